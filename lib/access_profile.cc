@@ -0,0 +1,165 @@
+// Copyright 2021 Google LLC
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "access_profile.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <charconv>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "error.h"
+#include "log.h"
+#include "path.h"
+#include "scoped_file.h"
+
+// First line of a profile file.
+static const std::string_view profile_header = "mount-zip access profile 1\n";
+
+void AccessProfile::Record(const i64 id,
+                           const std::string_view path,
+                           const off_t offset,
+                           const off_t size) {
+  if (id < 0 || offset < 0 || size <= 0)
+    return;
+
+  const std::lock_guard lock(mutex_);
+  const auto [it, added] = last_.try_emplace(id, ranges_.size());
+  if (!added) {
+    // Extend the last range of this file if it overlaps or touches this read.
+    Range& r = ranges_[it->second];
+    if (offset >= r.offset && offset <= r.offset + r.size) {
+      r.size = std::max(r.size, offset + size - r.offset);
+      return;
+    }
+
+    it->second = ranges_.size();
+  }
+
+  ranges_.push_back(
+      {.id = id, .path = std::string(path), .offset = offset, .size = size});
+}
+
+std::vector<AccessProfile::Range> AccessProfile::ranges() const {
+  const std::lock_guard lock(mutex_);
+  return ranges_;
+}
+
+void AccessProfile::Save(const char* const path) const {
+  assert(path);
+  try {
+    std::string contents(profile_header);
+    i64 count = 0;
+    for (const Range& r : ranges()) {
+      // A path containing a newline cannot be saved.
+      if (r.path.find('\n') != std::string::npos)
+        continue;
+
+      // Not using StrCat, since the global locale adds thousands separators.
+      contents += std::to_string(r.id);
+      contents += ' ';
+      contents += std::to_string(r.offset);
+      contents += ' ';
+      contents += std::to_string(r.size);
+      contents += ' ';
+      contents += r.path;
+      contents += '\n';
+      ++count;
+    }
+
+    // Write to a temporary file, and rename it once complete.
+    const std::string tmp_path = StrCat(path, ".", getpid(), ".tmp");
+    const ScopedFile file(open(tmp_path.c_str(),
+                               O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+    if (!file.IsValid())
+      ThrowSystemError("Cannot create ", Path(tmp_path));
+
+    try {
+      for (std::string_view data = contents; !data.empty();) {
+        const ssize_t n = write(file.GetDescriptor(), data.data(), data.size());
+        if (n < 0) {
+          if (errno == EINTR)
+            continue;
+          ThrowSystemError("Cannot write ", Path(tmp_path));
+        }
+
+        data.remove_prefix(n);
+      }
+
+      if (rename(tmp_path.c_str(), path) < 0)
+        ThrowSystemError("Cannot rename ", Path(tmp_path));
+    } catch (...) {
+      unlink(tmp_path.c_str());
+      throw;
+    }
+
+    LOG(DEBUG) << "Saved " << count << " ranges to access profile "
+               << Path(path);
+  } catch (const std::exception& e) {
+    LOG(ERROR) << "Cannot save access profile " << Path(path) << ": "
+               << e.what();
+  }
+}
+
+// Parses the integer at the start of |s|, followed by a space, and removes
+// them from |s|. Throws an std::runtime_error in case of error.
+static i64 ParseInt(std::string_view* const s) {
+  i64 n;
+  const auto [p, err] = std::from_chars(s->data(), s->data() + s->size(), n);
+  if (err != std::errc() || p == s->data() + s->size() || *p != ' ')
+    throw std::runtime_error("Bad number");
+
+  s->remove_prefix(p + 1 - s->data());
+  return n;
+}
+
+std::vector<AccessProfile::Range> AccessProfile::Load(const char* const path) {
+  assert(path);
+  const FileMapping mapping(path);
+  std::string_view contents(static_cast<const char*>(mapping.data()),
+                            mapping.size());
+  if (!contents.starts_with(profile_header))
+    throw std::runtime_error("Unsupported format");
+
+  contents.remove_prefix(profile_header.size());
+
+  std::vector<Range> ranges;
+  while (!contents.empty()) {
+    const size_t i = contents.find('\n');
+    if (i == std::string_view::npos)
+      throw std::runtime_error("Truncated line");
+
+    std::string_view line = contents.substr(0, i);
+    contents.remove_prefix(i + 1);
+
+    Range r;
+    r.id = ParseInt(&line);
+    r.offset = ParseInt(&line);
+    r.size = ParseInt(&line);
+    r.path = line;
+    if (r.id < 0 || r.offset < 0 || r.size <= 0)
+      throw std::runtime_error("Bad range");
+
+    ranges.push_back(std::move(r));
+  }
+
+  LOG(DEBUG) << "Loaded " << ranges.size() << " ranges from access profile "
+             << Path(path);
+  return ranges;
+}
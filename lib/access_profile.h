@@ -0,0 +1,71 @@
+// Copyright 2021 Google LLC
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef ACCESS_PROFILE_H
+#define ACCESS_PROFILE_H
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/types.h>
+
+using i64 = std::int64_t;
+
+// Byte ranges read from the files of a ZIP archive, in the order in which they
+// were first read. Each file is identified by the index and the original path
+// of its entry in the ZIP archive. Contiguous reads of a same file are merged
+// into a single range.
+//
+// The profile is saved as a text file starting with a header line, followed
+// by a line "id offset size path" per range. This class is thread-safe.
+class AccessProfile {
+ public:
+  struct Range {
+    i64 id;
+    std::string path;
+    off_t offset;
+    off_t size;
+  };
+
+  // Records a read of |size| bytes at |offset| in the file at index |id|.
+  void Record(i64 id, std::string_view path, off_t offset, off_t size);
+
+  // Gets the recorded ranges.
+  std::vector<Range> ranges() const;
+
+  // Saves the recorded ranges to the file at |path|. Logs an error if they
+  // cannot be saved.
+  void Save(const char* path) const;
+
+  // Loads the ranges saved in the file at |path|.
+  // Throws an std::runtime_error in case of error.
+  static std::vector<Range> Load(const char* path);
+
+ private:
+  // Mutex protecting the following members.
+  mutable std::mutex mutex_;
+
+  // Recorded ranges.
+  std::vector<Range> ranges_;
+
+  // Position in |ranges_| of the last range of each file.
+  std::unordered_map<i64, size_t> last_;
+};
+
+#endif  // ACCESS_PROFILE_H
@@ -0,0 +1,449 @@
+// Copyright 2021 Google LLC
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "archive_file.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "path.h"
+#include "stats.h"
+
+// Reads a little-endian integer of type T.
+template <typename T>
+static T Get(const char* const p) {
+  T x = 0;
+  for (size_t i = sizeof(T); i-- > 0;)
+    x = (x << 8) | static_cast<unsigned char>(p[i]);
+  return x;
+}
+
+static uint16_t Get16(const char* const p) {
+  return Get<uint16_t>(p);
+}
+
+static uint32_t Get32(const char* const p) {
+  return Get<uint32_t>(p);
+}
+
+static uint64_t Get64(const char* const p) {
+  return Get<uint64_t>(p);
+}
+
+// Signatures and sizes of the ZIP records.
+static const uint32_t local_header_signature = 0x04034b50;
+static const ssize_t local_header_size = 30;
+static const uint32_t central_header_signature = 0x02014b50;
+static const ssize_t central_header_size = 46;
+static const uint32_t eocd_signature = 0x06054b50;
+static const ssize_t eocd_size = 22;
+static const uint32_t eocd64_locator_signature = 0x07064b50;
+static const ssize_t eocd64_locator_size = 20;
+static const uint32_t eocd64_signature = 0x06064b50;
+static const ssize_t eocd64_size = 56;
+
+ArchiveFile::ArchiveFile(const char* const path)
+    : file_(open(path, O_RDONLY | O_CLOEXEC)) {
+  if (!file_.IsValid()) {
+    // The ZIP archive is opened by libzip too, which reports the error.
+    PLOG(DEBUG) << "Cannot open " << Path(path);
+    return;
+  }
+
+  struct stat st;
+  if (fstat(fd(), &st) < 0) {
+    PLOG(ERROR) << "Cannot stat " << Path(path);
+    return;
+  }
+
+  size_ = st.st_size;
+}
+
+bool ArchiveFile::ReadAt(char* dest, ssize_t size, off_t offset) const {
+  while (size > 0) {
+    const ssize_t n = pread(fd(), dest, size, offset);
+    if (n < 0 && errno == EINTR)
+      continue;
+
+    if (n < 0) {
+      PLOG(ERROR) << "Cannot read " << size << " bytes from ZIP archive at "
+                  << offset;
+      return false;
+    }
+
+    if (n == 0)
+      return false;
+
+    dest += n;
+    size -= n;
+    offset += n;
+  }
+
+  return true;
+}
+
+void ArchiveFile::ReadCentralDirectory() const {
+  if (size_ < eocd_size)
+    return;
+
+  // Find the end of central directory record. It is followed by a comment of
+  // up to 64 KB, and it can be preceded by a ZIP64 locator.
+  const off_t tail_size =
+      std::min<off_t>(size_, eocd64_locator_size + eocd_size + 0xFFFF);
+  std::vector<char> tail(tail_size);
+  if (!ReadAt(tail.data(), tail_size, size_ - tail_size))
+    return;
+
+  // Prefer a record whose comment ends exactly at the end of the file, since
+  // the comment itself could contain a signature.
+  ssize_t i = -1;
+  for (ssize_t j = tail_size - eocd_size; j >= 0; --j) {
+    if (Get32(&tail[j]) != eocd_signature)
+      continue;
+
+    if (i < 0)
+      i = j;
+
+    if (j + eocd_size + Get16(&tail[j + 20]) == tail_size) {
+      i = j;
+      break;
+    }
+  }
+
+  if (i < 0) {
+    LOG(DEBUG) << "Cannot find the end of central directory record";
+    return;
+  }
+
+  const char* const eocd = &tail[i];
+  uint64_t count = Get16(eocd + 10);
+  uint64_t cd_size = Get32(eocd + 12);
+  uint64_t cd_offset = Get32(eocd + 16);
+
+  if (count == 0xFFFF || cd_size == 0xFFFFFFFF || cd_offset == 0xFFFFFFFF) {
+    const char* const locator = eocd - eocd64_locator_size;
+    if (i < eocd64_locator_size ||
+        Get32(locator) != eocd64_locator_signature) {
+      LOG(DEBUG) << "Cannot find the ZIP64 end of central directory locator";
+      return;
+    }
+
+    char eocd64[eocd64_size];
+    if (!ReadAt(eocd64, eocd64_size, Get64(locator + 8)) ||
+        Get32(eocd64) != eocd64_signature) {
+      LOG(DEBUG) << "Cannot read the ZIP64 end of central directory record";
+      return;
+    }
+
+    count = Get64(eocd64 + 32);
+    cd_size = Get64(eocd64 + 40);
+    cd_offset = Get64(eocd64 + 48);
+  }
+
+  if (cd_offset > size_ || cd_size > size_ - cd_offset ||
+      count > cd_size / central_header_size) {
+    LOG(DEBUG) << "Invalid central directory: " << count << " entries, "
+               << cd_size << " bytes at " << cd_offset;
+    return;
+  }
+
+  // Read the central directory in chunks of at least 1 MB.
+  std::vector<char> buffer;
+  off_t buffer_offset = 0;
+  off_t pos = cd_offset;
+  const off_t end = cd_offset + cd_size;
+
+  // Gets the |n| bytes at |pos|, or null if they cannot be read.
+  const auto fetch = [&](const ssize_t n) -> const char* {
+    if (n > end - pos)
+      return nullptr;
+
+    if (pos < buffer_offset || pos + n > buffer_offset + buffer.size()) {
+      const ssize_t m =
+          std::min<off_t>(std::max<ssize_t>(n, 1 << 20), end - pos);
+      buffer.resize(m);
+      if (!ReadAt(buffer.data(), m, pos))
+        return nullptr;
+      buffer_offset = pos;
+    }
+
+    return &buffer[pos - buffer_offset];
+  };
+
+  std::vector<off_t> offsets;
+  offsets.reserve(count);
+
+  for (uint64_t k = 0; k < count; ++k) {
+    const char* const header = fetch(central_header_size);
+    if (!header || Get32(header) != central_header_signature) {
+      LOG(DEBUG) << "Invalid central directory header at " << pos;
+      return;
+    }
+
+    const uint32_t comp_size = Get32(header + 20);
+    const uint32_t size = Get32(header + 24);
+    const ssize_t name_size = Get16(header + 28);
+    const ssize_t extra_size = Get16(header + 30);
+    const ssize_t comment_size = Get16(header + 32);
+    uint64_t offset = Get32(header + 42);
+    pos += central_header_size;
+
+    if (offset == 0xFFFFFFFF) {
+      // Get the actual offset from the ZIP64 extra field.
+      const char* p = fetch(name_size + extra_size);
+      if (!p)
+        return;
+
+      p += name_size;
+      const char* const extra_end = p + extra_size;
+      while (extra_end - p >= 4) {
+        const uint16_t id = Get16(p);
+        const ssize_t n = Get16(p + 2);
+        p += 4;
+        if (n > extra_end - p)
+          break;
+
+        if (id == 0x0001) {
+          const char* q = p;
+          if (size == 0xFFFFFFFF)
+            q += 8;
+          if (comp_size == 0xFFFFFFFF)
+            q += 8;
+          if (q + 8 <= p + n)
+            offset = Get64(q);
+          break;
+        }
+
+        p += n;
+      }
+    }
+
+    pos += name_size + extra_size + comment_size;
+    offsets.push_back(static_cast<off_t>(offset));
+  }
+
+  LOG(DEBUG) << "Read " << offsets.size() << " entries from the central "
+             << "directory";
+  local_header_offsets_ = std::move(offsets);
+}
+
+off_t ArchiveFile::GetDataOffset(const i64 id,
+                                 const std::string_view name,
+                                 const off_t size) const {
+  if (!file_.IsValid())
+    return -1;
+
+  std::call_once(once_, [this] { ReadCentralDirectory(); });
+  if (id < 0 || id >= local_header_offsets_.size())
+    return -1;
+
+  const off_t offset = local_header_offsets_[id];
+  if (offset < 0 || offset > size_)
+    return -1;
+
+  char header[local_header_size];
+  if (!ReadAt(header, local_header_size, offset) ||
+      Get32(header) != local_header_signature)
+    return -1;
+
+  const ssize_t name_size = Get16(header + 26);
+  const ssize_t extra_size = Get16(header + 28);
+  if (name_size != name.size())
+    return -1;
+
+  std::string local_name(name_size, '\0');
+  if (!ReadAt(local_name.data(), name_size, offset + local_header_size) ||
+      local_name != name)
+    return -1;
+
+  const off_t data_offset =
+      offset + local_header_size + name_size + extra_size;
+  if (data_offset > size_ || size > size_ - data_offset)
+    return -1;
+
+  return data_offset;
+}
+
+struct ArchiveFile::Source {
+  const ArchiveFile& archive;
+
+  // Size of the chunks read ahead.
+  const ssize_t read_ahead;
+
+  // Last error.
+  zip_error_t error;
+
+  // Current position in the ZIP archive.
+  off_t pos = 0;
+
+  // Latest chunk read from the ZIP archive, and its position.
+  std::vector<char> chunk;
+  off_t chunk_offset = 0;
+
+  // Asks the system to start reading the chunk at |offset| in the background.
+  void ReadAhead(const off_t offset) const {
+#ifdef POSIX_FADV_WILLNEED
+    if (offset < archive.size_)
+      posix_fadvise(archive.fd(), offset,
+                    std::min<off_t>(read_ahead, archive.size_ - offset),
+                    POSIX_FADV_WILLNEED);
+#else
+    (void)offset;
+#endif
+  }
+
+  // Reads up to |len| bytes at the current position into |dest|. Returns the
+  // number of bytes read, which is only less than |len| at the end of the ZIP
+  // archive, or -1 in case of error.
+  zip_int64_t Read(char* dest, zip_uint64_t len) {
+    if (pos >= archive.size_)
+      return 0;
+
+    len = std::min<zip_uint64_t>(len, archive.size_ - pos);
+    const char* const start = dest;
+    char* const end = dest + len;
+
+    while (dest < end) {
+      const ssize_t n = end - dest;
+      if (pos >= chunk_offset && pos < chunk_offset + chunk.size()) {
+        const ssize_t m =
+            std::min<ssize_t>(n, chunk_offset + chunk.size() - pos);
+        std::memcpy(dest, &chunk[pos - chunk_offset], m);
+        dest += m;
+        pos += m;
+        continue;
+      }
+
+      // Read big requests straight into the destination buffer.
+      const bool direct = n >= read_ahead;
+      const ssize_t m =
+          direct ? n : std::min<off_t>(read_ahead, archive.size_ - pos);
+      if (!direct)
+        chunk.resize(m);
+
+      if (!archive.ReadAt(direct ? dest : chunk.data(), m, pos)) {
+        chunk.clear();
+        zip_error_set(&error, ZIP_ER_READ, EIO);
+        return -1;
+      }
+
+      Count(g_stats.archive_reads);
+      Count(g_stats.archive_read_bytes, m);
+      ReadAhead(pos + m);
+
+      if (direct) {
+        dest += m;
+        pos += m;
+      } else {
+        chunk_offset = pos;
+      }
+    }
+
+    return dest - start;
+  }
+};
+
+zip_source_t* ArchiveFile::MakeSource(const ssize_t read_ahead,
+                                      zip_error_t* const error) const {
+  assert(read_ahead > 0);
+  assert(error);
+  if (!file_.IsValid()) {
+    zip_error_set(error, ZIP_ER_OPEN, EBADF);
+    return nullptr;
+  }
+
+  Source* const source = new Source{.archive = *this, .read_ahead = read_ahead};
+  zip_error_init(&source->error);
+  zip_source_t* const p =
+      zip_source_function_create(SourceCallback, source, error);
+  if (!p) {
+    zip_error_fini(&source->error);
+    delete source;
+  }
+
+  return p;
+}
+
+zip_int64_t ArchiveFile::SourceCallback(void* const state,
+                                        void* const data,
+                                        const zip_uint64_t len,
+                                        const zip_source_cmd_t cmd) {
+  assert(state);
+  Source& source = *static_cast<Source*>(state);
+  switch (cmd) {
+    case ZIP_SOURCE_OPEN:
+      source.pos = 0;
+      return 0;
+
+    case ZIP_SOURCE_READ:
+      return source.Read(static_cast<char*>(data), len);
+
+    case ZIP_SOURCE_CLOSE:
+      source.chunk = {};
+      return 0;
+
+    case ZIP_SOURCE_STAT: {
+      zip_stat_t* const st =
+          ZIP_SOURCE_GET_ARGS(zip_stat_t, data, len, &source.error);
+      if (!st)
+        return -1;
+
+      zip_stat_init(st);
+      st->size = source.archive.size_;
+      st->comp_size = source.archive.size_;
+      st->valid |= ZIP_STAT_SIZE | ZIP_STAT_COMP_SIZE;
+      return sizeof(*st);
+    }
+
+    case ZIP_SOURCE_ERROR:
+      return zip_error_to_data(&source.error, data, len);
+
+    case ZIP_SOURCE_FREE:
+      zip_error_fini(&source.error);
+      delete &source;
+      return 0;
+
+    case ZIP_SOURCE_SEEK: {
+      const zip_int64_t pos = zip_source_seek_compute_offset(
+          source.pos, source.archive.size_, data, len, &source.error);
+      if (pos < 0)
+        return -1;
+
+      source.pos = pos;
+      return 0;
+    }
+
+    case ZIP_SOURCE_TELL:
+      return source.pos;
+
+    case ZIP_SOURCE_SUPPORTS:
+      return zip_source_make_command_bitmap(
+          ZIP_SOURCE_OPEN, ZIP_SOURCE_READ, ZIP_SOURCE_CLOSE, ZIP_SOURCE_STAT,
+          ZIP_SOURCE_ERROR, ZIP_SOURCE_FREE, ZIP_SOURCE_SEEK, ZIP_SOURCE_TELL,
+          ZIP_SOURCE_SUPPORTS, -1);
+
+    default:
+      zip_error_set(&source.error, ZIP_ER_OPNOTSUPP, 0);
+      return -1;
+  }
+}
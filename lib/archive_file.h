@@ -0,0 +1,95 @@
+// Copyright 2021 Google LLC
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef ARCHIVE_FILE_H
+#define ARCHIVE_FILE_H
+
+#include <cstdint>
+#include <mutex>
+#include <string_view>
+#include <vector>
+
+#include <sys/types.h>
+
+#include <zip.h>
+
+#include "scoped_file.h"
+
+using i64 = std::int64_t;
+
+// Direct read-only access to the ZIP archive file, bypassing libzip. This is
+// used to read the data of the files that are stored without compression
+// straight from the ZIP archive. This can also provide libzip with
+// the data of the ZIP archive, read ahead in big chunks.
+//
+// The positions of the local headers are read from the central directory the
+// first time they are needed. This class is thread-safe.
+class ArchiveFile {
+ public:
+  // Opens the ZIP archive at |path|. Returns an ArchiveFile providing no data
+  // offsets nor source if the file cannot be opened.
+  explicit ArchiveFile(const char* path);
+
+  ArchiveFile(const ArchiveFile&) = delete;
+  ArchiveFile& operator=(const ArchiveFile&) = delete;
+
+  // File descriptor of the ZIP archive, or -1.
+  int fd() const { return file_.GetDescriptor(); }
+
+  // Gets the position of the data of the entry at index |id| in the ZIP
+  // archive. Checks that the local header of this entry has the given raw
+  // |name|, and that the archive is big enough to hold |size| bytes of data.
+  // Returns -1 if the position cannot be determined.
+  off_t GetDataOffset(i64 id, std::string_view name, off_t size) const;
+
+  // Makes a libzip source reading the ZIP archive through the file descriptor
+  // of this ArchiveFile, in chunks of |read_ahead| bytes. Once a chunk has
+  // been read, the system is asked to start reading the next one in the
+  // background, so that the reads of the archive overlap with the
+  // decompression of the data. The returned source must be used by a single
+  // thread at a time, and must not outlive this ArchiveFile. Returns null and
+  // fills |error| if the ZIP archive couldn't be opened.
+  zip_source_t* MakeSource(ssize_t read_ahead, zip_error_t* error) const;
+
+  // Reads |size| bytes at |offset| in the ZIP archive into |dest|. Returns
+  // false if the data cannot be read completely.
+  bool ReadAt(char* dest, ssize_t size, off_t offset) const;
+
+ private:
+  // Reads the central directory and fills |local_header_offsets_|.
+  // Leaves |local_header_offsets_| empty in case of error.
+  void ReadCentralDirectory() const;
+
+  // State of a source made by MakeSource().
+  struct Source;
+
+  // Callback of the sources made by MakeSource().
+  static zip_int64_t SourceCallback(void* state,
+                                    void* data,
+                                    zip_uint64_t len,
+                                    zip_source_cmd_t cmd);
+
+  // ZIP archive file.
+  const ScopedFile file_;
+
+  // Size of the ZIP archive file.
+  off_t size_ = 0;
+
+  // Positions of the local headers, indexed by entry index. Filled once.
+  mutable std::once_flag once_;
+  mutable std::vector<off_t> local_header_offsets_;
+};
+
+#endif  // ARCHIVE_FILE_H
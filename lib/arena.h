@@ -0,0 +1,140 @@
+// Copyright 2021 Google LLC
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+// Allocates objects of type T in contiguous blocks rather than one by one on
+// the heap. The objects never move, and they are all destructed at once by
+// Clear() or by the destructor of the Arena. Not thread-safe.
+template <typename T>
+class Arena {
+ public:
+  Arena() = default;
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+  ~Arena() { Clear(); }
+
+  // Constructs a new object in place from the value returned by |make()|.
+  // Since |make()| returns a prvalue, the object is not copied nor moved, and
+  // it can hold pointers to itself.
+  template <typename F>
+  T* New(F&& make) {
+    if (blocks_.empty() || blocks_.back().size == blocks_.back().capacity)
+      AddBlock();
+
+    Block& block = blocks_.back();
+    T* const p = new (&block.slots[block.size]) T(make());
+    ++block.size;
+    ++size_;
+    return p;
+  }
+
+  // Destructs all the objects.
+  void Clear() {
+    while (!blocks_.empty()) {
+      Block& block = blocks_.back();
+      while (block.size > 0)
+        std::destroy_at(block.get(--block.size));
+      blocks_.pop_back();
+    }
+
+    size_ = 0;
+  }
+
+  // Number of objects in this arena.
+  size_t size() const { return size_; }
+
+ private:
+  // Uninitialized storage for one object.
+  struct alignas(T) Slot {
+    std::byte bytes[sizeof(T)];
+  };
+
+  struct Block {
+    std::unique_ptr<Slot[]> slots;
+    size_t capacity;
+    size_t size = 0;
+
+    T* get(size_t i) { return std::launder(reinterpret_cast<T*>(&slots[i])); }
+  };
+
+  // Adds a new block, twice as big as the previous one up to a limit.
+  void AddBlock() {
+    const size_t capacity =
+        blocks_.empty() ? 16 : std::min<size_t>(blocks_.back().capacity * 2,
+                                                16 * 1024);
+    blocks_.push_back(
+        {.slots = std::make_unique_for_overwrite<Slot[]>(capacity),
+         .capacity = capacity});
+  }
+
+  std::vector<Block> blocks_;
+  size_t size_ = 0;
+};
+
+// Stores strings contiguously in large blocks. The stored strings never move
+// until Clear() is called or the StringPool is destructed. Not thread-safe.
+class StringPool {
+ public:
+  StringPool() = default;
+  StringPool(const StringPool&) = delete;
+  StringPool& operator=(const StringPool&) = delete;
+
+  // Adds a copy of |s| followed by a NUL terminator.
+  std::string_view Add(const std::string_view s) {
+    const size_t n = s.size() + 1;
+    if (n > capacity_ - size_) {
+      capacity_ = std::max(n, block_size_);
+      blocks_.push_back(std::make_unique_for_overwrite<char[]>(capacity_));
+      size_ = 0;
+    }
+
+    char* const p = blocks_.back().get() + size_;
+    std::memcpy(p, s.data(), s.size());
+    p[s.size()] = '\0';
+    size_ += n;
+    return {p, s.size()};
+  }
+
+  // Removes all the strings.
+  void Clear() {
+    blocks_.clear();
+    capacity_ = 0;
+    size_ = 0;
+  }
+
+ private:
+  // Default size of a block.
+  static constexpr size_t block_size_ = 64 * 1024;
+
+  std::vector<std::unique_ptr<char[]>> blocks_;
+
+  // Capacity of the last block.
+  size_t capacity_ = 0;
+
+  // Number of bytes used in the last block.
+  size_t size_ = 0;
+};
+
+#endif  // ARENA_H
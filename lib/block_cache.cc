@@ -0,0 +1,152 @@
+// Copyright 2021 Google LLC
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "block_cache.h"
+
+#include <algorithm>
+#include <cassert>
+#include <functional>
+
+#include "stats.h"
+
+bool BlockCache::Get(const Key& key, Block* const block) {
+  assert(block);
+  const std::lock_guard lock(mutex_);
+  const auto it = blocks_.find(key);
+  if (it == blocks_.end())
+    return false;
+
+  const i64 i = it->second;
+  Slot& slot = slots_[i];
+  assert(slot.used);
+  lru_.splice(lru_.begin(), lru_, slot.lru);
+  ++slot.pins;
+  block->slot = i;
+  block->size = slot.size;
+  return true;
+}
+
+i64 BlockCache::Reserve() {
+  const std::lock_guard lock(mutex_);
+
+  if (!free_.empty()) {
+    std::pop_heap(free_.begin(), free_.end(), std::greater());
+    const i64 i = free_.back();
+    free_.pop_back();
+    assert(!slots_[i].used);
+    assert(slots_[i].pins == 0);
+    slots_[i].pins = 1;
+    return i;
+  }
+
+  if (max_slots_ == 0 || slots_.size() < max_slots_) {
+    slots_.emplace_back().pins = 1;
+    return slots_.size() - 1;
+  }
+
+  // Evict the least recently used block that isn't pinned.
+  for (auto it = lru_.rbegin(); it != lru_.rend(); ++it) {
+    const i64 i = *it;
+    Slot& slot = slots_[i];
+    assert(slot.used);
+    if (slot.pins > 0)
+      continue;
+
+    blocks_.erase(slot.key);
+    lru_.erase(slot.lru);
+    slot.used = false;
+    slot.pins = 1;
+    Count(g_stats.cache_evictions);
+    return i;
+  }
+
+  // All the blocks are pinned.
+  slots_.emplace_back().pins = 1;
+  return slots_.size() - 1;
+}
+
+void BlockCache::Put(const Key& key, const i64 i, const ssize_t size) {
+  assert(size >= 0);
+  assert(size <= block_size);
+  const std::lock_guard lock(mutex_);
+  Slot& slot = slots_[i];
+  assert(!slot.used);
+  assert(slot.pins > 0);
+  const bool inserted = blocks_.try_emplace(key, i).second;
+  assert(inserted);
+  (void)inserted;
+  slot.key = key;
+  slot.used = true;
+  slot.size = size;
+  lru_.push_front(i);
+  slot.lru = lru_.begin();
+}
+
+void BlockCache::Release(const i64 i) {
+  {
+    const std::lock_guard lock(mutex_);
+    Slot& slot = slots_[i];
+    assert(slot.pins > 0);
+    --slot.pins;
+    if (slot.used || slot.pins > 0)
+      return;
+  }
+
+  Free(i);
+}
+
+void BlockCache::Remove(const Key& key) {
+  i64 i;
+  {
+    const std::lock_guard lock(mutex_);
+    const auto it = blocks_.find(key);
+    if (it == blocks_.end())
+      return;
+
+    i = it->second;
+    blocks_.erase(it);
+    Slot& slot = slots_[i];
+    assert(slot.used);
+    lru_.erase(slot.lru);
+    slot.used = false;
+    if (slot.pins > 0)
+      return;
+  }
+
+  Free(i);
+}
+
+void BlockCache::Free(const i64 i) {
+  // Nothing refers to this slot anymore, and it cannot be reserved before it
+  // is added to the free slots.
+  if (free_slot_)
+    free_slot_(i);
+
+  const std::lock_guard lock(mutex_);
+  assert(!slots_[i].used);
+  assert(slots_[i].pins == 0);
+  free_.push_back(i);
+  std::push_heap(free_.begin(), free_.end(), std::greater());
+}
+
+i64 BlockCache::slot_count() const {
+  const std::lock_guard lock(mutex_);
+  return slots_.size();
+}
+
+i64 BlockCache::block_count() const {
+  const std::lock_guard lock(mutex_);
+  return blocks_.size();
+}
@@ -0,0 +1,162 @@
+// Copyright 2021 Google LLC
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <sys/types.h>
+
+using i64 = std::int64_t;
+
+// Keeps track of the blocks of decompressed data stored in the cache file.
+//
+// The cache file is divided into slots of |block_size| bytes. Each slot holds
+// one block of a cached file. Once the number of slots reaches the budget, the
+// least recently used block is evicted and its slot is reused for a new block.
+//
+// A block is pinned while it is being written or read, and a pinned block is
+// never evicted. A slot becomes free when its block is removed, and the free
+// slot with the lowest index is reused first, so that the used part of the
+// cache file stays compact. This class only does the bookkeeping: the caller
+// reads and writes the data in the cache file, and can give the space of the
+// free slots back to the system. It is thread-safe.
+class BlockCache {
+ public:
+  // Size of a block.
+  static constexpr off_t block_size = 1 << 20;
+
+  // Identifies a block.
+  struct Key {
+    // ID of the cached file.
+    i64 file;
+
+    // Index of the block in the cached file.
+    i64 index;
+
+    bool operator==(const Key&) const = default;
+  };
+
+  // Pinned block.
+  struct Block {
+    // Index of the slot holding the block.
+    i64 slot;
+
+    // Number of bytes in the block, which can be less than |block_size|
+    // for the last block of a file.
+    ssize_t size;
+  };
+
+  // Function called with the index of a slot that is about to become free.
+  // Called without holding any lock.
+  using FreeSlot = std::function<void(i64 slot)>;
+
+  // Creates a BlockCache using at most |max_slots| slots, or an unlimited
+  // number of slots if |max_slots| is 0. Calls |free_slot| (if any) each time
+  // a slot becomes free.
+  explicit BlockCache(i64 max_slots = 0, FreeSlot free_slot = {})
+      : max_slots_(max_slots), free_slot_(std::move(free_slot)) {}
+
+  BlockCache(const BlockCache&) = delete;
+  BlockCache& operator=(const BlockCache&) = delete;
+
+  // Looks up the block |key|. If it is cached, marks it as the most recently
+  // used block, pins it, stores it in |*block| and returns true.
+  bool Get(const Key& key, Block* block);
+
+  // Gets a slot to store a new block. Returns a free slot if any, or a new
+  // slot if the budget allows it, or the slot of the least recently used
+  // block that is not pinned, which is evicted. Goes over budget if all the
+  // blocks are pinned. The returned slot is pinned.
+  i64 Reserve();
+
+  // Stores the block |key| of |size| bytes in the given |slot|, which must
+  // have been returned by Reserve(). The slot stays pinned.
+  void Put(const Key& key, i64 slot, ssize_t size);
+
+  // Unpins the given |slot|. A reserved slot that was not used by Put()
+  // becomes free again.
+  void Release(i64 slot);
+
+  // Removes the block |key| if it is cached. Its slot becomes free once it
+  // isn't pinned anymore.
+  void Remove(const Key& key);
+
+  // Number of slots, including the free ones.
+  i64 slot_count() const;
+
+  // Number of cached blocks.
+  i64 block_count() const;
+
+ private:
+  struct KeyHash {
+    size_t operator()(const Key& key) const {
+      size_t h = std::hash<i64>()(key.file);
+      h ^= std::hash<i64>()(key.index) + 0x9e3779b9 + (h << 6) + (h >> 2);
+      return h;
+    }
+  };
+
+  struct Slot {
+    // Cached block, if |used| is true.
+    Key key;
+    bool used = false;
+
+    // Number of bytes in the cached block.
+    ssize_t size = 0;
+
+    // Number of pins.
+    int pins = 0;
+
+    // Position in |lru_| if |used| is true.
+    std::list<i64>::iterator lru;
+  };
+
+  // Calls |free_slot_| and adds the given |slot| to the free slots.
+  // Precondition: |slot| doesn't hold any block and isn't pinned.
+  // Precondition: mutex_ is not held.
+  void Free(i64 slot);
+
+  // Maximum number of slots, or 0.
+  const i64 max_slots_;
+
+  // Called when a slot becomes free.
+  const FreeSlot free_slot_;
+
+  // Mutex protecting all the following members.
+  mutable std::mutex mutex_;
+
+  // All the slots. Indexed by slot number.
+  std::vector<Slot> slots_;
+
+  // Slots holding a block, from the most recently used to the least recently
+  // used.
+  std::list<i64> lru_;
+
+  // Free slots, as a min-heap.
+  std::vector<i64> free_;
+
+  // Cached blocks.
+  std::unordered_map<Key, i64, KeyHash> blocks_;
+};
+
+#endif  // BLOCK_CACHE_H
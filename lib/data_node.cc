@@ -15,11 +15,17 @@
 // You should have received a copy of the GNU General Public License
 // along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <ctime>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
 
 #include <zip.h>
+#include <zlib.h>
 
 #include "data_node.h"
 #include "error.h"
@@ -94,7 +100,7 @@ static void ProcessPkWareUnixField(DataNode* const node,
   // specified (empty file content)
   if (S_ISLNK(node->mode) && node->size == 0 && link_len > 0) {
     assert(link);
-    node->target.assign(link, link_len);
+    node->target = std::make_unique<const std::string>(link, link_len);
     node->size = link_len;
   }
 }
@@ -237,12 +243,111 @@ static bool ProcessExtraFields(DataNode* const node, zip_t* const zip) {
   return has_pkware_field;
 }
 
-DataNode DataNode::Make(zip_t* const zip, const i64 id, const mode_t mode) {
+// Checks if the given |file| opened from |zip| at index |id| is seekable.
+static bool IsSeekable(ZipHandle* const zip,
+                       [[maybe_unused]] const i64 id,
+                       [[maybe_unused]] zip_file_t* const file) {
   assert(zip);
+  const std::lock_guard lock(zip->mutex);
+
+#if LIBZIP_VERSION_MAJOR > 1 ||      \
+    LIBZIP_VERSION_MAJOR == 1 &&     \
+        (LIBZIP_VERSION_MINOR > 9 || \
+         LIBZIP_VERSION_MINOR == 9 && LIBZIP_VERSION_MICRO >= 1)
+  // For libzip >= 1.9.1
+  return zip_file_is_seekable(file) > 0;
+#else
+  // For libzip < 1.9.1
+  zip_stat_t st;
+  return zip_stat_index(zip->zip, id, 0, &st) == 0 &&
+         (st.valid & ZIP_STAT_COMP_METHOD) != 0 &&
+         st.comp_method == ZIP_CM_STORE &&
+         (st.valid & ZIP_STAT_ENCRYPTION_METHOD) != 0 &&
+         st.encryption_method == ZIP_EM_NONE;
+#endif
+}
+
+// Gets the description of the file at index |id|, with its raw name.
+// Throws ZipError in case of error.
+static zip_stat_t StatFile(ZipHandle* const zip, const i64 id) {
+  assert(zip);
+  const std::lock_guard lock(zip->mutex);
+  zip_stat_t st;
+  if (zip_stat_index(zip->zip, id, ZIP_FL_ENC_RAW, &st) < 0)
+    throw ZipError(StrCat("Cannot stat File [", id, "]"), zip->zip);
+  return st;
+}
+
+// Gets the position of the data of the file described by |st| in the ZIP
+// archive file, if this file is stored without compression nor encryption.
+// Returns -1 otherwise.
+static off_t GetDataOffset(ZipHandle* const zip, const zip_stat_t& st) {
+  assert(zip);
+  if (!zip->archive || (st.valid & ZIP_STAT_NAME) == 0 ||
+      (st.valid & ZIP_STAT_COMP_METHOD) == 0 ||
+      st.comp_method != ZIP_CM_STORE ||
+      (st.valid & ZIP_STAT_ENCRYPTION_METHOD) == 0 ||
+      st.encryption_method != ZIP_EM_NONE || (st.valid & ZIP_STAT_SIZE) == 0 ||
+      (st.valid & ZIP_STAT_COMP_SIZE) == 0 || st.comp_size != st.size)
+    return -1;
+
+  return zip->archive->GetDataOffset(st.index, st.name, st.size);
+}
+
+// Is the file described by |st| stored without compression and encrypted with
+// WinZip AES, so that it can be read by an AesReader? Always false if built
+// without WITH_OPENSSL.
+static bool IsStoredAes(ZipHandle* const zip, const zip_stat_t& st) {
+  assert(zip);
+  if (!WinZipAes::available || !zip->archive || !zip->password ||
+      zip->password->empty() || (st.valid & ZIP_STAT_NAME) == 0 ||
+      (st.valid & ZIP_STAT_COMP_METHOD) == 0 ||
+      st.comp_method != ZIP_CM_STORE ||
+      (st.valid & ZIP_STAT_ENCRYPTION_METHOD) == 0 ||
+      (st.valid & ZIP_STAT_SIZE) == 0 || (st.valid & ZIP_STAT_COMP_SIZE) == 0)
+    return false;
+
+  const ssize_t header_size = WinZipAes::GetHeaderSize(st.encryption_method);
+  return header_size > 0 &&
+         st.comp_size == st.size + header_size + WinZipAes::trailer_size;
+}
+
+// Creates a seek-point index if the file at index |id| is deflated without
+// encryption. Returns a null pointer otherwise.
+static std::shared_ptr<DeflateIndex> MakeDeflateIndex(ZipHandle* const zip,
+                                                      const i64 id) {
+  assert(zip);
+  const std::lock_guard lock(zip->mutex);
   zip_stat_t st;
-  if (zip_stat_index(zip, id, 0, &st) < 0)
-    throw ZipError("Cannot stat file", zip);
+  if (zip_stat_index(zip->zip, id, 0, &st) < 0 ||
+      (st.valid & ZIP_STAT_COMP_METHOD) == 0 ||
+      st.comp_method != ZIP_CM_DEFLATE ||
+      (st.valid & ZIP_STAT_ENCRYPTION_METHOD) == 0 ||
+      st.encryption_method != ZIP_EM_NONE || (st.valid & ZIP_STAT_CRC) == 0)
+    return nullptr;
+
+  return std::make_shared<DeflateIndex>(Reader::GetSeekSpan(), st.crc);
+}
+
+// Gets the seek-point index of the file at index |id|, shared by all its
+// readers. Creates it if necessary. Returns a null pointer if seek points are
+// disabled or if the file is not deflated.
+// Precondition: Reader::cache_mutex is held.
+static std::shared_ptr<DeflateIndex> GetDeflateIndex(
+    DataNode::Cache* const shared,
+    ZipHandle* const zip,
+    const i64 id) {
+  assert(shared);
+  if (!shared->deflate_index && Reader::GetSeekSpan() > 0)
+    shared->deflate_index = MakeDeflateIndex(zip, id);
+  return shared->deflate_index;
+}
 
+DataNode DataNode::Make(zip_t* const zip,
+                        const zip_stat_t& st,
+                        const mode_t mode,
+                        const bool lazy_attributes) {
+  assert(zip);
   // check that all used fields are valid
   [[maybe_unused]] const zip_uint64_t need_valid =
       ZIP_STAT_NAME | ZIP_STAT_INDEX | ZIP_STAT_SIZE | ZIP_STAT_MTIME;
@@ -250,8 +355,19 @@ DataNode DataNode::Make(zip_t* const zip, const i64 id, const mode_t mode) {
   // directories (see zip_stat_index.c from libzip)
   assert((st.valid & need_valid) == need_valid);
 
-  DataNode node{
-      .id = id, .mode = mode, .size = st.size, .mtime = {.tv_sec = st.mtime}};
+  DataNode node{.ino = 0,
+                .id = static_cast<i64>(st.index),
+                .mode = mode,
+                .size = st.size,
+                .mtime = {.tv_sec = st.mtime}};
+
+  // The other file types need their extra fields for their link target, their
+  // device number or their actual type.
+  if (lazy_attributes && (S_ISREG(mode) || S_ISDIR(mode))) {
+    node.attributes_pending = true;
+    return node;
+  }
+
   const bool has_pkware_field = ProcessExtraFields(&node, zip);
 
   // InfoZIP may produce FIFO-marked node with content, PkZip - can't.
@@ -261,6 +377,110 @@ DataNode DataNode::Make(zip_t* const zip, const i64 id, const mode_t mode) {
   return node;
 }
 
+void DataNode::LoadAttributes(ZipHandle* const zip) const {
+  if (!std::atomic_ref(attributes_pending).load(std::memory_order_acquire))
+    return;
+
+  // Serializes the decoding of the attributes of all the nodes, since they
+  // might be decoded with different ZIP archive handles.
+  static std::mutex mutex;
+  const std::lock_guard lock(mutex);
+  if (!std::atomic_ref(attributes_pending).load(std::memory_order_relaxed))
+    return;
+
+  assert(zip);
+  {
+    const std::lock_guard zip_lock(zip->mutex);
+    // This DataNode is only const for the callers, which cannot see the
+    // attributes before they are decoded.
+    ProcessExtraFields(const_cast<DataNode*>(this), zip->zip);
+  }
+
+  Count(g_stats.attribute_loads);
+  std::atomic_ref(attributes_pending).store(false, std::memory_order_release);
+}
+
+bool DataNode::Verify(ZipHandle* const zip,
+                      const FileNode& file_node,
+                      const std::atomic<bool>& stop) const {
+  assert(zip);
+  if (id < 0 || target)
+    return true;
+
+  const zip_stat_t st = StatFile(zip, id);
+
+  // The files encrypted with WinZip AES might have no CRC-32. They are checked
+  // with their authentication code instead.
+  const bool aes = (st.valid & ZIP_STAT_ENCRYPTION_METHOD) != 0 &&
+                   WinZipAes::GetHeaderSize(st.encryption_method) != 0;
+  if ((st.valid & ZIP_STAT_CRC) == 0 && !aes) {
+    LOG(DEBUG) << "Cannot verify " << file_node << ": No CRC-32";
+    return true;
+  }
+
+  // Read the files stored without encryption directly from the ZIP archive.
+  // Let libzip decompress and decrypt the other ones, which also checks their
+  // CRC-32 or their authentication code.
+  const off_t offset = GetDataOffset(zip, st);
+  ZipFile file;
+  if (offset < 0)
+    file = Reader::Open(zip, id);
+
+  const ssize_t buffer_size = 1 << 20;
+  const std::unique_ptr<char[]> buffer(new char[buffer_size]);
+  uLong crc = crc32(0, Z_NULL, 0);
+
+  const auto fail = [&](const std::string_view reason) {
+    LOG(ERROR) << "Corrupted " << file_node << ": " << reason;
+    Count(g_stats.corrupted_files);
+    std::atomic_ref(corrupted).store(true, std::memory_order_relaxed);
+    return false;
+  };
+
+  try {
+    for (off_t pos = 0; pos < static_cast<off_t>(size);) {
+      if (stop)
+        return true;
+
+      ssize_t n = std::min<off_t>(buffer_size, size - pos);
+      if (offset >= 0) {
+        if (!zip->archive->ReadAt(buffer.get(), n, offset + pos))
+          throw ZipError("Cannot read file", ZIP_ER_READ);
+      } else {
+        const std::lock_guard lock(zip->mutex);
+        n = static_cast<ssize_t>(zip_fread(file.get(), buffer.get(), n));
+        if (n < 0)
+          throw ZipError("Cannot read file", file.get());
+        if (n == 0)
+          throw ZipError("Cannot read file", ZIP_ER_INCONS);
+      }
+
+      crc = crc32(crc, reinterpret_cast<const Bytef*>(buffer.get()), n);
+      pos += n;
+      Count(g_stats.verified_bytes, n);
+    }
+
+    if (file) {
+      // Read up to the end of the data, where libzip checks the CRC-32 or the
+      // authentication code.
+      const std::lock_guard lock(zip->mutex);
+      const zip_int64_t n = zip_fread(file.get(), buffer.get(), 1);
+      if (n < 0)
+        throw ZipError("Cannot read file", file.get());
+      if (n > 0)
+        throw ZipError("Cannot read file", ZIP_ER_INCONS);
+    }
+  } catch (const ZipError& e) {
+    return fail(e.what());
+  }
+
+  if (!aes && crc != st.crc)
+    return fail("CRC-32 mismatch");
+
+  LOG(DEBUG) << "Verified " << file_node;
+  return true;
+}
+
 DataNode::operator Stat() const {
   Stat st = {};
   st.st_ino = ino;
@@ -310,82 +530,279 @@ DataNode::operator Stat() const {
   return st;
 }
 
-bool DataNode::CacheAll(zip_t* const zip,
+// Makes a function opening a new BufferedReader on the file |id|, for a
+// SharedReader detaching from the shared decompression stream.
+static SharedReader::Open MakeStreamOpener(
+    ZipHandle* const zip,
+    const i64 id,
+    const off_t size,
+    DataNode::Cache* const shared,
+    std::shared_ptr<DeflateIndex> index) {
+  assert(shared);
+  return [zip, id, size, shared, index = std::move(index)]() -> Reader::Ptr {
+    ZipFile file = Reader::Open(zip, id, index ? ZIP_FL_COMPRESSED : 0);
+    return Reader::Ptr(new BufferedReader(zip, std::move(file), id, size,
+                                          &shared->reader, index));
+  };
+}
+
+bool DataNode::CacheAll(ZipHandle* const zip,
                         const FileNode& file_node,
                         std::function<void(ssize_t)> progress) {
-  assert(!cached_reader);
+  assert(!cache || !cache->reader);
   if (size == 0) {
     LOG(DEBUG) << "No need to cache " << file_node << ": Empty file";
     return false;
   }
 
+  if (IsStoredAes(zip, StatFile(zip, id))) {
+    LOG(DEBUG) << "No need to cache " << file_node << ": Direct reads";
+    return false;
+  }
+
   ZipFile file = Reader::Open(zip, id);
   assert(file);
-
-#if LIBZIP_VERSION_MAJOR > 1 ||      \
-    LIBZIP_VERSION_MAJOR == 1 &&     \
-        (LIBZIP_VERSION_MINOR > 9 || \
-         LIBZIP_VERSION_MINOR == 9 && LIBZIP_VERSION_MICRO >= 1)
-  // For libzip >= 1.9.1
-  const bool seekable = zip_file_is_seekable(file.get()) > 0;
-#else
-  // For libzip < 1.9.1
-  zip_stat_t st;
-  const bool seekable = zip_stat_index(zip, id, 0, &st) == 0 &&
-                        (st.valid & ZIP_STAT_COMP_METHOD) != 0 &&
-                        st.comp_method == ZIP_CM_STORE &&
-                        (st.valid & ZIP_STAT_ENCRYPTION_METHOD) != 0 &&
-                        st.encryption_method == ZIP_EM_NONE;
-#endif
+  const bool seekable = IsSeekable(zip, id, file.get());
 
   if (seekable) {
     LOG(DEBUG) << "No need to cache " << file_node << ": File is seekable";
     return false;
   }
 
-  cached_reader = CacheFile(std::move(file), id, size, std::move(progress));
+  std::shared_ptr<DeflateIndex> index;
+  {
+    const std::lock_guard lock(Reader::cache_mutex);
+    index = GetDeflateIndex(&GetCache(), zip, id);
+  }
+
+  if (index) {
+    // Read the raw deflate data, and decompress it with zlib.
+    file = Reader::Open(zip, id, ZIP_FL_COMPRESSED);
+  }
+
+  Reader::Ptr reader = CacheFile(zip, std::move(file), id, size,
+                                 std::move(progress), std::move(index));
+  const std::lock_guard lock(Reader::cache_mutex);
+  GetCache().reader = std::move(reader);
   return true;
 }
 
-Reader::Ptr DataNode::GetReader(zip_t* const zip,
+DataNode::Cache::~Cache() {
+  const std::lock_guard lock(Reader::cache_mutex);
+  Reader::UntrackCachedReader(&reader);
+}
+
+DataNode::Cache& DataNode::GetCache() const {
+  if (!cache)
+    cache = std::make_unique<Cache>();
+  return *cache;
+}
+
+Reader::Ptr DataNode::GetReader(ZipHandle* const zip,
                                 const FileNode& file_node) const {
-  if (cached_reader) {
-    LOG(DEBUG) << *cached_reader << ": Reusing Cached " << *cached_reader
-               << " for " << file_node;
-    return cached_reader->AddRef();
+  if (std::atomic_ref(corrupted).load(std::memory_order_relaxed))
+    throw ZipError("File failed an integrity check", ZIP_ER_CRC);
+
+  SharedReader::Stream stream;
+  Cache* shared = nullptr;
+  std::shared_ptr<DeflateIndex> index;
+  {
+    const std::lock_guard lock(Reader::cache_mutex);
+    if (cache && cache->reader) {
+      LOG(DEBUG) << *cache->reader << ": Reusing Cached " << *cache->reader
+                 << " for " << file_node;
+      Reader::TouchCachedReader(&cache->reader);
+      return cache->reader->AddRef();
+    }
+
+    if (cache && cache->stream) {
+      if (Reader::Ptr p = cache->stream->TryAddRef()) {
+        stream.reset(static_cast<BufferedReader*>(p.release()));
+        shared = cache.get();
+        index = shared->deflate_index;
+      }
+    }
+  }
+
+  if (stream) {
+    Count(g_stats.shared_stream_attaches);
+    Reader::Ptr reader(new SharedReader(
+        std::move(stream), MakeStreamOpener(zip, id, size, shared, index)));
+    LOG(DEBUG) << *reader << ": Attached to the shared decompression stream of "
+               << file_node;
+    return reader;
   }
 
-  if (!target.empty())
-    return Reader::Ptr(new StringReader(target));
+  if (target)
+    return Reader::Ptr(new StringReader(*target));
+
+  const zip_stat_t st = StatFile(zip, id);
+  if (const off_t offset = GetDataOffset(zip, st); offset >= 0) {
+    Reader::Ptr reader(new DirectReader(zip->archive->fd(), offset, size));
+    LOG(DEBUG) << *reader << ": Opened " << file_node << ", direct = true";
+    return reader;
+  }
+
+  if (IsStoredAes(zip, st)) {
+    if (Reader::Ptr reader = GetAesReader(zip, st, file_node)) {
+      LOG(DEBUG) << *reader << ": Opened " << file_node << ", decrypted = true";
+      return reader;
+    }
+  }
 
   ZipFile file = Reader::Open(zip, id);
   assert(file);
+  const bool seekable = IsSeekable(zip, id, file.get());
 
-#if LIBZIP_VERSION_MAJOR > 1 ||      \
-    LIBZIP_VERSION_MAJOR == 1 &&     \
-        (LIBZIP_VERSION_MINOR > 9 || \
-         LIBZIP_VERSION_MINOR == 9 && LIBZIP_VERSION_MICRO >= 1)
-  // For libzip >= 1.9.1
-  const bool seekable = zip_file_is_seekable(file.get()) > 0;
-#else
-  // For libzip < 1.9.1
-  zip_stat_t st;
-  const bool seekable = zip_stat_index(zip, id, 0, &st) == 0 &&
-                        (st.valid & ZIP_STAT_COMP_METHOD) != 0 &&
-                        st.comp_method == ZIP_CM_STORE &&
-                        (st.valid & ZIP_STAT_ENCRYPTION_METHOD) != 0 &&
-                        st.encryption_method == ZIP_EM_NONE;
-#endif
+  if (seekable) {
+    Reader::Ptr reader(new UnbufferedReader(zip, std::move(file), id, size));
+    LOG(DEBUG) << *reader << ": Opened " << file_node << ", seekable = true";
+    return reader;
+  }
+
+  {
+    const std::lock_guard lock(Reader::cache_mutex);
+    shared = &GetCache();
+    index = GetDeflateIndex(shared, zip, id);
+  }
 
-  Reader::Ptr reader(seekable ? new UnbufferedReader(std::move(file), id, size)
-                              : new BufferedReader(zip, std::move(file), id,
-                                                   size, &cached_reader));
+  if (index) {
+    // Read the raw deflate data, and decompress it with zlib.
+    file = Reader::Open(zip, id, ZIP_FL_COMPRESSED);
+  }
 
-  LOG(DEBUG) << *reader << ": Opened " << file_node
-             << ", seekable = " << seekable;
+  stream.reset(new BufferedReader(zip, std::move(file), id, size,
+                                  &shared->reader, index));
+  {
+    const std::lock_guard lock(Reader::cache_mutex);
+    if (!shared->stream)
+      stream->Share(&shared->stream);
+  }
+
+  Reader::Ptr reader(new SharedReader(
+      std::move(stream), MakeStreamOpener(zip, id, size, shared, index)));
+  LOG(DEBUG) << *reader << ": Opened " << file_node << ", seekable = false";
   return reader;
 }
 
+Reader::Ptr DataNode::GetAesReader(ZipHandle* const zip,
+                                   const zip_stat_t& st,
+                                   const FileNode& file_node) const {
+  assert(zip);
+  assert(IsStoredAes(zip, st));
+  WinZipAes::Ptr aes;
+  off_t offset;
+  {
+    const std::lock_guard lock(Reader::cache_mutex);
+    const Cache& shared = GetCache();
+    aes = shared.aes;
+    offset = shared.aes_offset;
+  }
+
+  if (!aes) {
+    const ssize_t header_size = WinZipAes::GetHeaderSize(st.encryption_method);
+    const off_t header_offset =
+        zip->archive->GetDataOffset(id, st.name, st.comp_size);
+    if (header_offset < 0)
+      return nullptr;
+
+    std::string header(header_size, '\0');
+    if (!zip->archive->ReadAt(header.data(), header_size, header_offset))
+      return nullptr;
+
+    aes = WinZipAes::Make(st.encryption_method, *zip->password, header);
+    if (!aes)
+      return nullptr;
+
+    // The reads in random order cannot check the authentication code, which
+    // covers the whole data. Check it once, before serving any data.
+    offset = header_offset + header_size;
+    if (!aes->Authenticate(zip->archive->fd(), offset, size)) {
+      Count(g_stats.corrupted_files);
+      std::atomic_ref(corrupted).store(true, std::memory_order_relaxed);
+      throw ZipError(StrCat("Cannot authenticate ", file_node), ZIP_ER_CRC);
+    }
+
+    LOG(DEBUG) << "Authenticated " << file_node;
+    const std::lock_guard lock(Reader::cache_mutex);
+    Cache& shared = GetCache();
+    shared.aes = aes;
+    shared.aes_offset = offset;
+  }
+
+  return Reader::Ptr(new AesReader(zip->archive->fd(), offset, size,
+                                   aes->MakeDecryptor()));
+}
+
+bool DataNode::Warm(ZipHandle* const zip,
+                    const FileNode& file_node,
+                    const off_t offset,
+                    ssize_t count) const {
+  if (offset >= size || count <= 0)
+    return false;
+
+  count = std::min<off_t>(count, size - offset);
+
+  // Idle cached readers released to make room, deleted once cache_mutex is
+  // unlocked.
+  std::vector<Reader::Ptr> released;
+  Reader::Ptr reader;
+  {
+    const std::lock_guard lock(Reader::cache_mutex);
+    if (cache && cache->reader) {
+      reader = cache->reader->AddRef();
+      Reader::TouchCachedReader(&cache->reader);
+    }
+  }
+
+  if (!reader) {
+    if (target) {
+      LOG(DEBUG) << "No need to warm " << file_node << ": Direct reads";
+      return false;
+    }
+
+    if (const zip_stat_t st = StatFile(zip, id);
+        GetDataOffset(zip, st) >= 0 || IsStoredAes(zip, st)) {
+      LOG(DEBUG) << "No need to warm " << file_node << ": Direct reads";
+      return false;
+    }
+
+    ZipFile file = Reader::Open(zip, id);
+    assert(file);
+    if (IsSeekable(zip, id, file.get())) {
+      LOG(DEBUG) << "No need to warm " << file_node << ": File is seekable";
+      return false;
+    }
+
+    std::shared_ptr<DeflateIndex> index;
+    {
+      const std::lock_guard lock(Reader::cache_mutex);
+      index = GetDeflateIndex(&GetCache(), zip, id);
+    }
+
+    if (index) {
+      // Read the raw deflate data, and decompress it with zlib.
+      file = Reader::Open(zip, id, ZIP_FL_COMPRESSED);
+    }
+
+    Reader::Ptr p = MakeCachedReader(zip, std::move(file), id, size, index);
+    const std::lock_guard lock(Reader::cache_mutex);
+    Cache& shared = GetCache();
+    if (!shared.reader) {
+      shared.reader = std::move(p);
+      reader = shared.reader->AddRef();
+      Reader::TrackCachedReader(&shared.reader, &released);
+    } else {
+      reader = shared.reader->AddRef();
+    }
+  }
+
+  const std::unique_ptr<char[]> buffer =
+      std::make_unique_for_overwrite<char[]>(static_cast<size_t>(count));
+  reader->Read(buffer.get(), buffer.get() + count, offset);
+  return true;
+}
+
 timespec DataNode::Now() {
   timespec ts;
   if (clock_gettime(CLOCK_REALTIME, &ts) != 0)
@@ -18,7 +18,9 @@
 #ifndef DATA_NODE_H
 #define DATA_NODE_H
 
+#include <atomic>
 #include <cassert>
+#include <memory>
 #include <ostream>
 #include <string>
 
@@ -72,23 +74,106 @@ struct DataNode {
   timespec mtime = Now();
   timespec atime = mtime;
   timespec ctime = mtime;
-  std::string target;  // Link target
-  mutable Reader::Ptr cached_reader;
+
+  // Are the timestamps, owner and group stored in the extra fields of the ZIP
+  // entry still to be decoded by LoadAttributes()? Accessed atomically.
+  mutable bool attributes_pending = false;
+
+  // Has the data of this file failed an integrity check, either by Verify() or
+  // when checking the authentication code of a file encrypted with WinZip AES?
+  // Such a file cannot be opened anymore. Accessed atomically.
+  mutable bool corrupted = false;
+
+  // Link target, if it is not stored as file contents. This is rare enough to
+  // be kept out of line.
+  std::unique_ptr<const std::string> target;
+
+  // State shared by all the readers of this file.
+  struct Cache {
+    ~Cache();
+
+    // Cached reader, which can be released once it is not used anymore if the
+    // number of idle cached files is limited.
+    Reader::Ptr reader;
+    std::shared_ptr<DeflateIndex> deflate_index;
+
+    // Decompression stream shared by the readers currently open on this file,
+    // if any.
+    BufferedReader* stream = nullptr;
+
+    // Keys of a file stored without compression and encrypted with WinZip AES,
+    // and position of its encrypted data in the ZIP archive file, once its
+    // authentication code has been checked.
+    WinZipAes::Ptr aes;
+    off_t aes_offset = -1;
+  };
+
+  // Created when first needed. Protected by Reader::cache_mutex.
+  mutable std::unique_ptr<Cache> cache;
+
   static const blksize_t block_size = 512;
 
   // Get attributes.
   using Stat = struct stat;
   operator Stat() const;
 
-  bool CacheAll(zip_t* zip,
+  bool CacheAll(ZipHandle* zip,
                 const FileNode& file_node,
                 std::function<void(ssize_t)> progress = {});
 
-  Reader::Ptr GetReader(zip_t* zip, const FileNode& file_node) const;
-
-  static DataNode Make(zip_t* zip, i64 id, mode_t mode);
+  Reader::Ptr GetReader(ZipHandle* zip, const FileNode& file_node) const;
+
+  // Decompresses and caches the |count| bytes at |offset| in this file, so
+  // that reading them later is fast. Returns false if this file doesn't need
+  // to be cached. Throws ZipError in case of error.
+  bool Warm(ZipHandle* zip,
+            const FileNode& file_node,
+            off_t offset,
+            ssize_t count) const;
+
+  // Decodes the timestamps, owner and group stored in the extra fields of the
+  // ZIP entry, if this has been deferred by Make() and not done yet.
+  void LoadAttributes(ZipHandle* zip) const;
+
+  // Reads the data of this file from the ZIP archive, and checks its CRC-32
+  // against the one recorded in its ZIP entry. A file encrypted with WinZip
+  // AES is decrypted by libzip, which checks its authentication code instead.
+  // Marks this file as corrupted and returns false if the check fails, or if
+  // the data cannot be read. Returns true if the check passes, if this file
+  // has no CRC-32 and is not encrypted with WinZip AES, or if |stop| gets set
+  // before the end. Throws ZipError if the file cannot be opened.
+  bool Verify(ZipHandle* zip,
+              const FileNode& file_node,
+              const std::atomic<bool>& stop) const;
+
+  // Makes a DataNode for the entry described by |st|, which must have been
+  // filled by zip_stat_index(). The returned DataNode has no inode number yet.
+  // This can be called from several threads with different handles |zip|.
+  // If |lazy_attributes| is true, the extra fields of regular files and
+  // directories are only decoded by LoadAttributes(), which avoids reading
+  // their local headers. Until then, they only get the DOS modification time
+  // recorded in the central directory.
+  static DataNode Make(zip_t* zip,
+                       const zip_stat_t& st,
+                       mode_t mode,
+                       bool lazy_attributes = false);
 
   static timespec Now();
+
+ private:
+  // Gets the cache, creating it if necessary.
+  // Precondition: Reader::cache_mutex is held.
+  Cache& GetCache() const;
+
+  // Makes an AesReader for this file, described by |st|, which must be stored
+  // without compression and encrypted with WinZip AES. Derives the keys and
+  // checks the authentication code of the file the first time, and keeps them
+  // in the cache. Returns a null pointer if the password doesn't match or if
+  // the data cannot be located. Throws ZipError if the authentication code
+  // doesn't match.
+  Reader::Ptr GetAesReader(ZipHandle* zip,
+                           const zip_stat_t& st,
+                           const FileNode& file_node) const;
 };
 
 #endif
@@ -0,0 +1,194 @@
+// Copyright 2021 Google LLC
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "decoder.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+
+#include <zip.h>
+
+#ifdef WITH_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
+#include "error.h"
+#include "log.h"
+
+InflateEngine Decoder::engine_ = InflateEngine::Libzip;
+
+void Decoder::SetEngine(const std::string_view name) {
+  if (name == "libzip") {
+    engine_ = InflateEngine::Libzip;
+    return;
+  }
+
+  if (name == "libdeflate") {
+#ifdef WITH_LIBDEFLATE
+    engine_ = InflateEngine::Libdeflate;
+    return;
+#else
+    throw std::runtime_error(
+        "Cannot use libdeflate: mount-zip was built without libdeflate");
+#endif
+  }
+
+  throw std::runtime_error(
+      StrCat("Unknown decompression engine '", name, "'"));
+}
+
+#ifdef WITH_LIBDEFLATE
+
+// Decoder decompressing a deflated file in one go with libdeflate, which is
+// much faster than zlib. Since libdeflate needs to hold the whole compressed
+// and decompressed data in memory, it is only used for files up to
+// |max_size|.
+class LibdeflateDecoder : public Decoder {
+ public:
+  // Maximum size of the files to decompress with libdeflate.
+  static constexpr off_t max_size = 256 << 20;
+
+  // Creates a LibdeflateDecoder if the file at index |file_id| is deflated
+  // without encryption, and not too big. Returns a null pointer otherwise.
+  static Ptr Make(ZipHandle* const zip, const i64 file_id) {
+    assert(zip);
+    const std::lock_guard lock(zip->mutex);
+    zip_stat_t st;
+    if (zip_stat_index(zip->zip, file_id, 0, &st) < 0 ||
+        (st.valid & ZIP_STAT_COMP_METHOD) == 0 ||
+        st.comp_method != ZIP_CM_DEFLATE ||
+        (st.valid & ZIP_STAT_ENCRYPTION_METHOD) == 0 ||
+        st.encryption_method != ZIP_EM_NONE ||
+        (st.valid & ZIP_STAT_SIZE) == 0 ||
+        (st.valid & ZIP_STAT_COMP_SIZE) == 0 ||
+        (st.valid & ZIP_STAT_CRC) == 0 || st.size == 0 ||
+        st.size > max_size || st.comp_size > max_size)
+      return nullptr;
+
+    return Ptr(new LibdeflateDecoder(zip, file_id, st.comp_size, st.size,
+                                     st.crc));
+  }
+
+  ssize_t Read(char* const dest, ssize_t size) override {
+    if (!data_)
+      Decompress();
+
+    size = std::min<off_t>(size, size_ - pos_);
+    std::memcpy(dest, &data_[pos_], size);
+    pos_ += size;
+    return size;
+  }
+
+ private:
+  LibdeflateDecoder(ZipHandle* const zip,
+                    const i64 file_id,
+                    const off_t comp_size,
+                    const off_t size,
+                    const uint32_t crc)
+      : zip_(zip),
+        file_id_(file_id),
+        comp_size_(comp_size),
+        size_(size),
+        crc_(crc) {}
+
+  // Reads the compressed data, and decompresses it into |data_|.
+  // Throws ZipError in case of error.
+  void Decompress() {
+    const Timer timer;
+
+    // Read the raw deflate data.
+    const std::unique_ptr<char[]> in(new char[comp_size_]);
+    {
+      const ZipFile file = Reader::Open(zip_, file_id_, ZIP_FL_COMPRESSED);
+      const std::lock_guard lock(zip_->mutex);
+      for (off_t n = 0; n < comp_size_;) {
+        const zip_int64_t m = zip_fread(file.get(), &in[n], comp_size_ - n);
+        if (m < 0)
+          throw ZipError("Cannot read file", file.get());
+        if (m == 0)
+          throw ZipError("Cannot read file", ZIP_ER_INCONS);
+        n += m;
+      }
+    }
+
+    std::unique_ptr<char[]> out(new char[size_]);
+    libdeflate_decompressor* const decompressor =
+        libdeflate_alloc_decompressor();
+    if (!decompressor)
+      throw std::bad_alloc();
+
+    size_t out_size = 0;
+    const libdeflate_result result = libdeflate_deflate_decompress(
+        decompressor, in.get(), comp_size_, out.get(), size_, &out_size);
+    libdeflate_free_decompressor(decompressor);
+
+    if (result != LIBDEFLATE_SUCCESS)
+      throw ZipError("Cannot decompress data with libdeflate", ZIP_ER_ZLIB);
+
+    if (out_size != size_)
+      throw ZipError("Cannot read file", ZIP_ER_INCONS);
+
+    if (libdeflate_crc32(0, out.get(), size_) != crc_)
+      throw ZipError("Cannot read file", ZIP_ER_CRC);
+
+    LOG(DEBUG) << "Decompressed " << size_ << " bytes with libdeflate in "
+               << timer;
+    data_ = std::move(out);
+  }
+
+  // Handle of the ZIP archive containing the file.
+  ZipHandle* const zip_;
+
+  // ID of the file.
+  const i64 file_id_;
+
+  // Size of the compressed data.
+  const off_t comp_size_;
+
+  // Size of the decompressed data.
+  const off_t size_;
+
+  // Expected CRC-32 of the decompressed data.
+  const uint32_t crc_;
+
+  // Decompressed data, or null if not decompressed yet.
+  std::unique_ptr<char[]> data_;
+
+  // Position of the next byte to return.
+  off_t pos_ = 0;
+};
+
+#endif  // WITH_LIBDEFLATE
+
+Decoder::Ptr Decoder::Make([[maybe_unused]] ZipHandle* const zip,
+                           [[maybe_unused]] const i64 file_id) {
+  switch (engine_) {
+    case InflateEngine::Libzip:
+      return nullptr;
+
+    case InflateEngine::Libdeflate:
+#ifdef WITH_LIBDEFLATE
+      return LibdeflateDecoder::Make(zip, file_id);
+#else
+      return nullptr;
+#endif
+  }
+
+  return nullptr;
+}
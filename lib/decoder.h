@@ -0,0 +1,65 @@
+// Copyright 2021 Google LLC
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef DECODER_H
+#define DECODER_H
+
+#include <memory>
+#include <string_view>
+
+#include <sys/types.h>
+
+#include "reader.h"
+
+// Decompression engines.
+enum class InflateEngine {
+  // Let libzip decompress the data.
+  Libzip,
+
+  // Decompress deflated files with libdeflate. Only available if built with
+  // WITH_LIBDEFLATE.
+  Libdeflate,
+};
+
+// Alternative decompression engine providing the decompressed data of a file
+// in place of libzip. Only used for whole-file decompression.
+class Decoder {
+ public:
+  using Ptr = std::unique_ptr<Decoder>;
+
+  virtual ~Decoder() = default;
+
+  // Decompresses up to |size| bytes and stores them into |dest|. Returns the
+  // number of bytes written, or 0 at the end of the file. Throws ZipError in
+  // case of error.
+  virtual ssize_t Read(char* dest, ssize_t size) = 0;
+
+  // Creates a Decoder for the file at index |file_id| using the selected
+  // engine. Returns a null pointer if this file should be decompressed by
+  // libzip instead.
+  static Ptr Make(ZipHandle* zip, i64 file_id);
+
+  // Selects the decompression engine by name ("libzip" or "libdeflate").
+  // Throws std::runtime_error if this engine is unknown or not available.
+  static void SetEngine(std::string_view name);
+
+  // Gets the selected decompression engine.
+  static InflateEngine GetEngine() { return engine_; }
+
+ private:
+  static InflateEngine engine_;
+};
+
+#endif  // DECODER_H
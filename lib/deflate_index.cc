@@ -0,0 +1,211 @@
+// Copyright 2021 Google LLC
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "deflate_index.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <limits>
+#include <utility>
+
+#include <zip.h>
+
+#include "error.h"
+#include "log.h"
+
+const DeflateIndex::Point* DeflateIndex::Find(const off_t offset) const {
+  const std::lock_guard lock(mutex_);
+  const auto it = std::upper_bound(
+      points_.cbegin(), points_.cend(), offset,
+      [](const off_t offset, const std::unique_ptr<const Point>& point) {
+        return offset < point->out;
+      });
+  return it == points_.cbegin() ? nullptr : std::prev(it)->get();
+}
+
+bool DeflateIndex::CanInsertAt(const off_t out) const {
+  const auto it = std::upper_bound(
+      points_.cbegin(), points_.cend(), out,
+      [](const off_t out, const std::unique_ptr<const Point>& point) {
+        return out < point->out;
+      });
+
+  // The beginning of the stream acts as an implicit seek point.
+  const off_t prev = it == points_.cbegin() ? 0 : (*std::prev(it))->out;
+  if (out - prev < span)
+    return false;
+
+  return it == points_.cend() || (*it)->out - out >= span;
+}
+
+bool DeflateIndex::ShouldAdd(const off_t out) const {
+  const std::lock_guard lock(mutex_);
+  return CanInsertAt(out);
+}
+
+void DeflateIndex::Add(Point point) {
+  const std::lock_guard lock(mutex_);
+  if (!CanInsertAt(point.out))
+    return;
+
+  const off_t out = point.out;
+  const auto it = std::upper_bound(
+      points_.cbegin(), points_.cend(), out,
+      [](const off_t out, const std::unique_ptr<const Point>& point) {
+        return out < point->out;
+      });
+  points_.insert(it, std::make_unique<const Point>(std::move(point)));
+}
+
+size_t DeflateIndex::size() const {
+  const std::lock_guard lock(mutex_);
+  return points_.size();
+}
+
+Inflater::Inflater(DeflateIndex* const index) : index_(index) {
+  assert(index_);
+  if (inflateInit2(&stream_, -15) != Z_OK)
+    throw ZipError("Cannot initialize zlib", ZIP_ER_ZLIB);
+}
+
+Inflater::~Inflater() {
+  inflateEnd(&stream_);
+}
+
+void Inflater::Reset(const DeflateIndex::Point* const point) {
+  if (inflateReset(&stream_) != Z_OK)
+    throw ZipError("Cannot reset zlib", ZIP_ER_ZLIB);
+
+  stream_.next_in = Z_NULL;
+  stream_.avail_in = 0;
+  done_ = false;
+
+  if (!point) {
+    out_ = 0;
+    in_ = 0;
+    crc_ = crc32(0, Z_NULL, 0);
+    return;
+  }
+
+  if (point->bits &&
+      inflatePrime(&stream_, point->bits, point->byte >> (8 - point->bits)) !=
+          Z_OK)
+    throw ZipError("Cannot prime zlib", ZIP_ER_ZLIB);
+
+  if (inflateSetDictionary(&stream_, point->window.data(),
+                           point->window.size()) != Z_OK)
+    throw ZipError("Cannot set zlib dictionary", ZIP_ER_ZLIB);
+
+  out_ = point->out - point->window.size();
+  Update(point->window.data(), point->window.size());
+  assert(out_ == point->out);
+  in_ = point->in;
+  crc_ = point->crc;
+}
+
+void Inflater::Update(const Bytef* p, ssize_t n) {
+  assert(n >= 0);
+  if (n > window_size_) {
+    out_ += n - window_size_;
+    p += n - window_size_;
+    n = window_size_;
+  }
+
+  while (n > 0) {
+    const ssize_t i = out_ % window_size_;
+    const ssize_t m = std::min(n, window_size_ - i);
+    std::memcpy(&window_[i], p, m);
+    out_ += m;
+    p += m;
+    n -= m;
+  }
+}
+
+void Inflater::AddPoint() {
+  if (!index_->ShouldAdd(out_))
+    return;
+
+  const ssize_t n = std::min<off_t>(out_, window_size_);
+  DeflateIndex::Point point{.out = out_,
+                            .in = in_,
+                            .bits = stream_.data_type & 7,
+                            .byte = last_byte_,
+                            .crc = crc_};
+  point.window.reserve(n);
+  const ssize_t i = (out_ - n) % window_size_;
+  const ssize_t m = std::min(n, window_size_ - i);
+  point.window.insert(point.window.end(), &window_[i], &window_[i + m]);
+  point.window.insert(point.window.end(), &window_[0], &window_[n - m]);
+  assert(point.window.size() == n);
+
+  LOG(DEBUG) << "Added seek point at " << out_;
+  index_->Add(std::move(point));
+}
+
+ssize_t Inflater::Read(char* const dest, ssize_t size, const Source& source) {
+  assert(size >= 0);
+  if (done_)
+    return 0;
+
+  if (size > std::numeric_limits<uInt>::max())
+    size = std::numeric_limits<uInt>::max();
+
+  stream_.next_out = reinterpret_cast<Bytef*>(dest);
+  stream_.avail_out = static_cast<uInt>(size);
+
+  while (stream_.avail_out > 0) {
+    bool end_of_input = false;
+    if (stream_.avail_in == 0) {
+      const ssize_t n = source(input_.get(), input_size_);
+      assert(n >= 0);
+      end_of_input = n == 0;
+      stream_.next_in = input_.get();
+      stream_.avail_in = static_cast<uInt>(n);
+    }
+
+    const Bytef* const out = stream_.next_out;
+    const uInt avail_in = stream_.avail_in;
+    const int ret = inflate(&stream_, Z_BLOCK);
+    if (ret == Z_BUF_ERROR && end_of_input)
+      throw ZipError("Truncated compressed data", ZIP_ER_INCONS);
+
+    if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+      throw ZipError(StrCat("Cannot decompress data: ",
+                            stream_.msg ? stream_.msg : "zlib error"),
+                     ZIP_ER_ZLIB);
+
+    if (const uInt consumed = avail_in - stream_.avail_in; consumed > 0) {
+      in_ += consumed;
+      last_byte_ = stream_.next_in[-1];
+    }
+
+    Update(out, stream_.next_out - out);
+    crc_ = crc32(crc_, out, stream_.next_out - out);
+
+    if (ret == Z_STREAM_END) {
+      done_ = true;
+      if (crc_ != index_->crc)
+        throw ZipError("Cannot read file", ZIP_ER_CRC);
+      break;
+    }
+
+    // Record a seek point at the end of a non-final deflate block.
+    if ((stream_.data_type & 128) != 0 && (stream_.data_type & 64) == 0)
+      AddPoint();
+  }
+
+  return size - stream_.avail_out;
+}
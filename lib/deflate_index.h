@@ -0,0 +1,162 @@
+// Copyright 2021 Google LLC
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef DEFLATE_INDEX_H
+#define DEFLATE_INDEX_H
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <sys/types.h>
+#include <zlib.h>
+
+// Index of seek points in a raw deflate stream, in the spirit of zlib's
+// zran.c example. Each seek point records the state needed to restart the
+// decompression in the middle of the stream: the bit position in the
+// compressed data, and the last 32 KB of decompressed data.
+//
+// The seek points are added by the Inflater objects while they decompress the
+// stream. A DeflateIndex can be shared between several Inflater objects, and
+// it can be accessed concurrently by several threads.
+class DeflateIndex {
+ public:
+  DeflateIndex(off_t span, uLong crc) : span(span), crc(crc) {}
+
+  // Restart point in the deflate stream.
+  struct Point {
+    // Position in the decompressed data.
+    off_t out;
+
+    // Position of the first full byte in the compressed data.
+    off_t in;
+
+    // Number of bits (1 to 7) taken from |byte| before the byte at |in|, or 0.
+    int bits;
+
+    // Byte at |in - 1| if |bits| is not 0.
+    Bytef byte;
+
+    // CRC-32 of the decompressed data up to |out|.
+    uLong crc;
+
+    // Up to 32 KB of decompressed data preceding |out|.
+    std::vector<Bytef> window;
+  };
+
+  // Minimum distance between two consecutive seek points, in bytes of
+  // decompressed data.
+  const off_t span;
+
+  // Expected CRC-32 of the whole decompressed data.
+  const uLong crc;
+
+  // Finds the last seek point located at or before |offset|.
+  // Returns a null pointer if there is no such point. The returned point stays
+  // valid for the lifetime of this DeflateIndex.
+  const Point* Find(off_t offset) const;
+
+  // Checks if a seek point at |out| would be far enough from its neighbours.
+  bool ShouldAdd(off_t out) const;
+
+  // Adds the given seek point if it is far enough from its neighbours.
+  void Add(Point point);
+
+  // Number of seek points.
+  size_t size() const;
+
+ private:
+  // Checks if a seek point at |out| would be far enough from its neighbours.
+  // Precondition: |mutex_| is held.
+  bool CanInsertAt(off_t out) const;
+
+  mutable std::mutex mutex_;
+
+  // Seek points sorted by position.
+  std::vector<std::unique_ptr<const Point>> points_;
+};
+
+// Raw deflate decompression engine recording seek points in a DeflateIndex,
+// and able to restart from any of these seek points.
+class Inflater {
+ public:
+  // Function reading up to |size| bytes of compressed data into |dest|.
+  // Returns the number of bytes read, or 0 at the end of the compressed data.
+  using Source = std::function<ssize_t(Bytef* dest, ssize_t size)>;
+
+  // Throws a ZipError in case of error.
+  explicit Inflater(DeflateIndex* index);
+  ~Inflater();
+
+  Inflater(const Inflater&) = delete;
+  Inflater& operator=(const Inflater&) = delete;
+
+  // Restarts the decompression from the given seek |point|, or from the
+  // beginning of the stream if |point| is null. The source must then provide
+  // the compressed data starting at |point->in|, or at 0 if |point| is null.
+  // Throws a ZipError in case of error.
+  void Reset(const DeflateIndex::Point* point);
+
+  // Decompresses up to |size| bytes into |dest|, taking the compressed data
+  // from |source|. Returns the number of bytes written, which can only be less
+  // than |size| at the end of the stream. Checks the CRC-32 of the
+  // decompressed data at the end of the stream. Throws a ZipError in case of
+  // error.
+  ssize_t Read(char* dest, ssize_t size, const Source& source);
+
+  // Current position in the decompressed data.
+  off_t pos() const { return out_; }
+
+ private:
+  // Size of the deflate window.
+  static constexpr ssize_t window_size_ = 32 * 1024;
+
+  // Size of the input buffer.
+  static constexpr ssize_t input_size_ = 64 * 1024;
+
+  // Keeps track of the |n| bytes that have just been decompressed to |p|.
+  void Update(const Bytef* p, ssize_t n);
+
+  // Records a seek point at the current position.
+  void AddPoint();
+
+  DeflateIndex* const index_;
+  z_stream stream_ = {};
+
+  // Position in the decompressed data.
+  off_t out_ = 0;
+
+  // Position in the compressed data.
+  off_t in_ = 0;
+
+  // Last byte of compressed data consumed.
+  Bytef last_byte_ = 0;
+
+  // CRC-32 of the decompressed data up to |out_|.
+  uLong crc_ = crc32(0, Z_NULL, 0);
+
+  // Has the end of the stream been reached?
+  bool done_ = false;
+
+  // Rolling buffer holding the last decompressed bytes. The byte at position
+  // |i| in the decompressed data is stored at |window_[i % window_size_]|.
+  const std::unique_ptr<Bytef[]> window_{new Bytef[window_size_]};
+
+  // Buffer holding the compressed data.
+  const std::unique_ptr<Bytef[]> input_{new Bytef[input_size_]};
+};
+
+#endif  // DEFLATE_INDEX_H
@@ -18,9 +18,9 @@
 #ifndef FILE_NODE_H
 #define FILE_NODE_H
 
-#include <memory>
 #include <ostream>
 #include <string>
+#include <string_view>
 
 #include <unistd.h>
 #include <zip.h>
@@ -34,14 +34,8 @@
 namespace bi = boost::intrusive;
 
 // Represents a named file or directory entry in the filesystem tree.
+// FileNodes are allocated in an Arena owned by the Tree.
 struct FileNode {
-  // FileNodes are dynamically allocated and passed around by unique_ptr when
-  // the ownership is transferred.
-  using Ptr = std::unique_ptr<FileNode>;
-
-  // Reference to the ZIP archive.
-  zip_t* const zip;
-
   // Index of the entry represented by this node in the ZIP archive, or -1 if it
   // is not directly represented in the ZIP archive (like the root directory, or
   // any intermediate directory).
@@ -59,8 +53,9 @@ struct FileNode {
 
   // Name of this node in the context of its parent. This name should be a valid
   // and non-empty filename, and it shouldn't contain any '/' separator. The
-  // only exception is the root directory, which is just named "/".
-  std::string name;
+  // only exception is the root directory, which is just named "/". The name
+  // is stored in a StringPool owned by the Tree, and it is NUL-terminated.
+  std::string_view name;
 
   // Original path as recorded in the ZIP archive. This is used to find hardlink
   // targets.
@@ -69,6 +64,10 @@ struct FileNode {
   // Number of entries whose name have initially collided with this file node.
   int collision_count = 0;
 
+  // Have the children of this directory node been created? Only false in lazy
+  // mode, for the directories that haven't been looked up yet.
+  bool expanded = true;
+
 #ifdef NDEBUG
   using LinkMode = bi::link_mode<bi::normal_link>;
 #else
@@ -98,13 +97,27 @@ struct FileNode {
   using Stat = struct stat;
   operator Stat() const { return *link; }
 
+  // Gets the attributes needed to list this node in its parent directory: its
+  // inode number and its file type. This doesn't read the other attributes,
+  // which might be being decoded by LoadAttributes().
+  Stat GetEntryStat() const {
+    Stat st = {};
+    st.st_ino = link->ino;
+    st.st_mode = link->mode & S_IFMT;
+    return st;
+  }
+
+  // Decodes the attributes stored in the extra fields of the ZIP entry, if
+  // this hasn't been done yet.
+  void LoadAttributes(ZipHandle* const zip) const { link->LoadAttributes(zip); }
+
   FileType type() const { return GetFileType(link->mode); }
   bool is_dir() const { return type() == FileType::Directory; }
 
   // Gets the full absolute path of this node.
   std::string path() const {
     if (!parent)
-      return name;
+      return std::string(name);
 
     std::string s = parent->path();
     Path::Append(&s, name);
@@ -118,12 +131,25 @@ struct FileNode {
     children.push_front(*child);
   }
 
-  bool CacheAll(std::function<void(ssize_t)> progress = {}) {
+  bool CacheAll(ZipHandle* const zip,
+                std::function<void(ssize_t)> progress = {}) {
     return data.CacheAll(zip, *this, std::move(progress));
   }
 
-  // Gets a Reader to read file contents.
-  Reader::Ptr GetReader() const { return link->GetReader(zip, *this); }
+  // Decompresses and caches the |count| bytes at |offset| in this file.
+  bool Warm(ZipHandle* const zip, const off_t offset, const ssize_t count) {
+    return link->Warm(zip, *this, offset, count);
+  }
+
+  // Checks the CRC-32 of the data of this file.
+  bool Verify(ZipHandle* const zip, const std::atomic<bool>& stop) const {
+    return data.Verify(zip, *this, stop);
+  }
+
+  // Gets a Reader to read file contents from the given ZIP archive handle.
+  Reader::Ptr GetReader(ZipHandle* const zip) const {
+    return link->GetReader(zip, *this);
+  }
 
   // Output operator for debugging.
   friend std::ostream& operator<<(std::ostream& out, const FileNode& node) {
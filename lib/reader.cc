@@ -15,13 +15,21 @@
 
 #include "reader.h"
 
+#include <algorithm>
+#include <bit>
 #include <cassert>
 #include <cerrno>
 #include <cstdlib>
+#include <condition_variable>
 #include <cstring>
+#include <deque>
+#include <exception>
 #include <limits>
+#include <list>
 #include <stdexcept>
+#include <thread>
 #include <utility>
+#include <vector>
 
 #include <fcntl.h>
 #include <sys/mman.h>
@@ -30,9 +38,12 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "block_cache.h"
+#include "decoder.h"
 #include "error.h"
 #include "path.h"
 #include "scoped_file.h"
+#include "stats.h"
 
 static std::string GetTmpDir() {
   const char* const val = std::getenv("TMPDIR");
@@ -41,7 +52,14 @@ static std::string GetTmpDir() {
 
 CacheStrategy Reader::cache_strategy_ = CacheStrategy::Unspecified;
 std::string Reader::cache_dir_ = GetTmpDir();
-i64 Reader::reader_count_ = 0;
+std::atomic<i64> Reader::reader_count_ = 0;
+std::mutex Reader::cache_mutex;
+off_t Reader::cache_size_ = 0;
+off_t Reader::seek_span_ = 0;
+ssize_t Reader::prefetch_size_ = 0;
+ssize_t Reader::max_buffer_size_ = 1 << 20;
+int Reader::inflate_threads_ = 1;
+int Reader::max_idle_cached_files_ = 0;
 
 static void LimitSize(ssize_t* const a, off_t b) {
   if (*a > b)
@@ -63,13 +81,119 @@ void Reader::SetCacheDir(const std::string_view dir) {
   LOG(DEBUG) << "Using cache dir " << Path(Reader::cache_dir_);
 }
 
-ZipFile Reader::Open(zip_t* const zip, const i64 file_id) {
-  ZipFile file(zip_fopen_index(zip, file_id, 0));
+// Slots of the tracked cached readers, from the most recently used to the
+// least recently used. Protected by Reader::cache_mutex.
+static std::list<Reader::Ptr*> g_cached_slots;
+
+void Reader::TrackCachedReader(Ptr* const slot,
+                               std::vector<Ptr>* const released) {
+  assert(slot);
+  assert(*slot);
+  assert(released);
+  if (max_idle_cached_files_ <= 0)
+    return;
+
+  const auto it = std::find(g_cached_slots.begin(), g_cached_slots.end(), slot);
+  if (it == g_cached_slots.end()) {
+    g_cached_slots.push_front(slot);
+  } else {
+    g_cached_slots.splice(g_cached_slots.begin(), g_cached_slots, it);
+  }
+
+  // A cached reader is idle when it is only referenced from its slot. Nobody
+  // can add a reference to it without holding cache_mutex.
+  int idle = 0;
+  for (auto it = g_cached_slots.begin(); it != g_cached_slots.end();) {
+    Ptr& p = **it;
+    if (p->ref_count_ > 1 || ++idle <= max_idle_cached_files_) {
+      ++it;
+      continue;
+    }
+
+    LOG(DEBUG) << *p << ": Releasing idle Cached " << *p;
+    Count(g_stats.idle_cache_releases);
+    released->push_back(std::move(p));
+    it = g_cached_slots.erase(it);
+  }
+}
+
+void Reader::TouchCachedReader(Ptr* const slot) {
+  const auto it = std::find(g_cached_slots.begin(), g_cached_slots.end(), slot);
+  if (it != g_cached_slots.end())
+    g_cached_slots.splice(g_cached_slots.begin(), g_cached_slots, it);
+}
+
+void Reader::UntrackCachedReader(Ptr* const slot) {
+  g_cached_slots.remove(slot);
+}
+
+ZipFile Reader::Open(ZipHandle* const zip,
+                     const i64 file_id,
+                     const zip_flags_t flags) {
+  assert(zip);
+  const std::lock_guard lock(zip->mutex);
+  ZipFile file(zip_fopen_index(zip->zip, file_id, flags), ZipClose{zip});
   if (!file)
-    throw ZipError(StrCat("Cannot open File [", file_id, "]"), zip);
+    throw ZipError(StrCat("Cannot open File [", file_id, "]"), zip->zip);
   return file;
 }
 
+char* DirectReader::Read(char* dest, char* const dest_end, off_t offset) {
+  const ScopedLatency latency(g_stats.direct_reader_latency);
+  if (offset >= size_)
+    return dest;
+
+  const char* const start = dest;
+
+  ssize_t count = dest_end - dest;
+  LimitSize(&count, size_ - offset);
+  offset += data_offset_;
+
+  while (count > 0) {
+    const ssize_t n = pread(fd_, dest, count, offset);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      ThrowSystemError("Cannot read ", count, " bytes from ZIP archive at ",
+                       offset);
+    }
+
+    if (n == 0)
+      throw ZipError("Cannot read file", ZIP_ER_INCONS);
+
+    dest += n;
+    count -= n;
+    offset += n;
+  }
+
+  Count(g_stats.direct_reader_bytes, dest - start);
+  return dest;
+}
+
+bool DirectReader::GetFileRange(const off_t offset,
+                                ssize_t size,
+                                FileRange* const range) {
+  assert(range);
+  if (offset >= size_) {
+    size = 0;
+  } else {
+    LimitSize(&size, size_ - offset);
+  }
+
+  *range = {.fd = fd_, .pos = data_offset_ + offset, .size = size};
+  return true;
+}
+
+char* AesReader::Read(char* const dest,
+                      char* const dest_end,
+                      const off_t offset) {
+  char* const end = DirectReader::Read(dest, dest_end, offset);
+  const std::lock_guard lock(mutex_);
+  decryptor_->Decrypt(dest, end - dest, offset);
+  Count(g_stats.decrypted_bytes, end - dest);
+  return end;
+}
+
 ssize_t UnbufferedReader::ReadAtCurrentPosition(char* dest, ssize_t size) {
   assert(size >= 0);
 
@@ -83,6 +207,7 @@ ssize_t UnbufferedReader::ReadAtCurrentPosition(char* dest, ssize_t size) {
     return 0;
 
   assert(file_);
+  const std::lock_guard lock(zip_->mutex);
   const ssize_t n = static_cast<ssize_t>(zip_fread(file_.get(), dest, size));
 
   if (n < 0)
@@ -93,10 +218,14 @@ ssize_t UnbufferedReader::ReadAtCurrentPosition(char* dest, ssize_t size) {
 }
 
 char* UnbufferedReader::Read(char* dest, char* dest_end, off_t offset) {
+  const ScopedLatency latency(g_stats.unbuffered_reader_latency);
+  const std::lock_guard lock(mutex_);
+
   if (pos_ != offset) {
     LOG(DEBUG) << *this << ": Jump " << offset - pos_ << " from " << pos_
                << " to " << offset;
 
+    const std::lock_guard zip_lock(zip_->mutex);
     if (zip_fseek(file_.get(), offset, SEEK_SET) < 0)
       throw ZipError("Cannot fseek file", file_.get());
 
@@ -106,6 +235,7 @@ char* UnbufferedReader::Read(char* dest, char* dest_end, off_t offset) {
   assert(pos_ == offset);
 
   while (const ssize_t n = ReadAtCurrentPosition(dest, dest_end - dest)) {
+    Count(g_stats.unbuffered_reader_bytes, n);
     dest += n;
   }
 
@@ -113,20 +243,72 @@ char* UnbufferedReader::Read(char* dest, char* dest_end, off_t offset) {
 }
 
 // Reader used for compressed files. It features a decompression engine and it
-// caches the decompressed bytes in a cache file.
+// caches the decompressed bytes in the global cache file, block by block. The
+// cached blocks can be evicted, in which case they are decompressed again when
+// needed.
 class CacheFileReader : public UnbufferedReader {
  public:
-  using UnbufferedReader::UnbufferedReader;
-  CacheFileReader(zip_t* const zip,
+  using Progress = std::function<void(ssize_t)>;
+
+  // If |index| is given, |file| must provide the raw deflate data. It is then
+  // decompressed with zlib, restarting from the closest seek point rather than
+  // from the beginning, and possibly with several threads.
+  CacheFileReader(ZipHandle* const zip,
+                  ZipFile file,
                   const i64 file_id,
-                  const off_t expected_size)
-      : UnbufferedReader(Open(zip, file_id), file_id, expected_size) {}
+                  const off_t expected_size,
+                  std::shared_ptr<DeflateIndex> index = nullptr)
+      : UnbufferedReader(zip, std::move(file), file_id, expected_size),
+        index_(std::move(index)) {
+    if (index_)
+      inflater_ = std::make_unique<Inflater>(index_.get());
+  }
 
-  void CacheAll(std::function<void(ssize_t)> progress) {
-    EnsureCachedUpTo(expected_size_, std::move(progress));
+  CacheFileReader(ZipHandle* const zip,
+                  const i64 file_id,
+                  const off_t expected_size,
+                  const std::shared_ptr<DeflateIndex>& index = nullptr)
+      : CacheFileReader(zip,
+                        Open(zip, file_id, index ? ZIP_FL_COMPRESSED : 0),
+                        file_id,
+                        expected_size,
+                        index) {}
+
+  ~CacheFileReader() override {
+    BlockCache& cache = GetBlockCache();
+    for (i64 i = 0; i < block_count_; ++i)
+      cache.Remove({reader_id_, i});
+  }
+
+  void CacheAll(const Progress& progress) {
+    if (block_count_ == 0)
+      return;
+
+    const std::lock_guard lock(mutex_);
+
+    // Decompress from the beginning, so that all the blocks get cached.
+    if (pos_ > 0)
+      Rewind();
+
+    const i64 last = block_count_ - 1;
+    if (inflater_ && inflate_threads_ > 1)
+      CacheInParallel(last, progress);
+
+    if (pos_ % BlockCache::block_size != 0)
+      return;
+
+    const Block block = CacheBlocksUpTo(last, progress);
+    if (block.slot >= 0)
+      GetBlockCache().Release(block.slot);
   }
 
  private:
+  using Block = BlockCache::Block;
+
+  // Function decompressing up to |size| bytes into |dest|. Returns the number
+  // of bytes written, or 0 at the end of the file.
+  using Source = std::function<ssize_t(char* dest, ssize_t size)>;
+
   // Creates a new and empty cache file.
   // Throws std::system_error in case of error.
   static ScopedFile CreateCacheFile() {
@@ -193,38 +375,122 @@ class CacheFileReader : public UnbufferedReader {
     return file.GetDescriptor();
   }
 
-  // Reserves space in the cache file.
-  // Returns the start position of the reserved space.
-  off_t ReserveSpace() const {
+  // Part of the global cache file mapped in memory.
+  struct CacheMapping {
+    // Start of the mapping, or null if the cache file is not mapped.
+    const char* data = nullptr;
+
+    // Number of slots of the cache file covered by the mapping.
+    i64 slots = 0;
+  };
+
+  // Maps the global cache file in memory, so that the cached blocks can be
+  // read without a system call. Without a cache size limit, only the first
+  // slots are mapped, since the free slots are reused lowest first. Returns
+  // an empty mapping if the cache file cannot be mapped, in which case it is
+  // read with pread.
+  static CacheMapping MapCacheFile() {
+    // Mapped size when the cache size is unlimited: 64 GB of address space on
+    // 64-bit systems.
+    constexpr i64 max_mapped_slots =
+        sizeof(void*) < 8 ? 0 : (i64(1) << 36) / BlockCache::block_size;
+    constexpr off_t block_size = BlockCache::block_size;
+    const i64 slots = cache_size_ > 0
+                          ? (cache_size_ + block_size - 1) / block_size
+                          : max_mapped_slots;
+    if (slots <= 0)
+      return {};
+
+    // The pages beyond the end of the cache file are only accessed once their
+    // slots have been reserved.
+    const size_t size = slots * BlockCache::block_size;
+    void* const p =
+        mmap(nullptr, size, PROT_READ, MAP_SHARED, GetCacheFile(), 0);
+    if (p == MAP_FAILED) {
+      PLOG(DEBUG) << "Cannot map " << size << " bytes of cache file";
+      return {};
+    }
+
+#ifdef MADV_HUGEPAGE
+    // Let the kernel back an in-memory cache file with huge pages, if it is
+    // configured to do so (shmem_enabled set to advise).
+    if (cache_strategy_ == CacheStrategy::InMemory &&
+        madvise(p, size, MADV_HUGEPAGE) < 0)
+      PLOG(DEBUG) << "Cannot advise huge pages for cache file";
+#endif
+
+    LOG(DEBUG) << "Mapped " << slots << " slots of cache file in memory";
+    return {.data = static_cast<const char*>(p), .slots = slots};
+  }
+
+  // Gets the mapping of the global cache file.
+  static const CacheMapping& GetCacheMapping() {
+    static const CacheMapping mapping = MapCacheFile();
+    return mapping;
+  }
+
+  // Gets the global block cache.
+  static BlockCache& GetBlockCache() {
+    static BlockCache cache(
+        (cache_size_ + BlockCache::block_size - 1) / BlockCache::block_size,
+        PunchHole);
+    return cache;
+  }
+
+  // Gives the space of the free |slot| in the cache file back to the system.
+  // This space gets reserved again if the slot is reused.
+  static void PunchHole(const i64 slot) {
+#ifdef FALLOC_FL_PUNCH_HOLE
+    const off_t offset = slot * BlockCache::block_size;
+    const off_t size = BlockCache::block_size;
+    if (fallocate(GetCacheFile(), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  offset, size) < 0) {
+      // Not all the filesystems support this. The slot can be reused anyway.
+      PLOG(DEBUG) << "Cannot punch hole of " << size
+                  << " bytes in cache file at offset " << offset;
+      return;
+    }
+
+    Count(g_stats.cache_punched_bytes, size);
+#else
+    (void)slot;
+#endif
+  }
+
+  // Reserves space in the cache file for a block in the given |slot|.
+  void ReserveSpace(const i64 slot) const {
+    const off_t offset = slot * BlockCache::block_size;
+    const off_t size = BlockCache::block_size;
+    Count(g_stats.cache_reserved_bytes, size);
+#if __APPLE__
+    // Prevent concurrent reservations from extending the file in the wrong
+    // order.
+    static std::mutex mutex;
+    const std::lock_guard lock(mutex);
+
     // Get current cache file size.
     struct stat st;
     if (fstat(cache_file_, &st) < 0)
       ThrowSystemError("Cannot stat cache file ", cache_file_);
 
-    // Extend cache file.
-    const off_t offset = st.st_size;
-#if __APPLE__
-    fstore_t st{.fst_flags = F_ALLOCATEALL,
-                .fst_posmode = F_PEOFPOSMODE,
-                .fst_offset = 0,
-                .fst_length = expected_size_};
-    if (fcntl(cache_file_, F_PREALLOCATE, &st) < 0 ||
-        ftruncate(cache_file_, offset + expected_size_) < 0)
-      ThrowSystemError("Cannot reserve ", expected_size_,
-                       " bytes in cache file ", cache_file_, " at offset ",
-                       offset);
+    if (st.st_size >= offset + size)
+      return;
+
+    fstore_t fst{.fst_flags = F_ALLOCATEALL,
+                 .fst_posmode = F_PEOFPOSMODE,
+                 .fst_offset = 0,
+                 .fst_length = offset + size - st.st_size};
+    if (fcntl(cache_file_, F_PREALLOCATE, &fst) < 0 ||
+        ftruncate(cache_file_, offset + size) < 0)
+      ThrowSystemError("Cannot reserve ", size, " bytes in cache file ",
+                       cache_file_, " at offset ", offset);
 #else
-    if (const int err = posix_fallocate(cache_file_, offset, expected_size_)) {
+    if (const int err = posix_fallocate(cache_file_, offset, size)) {
       errno = err;  // posix_fallocate doesn't set errno
-      ThrowSystemError("Cannot reserve ", expected_size_,
-                       " bytes in cache file ", cache_file_, " at offset ",
-                       offset);
+      ThrowSystemError("Cannot reserve ", size, " bytes in cache file ",
+                       cache_file_, " at offset ", offset);
     }
 #endif
-
-    LOG(DEBUG) << "Reserved " << expected_size_
-               << " bytes in cache file at offset " << offset;
-    return offset;
   }
 
   // Writes data to the global cache file.
@@ -239,82 +505,557 @@ class CacheFileReader : public UnbufferedReader {
       if (n < 0)
         ThrowSystemError("Cannot write ", count,
                          " bytes into cache file at offset ", offset);
+      Count(g_stats.cache_written_bytes, n);
       buf += n;
       count -= n;
       offset += n;
     }
   }
 
-  // Ensures the decompressed data is cached at least up to the given offset.
-  void EnsureCachedUpTo(const off_t offset,
-                        const std::function<void(ssize_t)> progress = {}) {
+  // Restarts decompressing from the beginning.
+  // Precondition: mutex_ is held.
+  void Rewind() {
+    if (inflater_)
+      return Restart(nullptr);
+
+    LOG(DEBUG) << *this << ": Rewind";
+    Count(g_stats.rewinds);
+    file_ = Open(zip_, file_id_);
+    decoder_ = Decoder::Make(zip_, file_id_);
+    pos_ = 0;
+  }
+
+  // Restarts decompressing from the given seek |point|, or from the beginning
+  // if |point| is null.
+  // Precondition: mutex_ is held.
+  // Precondition: |inflater_| is set.
+  void Restart(const DeflateIndex::Point* const point) {
+    assert(inflater_);
+    if (point) {
+      LOG(DEBUG) << *this << ": Restart from seek point at " << point->out;
+      Count(g_stats.seek_point_restarts);
+    } else {
+      LOG(DEBUG) << *this << ": Rewind";
+      Count(g_stats.rewinds);
+    }
+
+    file_ = OpenAt(point);
+    inflater_->Reset(point);
+    pos_ = inflater_->pos();
+  }
+
+  // Opens the raw deflate data, and positions it at the given seek |point|,
+  // or at the beginning if |point| is null.
+  // Throws ZipError in case of error.
+  ZipFile OpenAt(const DeflateIndex::Point* const point) const {
+    ZipFile file = Open(zip_, file_id_, ZIP_FL_COMPRESSED);
+    const off_t in = point ? point->in : 0;
+    if (in == 0)
+      return file;
+
+    const std::lock_guard lock(zip_->mutex);
+    if (zip_fseek(file.get(), in, SEEK_SET) == 0)
+      return file;
+
+    // The compressed data is not seekable. Skip the compressed data up to the
+    // seek point.
+    LOG(DEBUG) << *this << ": Skipping " << in << " bytes of compressed data";
+    for (off_t skipped = 0; skipped < in;) {
+      char buf[64 * 1024];
+      ssize_t count = sizeof(buf);
+      LimitSize(&count, in - skipped);
+      const zip_int64_t n = zip_fread(file.get(), buf, count);
+      if (n < 0)
+        throw ZipError("Cannot read file", file.get());
+      if (n == 0)
+        throw ZipError("Cannot read file", ZIP_ER_INCONS);
+      skipped += n;
+    }
+
+    return file;
+  }
+
+  // Decompresses up to |size| bytes with |inflater|, taking the raw deflate
+  // data from |file|, and stores them into |dest|. Returns the number of bytes
+  // written, or 0 at the end of the file. Throws ZipError in case of error.
+  ssize_t Inflate(Inflater* const inflater,
+                  zip_file_t* const file,
+                  char* const dest,
+                  ssize_t size) const {
+    assert(inflater);
+    assert(file);
+    const auto source = [this, file](Bytef* const buf, const ssize_t count) {
+      const std::lock_guard lock(zip_->mutex);
+      const zip_int64_t n = zip_fread(file, buf, count);
+      if (n < 0)
+        throw ZipError("Cannot read file", file);
+      return static_cast<ssize_t>(n);
+    };
+
+    if (inflater->pos() >= expected_size_) {
+      // Check that the deflate stream ends here too, which also checks the CRC.
+      char c;
+      if (inflater->Read(&c, 1, source) != 0)
+        throw ZipError("Cannot read file", ZIP_ER_INCONS);
+      return 0;
+    }
+
+    LimitSize(&size, expected_size_ - inflater->pos());
+    return inflater->Read(dest, size, source);
+  }
+
+  // Decompresses up to |size| bytes at the current position pos_ with zlib if
+  // there is a seek-point index, or with the decoder if any, or with libzip
+  // otherwise. Same contract as ReadAtCurrentPosition().
+  // Precondition: mutex_ is held.
+  ssize_t Decompress(char* const dest, const ssize_t size) {
+    const ScopedTime timer(g_stats.inflate_ns);
+    ssize_t n;
+    if (inflater_) {
+      n = file_ && size > 0
+              ? Inflate(inflater_.get(), file_.get(), dest, size)
+              : 0;
+      pos_ += n;
+      assert(pos_ == inflater_->pos());
+    } else if (decoder_) {
+      n = pos_ < expected_size_ && size > 0 ? decoder_->Read(dest, size) : 0;
+      pos_ += n;
+    } else {
+      n = ReadAtCurrentPosition(dest, size);
+    }
+
+    Count(g_stats.inflated_bytes, n);
+    return n;
+  }
+
+  // Decompresses and discards |count| bytes with |source|. Returns false if
+  // the end of file is reached first.
+  static bool Discard(const Source& source, off_t count) {
+    while (count > 0) {
+      char buf[64 * 1024];
+      ssize_t n = sizeof(buf);
+      LimitSize(&n, count);
+      n = source(buf, n);
+      if (n == 0)
+        return false;
+      count -= n;
+    }
+
+    return true;
+  }
+
+  // Decompresses the next block with |source|, and writes it in the cache file
+  // at the given |slot|, or discards it if |slot| is negative. Returns the size
+  // of the block, which is less than the block size if the end of file has
+  // been reached.
+  ssize_t DecompressBlock(const Source& source,
+                          const i64 slot,
+                          const Progress& progress) const {
+    const off_t store_offset = slot * BlockCache::block_size;
+    ssize_t size = 0;
+
+    while (size < BlockCache::block_size) {
+      const ssize_t buf_size = 64 * 1024;
+      char buf[buf_size];
+      const ssize_t n = source(
+          buf, std::min<ssize_t>(buf_size, BlockCache::block_size - size));
+      if (n == 0)
+        break;
+
+      if (slot >= 0)
+        WriteToCacheFile(buf, n, store_offset + size);
+      if (progress)
+        progress(n);
+      size += n;
+    }
+
+    return size;
+  }
+
+  // Decompresses the block |i| with |source|, and caches it unless it is
+  // already cached. Returns this block, pinned, with the number of bytes that
+  // have been decompressed as size.
+  Block CacheBlock(const i64 i,
+                   const Source& source,
+                   const Progress& progress) const {
+    BlockCache& cache = GetBlockCache();
+    const BlockCache::Key key = {.file = reader_id_, .index = i};
+    Block block;
+
+    // If this block is already cached, skip it.
+    const bool cached = cache.Get(key, &block);
+    if (!cached)
+      block.slot = cache.Reserve();
+
+    try {
+      if (!cached)
+        ReserveSpace(block.slot);
+      block.size = DecompressBlock(source, cached ? -1 : block.slot, progress);
+    } catch (...) {
+      cache.Release(block.slot);
+      throw;
+    }
+
+    if (!cached)
+      cache.Put(key, block.slot, block.size);
+    return block;
+  }
+
+  // Moves the current position pos_ to the start of a block at or before
+  // |offset|, from where the data up to |offset| can be decompressed. Restarts
+  // from the closest seek point if it is ahead, or from the beginning if
+  // |offset| is behind. Returns false if the end of file is reached before
+  // |offset|.
+  // Precondition: mutex_ is held.
+  // Precondition: |offset| is at the start of a block.
+  bool SeekBlock(const off_t offset) {
+    assert(offset % BlockCache::block_size == 0);
+    const DeflateIndex::Point* const point =
+        index_ ? index_->Find(offset) : nullptr;
+
+    if (point && (pos_ > offset || point->out > pos_)) {
+      Restart(point);
+      // Skip the data up to the start of the next block.
+      const Source source = [this](char* const dest, const ssize_t size) {
+        return Decompress(dest, size);
+      };
+      if (!Discard(source, BlockStart(point->out) - pos_)) {
+        file_.reset();
+        return false;
+      }
+    } else if (pos_ > offset) {
+      Rewind();
+    } else if (pos_ % BlockCache::block_size != 0) {
+      // The end of file was reached before this block.
+      return false;
+    } else if (pos_ < offset) {
+      LOG(DEBUG) << *this << ": Jump " << offset - pos_ << " from " << pos_
+                 << " to " << offset;
+    }
+
+    assert(pos_ % BlockCache::block_size == 0);
+    assert(pos_ <= offset);
+    return true;
+  }
+
+  // Gets the start of the first block at or after |offset|.
+  static off_t BlockStart(const off_t offset) {
+    return (offset + BlockCache::block_size - 1) / BlockCache::block_size *
+           BlockCache::block_size;
+  }
+
+  // Decompresses the blocks from the seek |point| with a separate
+  // decompression engine, and caches the blocks from |first| to |end|
+  // (excluded). Called by the worker threads of CacheInParallel().
+  // Throws ZipError in case of error.
+  void CacheChunk(const DeflateIndex::Point* const point,
+                  const i64 first,
+                  const i64 end,
+                  const Progress& progress) const {
+    assert(point);
+    const ZipFile file = OpenAt(point);
+    Inflater inflater(index_.get());
+    inflater.Reset(point);
+    const Source source = [&](char* const dest, const ssize_t size) {
+      const ScopedTime timer(g_stats.inflate_ns);
+      const ssize_t n = Inflate(&inflater, file.get(), dest, size);
+      Count(g_stats.inflated_bytes, n);
+      return n;
+    };
+
+    if (!Discard(source, first * BlockCache::block_size - inflater.pos()))
+      return;
+
+    BlockCache& cache = GetBlockCache();
+    for (i64 i = first; i < end; ++i) {
+      const Block block = CacheBlock(i, source, progress);
+      cache.Release(block.slot);
+      if (block.size < BlockCache::block_size)
+        return;
+    }
+  }
+
+  // Caches the blocks from the current position pos_ up to the last seek point
+  // before the block |index|. Splits them in chunks starting at the seek
+  // points recorded so far, and decompresses these chunks with up to
+  // |inflate_threads_| threads. This thread decompresses the first chunk from
+  // the current position. Does nothing if there are not enough seek points.
+  // Otherwise, moves the current position pos_ to the end of the last chunk.
+  // Precondition: mutex_ is held.
+  // Precondition: pos_ is at the start of a block at or before |index|.
+  void CacheInParallel(const i64 index, const Progress& progress) {
+    assert(index_);
+    const i64 first = pos_ / BlockCache::block_size;
+    const DeflateIndex::Point* const last =
+        index_->Find(index * BlockCache::block_size);
+    if (!last)
+      return;
+
+    // The rest is decompressed from |last| afterwards.
+    i64 end = BlockStart(last->out) / BlockCache::block_size;
+
+    // Don't evict the blocks that have just been cached.
+    if (cache_size_ > 0)
+      end = std::min<i64>(
+          end, first + cache_size_ / BlockCache::block_size / 2);
+
+    const i64 count = end - first;
+    if (count < 2)
+      return;
+
+    struct Chunk {
+      const DeflateIndex::Point* point;
+      i64 first;
+    };
+
+    // Chunks after the first one.
+    std::vector<Chunk> chunks;
+    const i64 thread_count = std::min<i64>(inflate_threads_, count);
+    for (i64 k = 1; k < thread_count; ++k) {
+      const DeflateIndex::Point* const point = index_->Find(
+          (first + count * k / thread_count) * BlockCache::block_size);
+      if (!point)
+        continue;
+
+      const i64 start = BlockStart(point->out) / BlockCache::block_size;
+      if (start > (chunks.empty() ? first : chunks.back().first) &&
+          start < end)
+        chunks.push_back({.point = point, .first = start});
+    }
+
+    if (chunks.empty())
+      return;
+
+    LOG(DEBUG) << *this << ": Caching blocks " << first << " to " << end
+               << " with " << chunks.size() + 1 << " threads";
+
+    std::mutex error_mutex;
+    std::exception_ptr error;
+    const auto run = [&](const std::function<void()>& f) {
+      try {
+        f();
+      } catch (...) {
+        const std::lock_guard lock(error_mutex);
+        if (!error)
+          error = std::current_exception();
+      }
+    };
+
+    std::vector<std::thread> threads;
+    threads.reserve(chunks.size());
+    for (size_t k = 0; k < chunks.size(); ++k) {
+      const i64 chunk_end = k + 1 < chunks.size() ? chunks[k + 1].first : end;
+      threads.emplace_back([&, k, chunk_end] {
+        run([&] {
+          CacheChunk(chunks[k].point, chunks[k].first, chunk_end, progress);
+        });
+      });
+    }
+
+    run([&] {
+      const Block block = CacheBlocksUpTo(chunks.front().first - 1, progress);
+      if (block.slot >= 0)
+        GetBlockCache().Release(block.slot);
+    });
+
+    for (std::thread& thread : threads)
+      thread.join();
+
+    if (error)
+      std::rethrow_exception(error);
+
+    // Continue from the end of the last chunk.
+    Restart(index_->Find(end * BlockCache::block_size));
+    const Source source = [this](char* const dest, const ssize_t size) {
+      return Decompress(dest, size);
+    };
+    if (!Discard(source, end * BlockCache::block_size - pos_))
+      file_.reset();
+  }
+
+  // Decompresses the data from the current position pos_ up to the end of the
+  // block |index|, and caches the decompressed blocks that are not cached yet.
+  // Returns the block |index|, pinned, or a block with a negative slot if the
+  // file ends before this block.
+  // Precondition: mutex_ is held.
+  // Precondition: pos_ is at the start of a block at or before |index|.
+  Block CacheBlocksUpTo(const i64 index, const Progress& progress) {
+    assert(pos_ % BlockCache::block_size == 0);
+    assert(pos_ <= index * BlockCache::block_size);
+    BlockCache& cache = GetBlockCache();
+    const Source source = [this](char* const dest, const ssize_t size) {
+      return Decompress(dest, size);
+    };
+
     const off_t start_pos = pos_;
-    const off_t total_to_cache = offset - pos_;
+    const off_t total_to_cache = (index + 1) * BlockCache::block_size - pos_;
     const Timer timer;
     Beat should_log_progress;
+    Block block;
 
-    while (pos_ < offset) {
+    while (true) {
       if (should_log_progress)
         LOG(DEBUG) << "Caching " << total_to_cache << " bytes... "
                    << 100 * (pos_ - start_pos) / total_to_cache << "%";
 
-      const ssize_t buf_size = 64 * 1024;
-      char buf[buf_size];
-      const off_t store_offset = start_offset_ + pos_;
-      const ssize_t n = ReadAtCurrentPosition(buf, buf_size);
-      if (n == 0) {
+      const i64 i = pos_ / BlockCache::block_size;
+      assert(i <= index);
+      block = CacheBlock(i, source, progress);
+
+      const bool eof = block.size < BlockCache::block_size;
+      if (eof) {
         file_.reset();
-        break;
+        decoder_.reset();
       }
 
-      WriteToCacheFile(buf, n, store_offset);
-      if (progress)
-        progress(n);
+      if (i == index)
+        break;
+
+      cache.Release(block.slot);
+
+      if (eof) {
+        // The file is shorter than expected.
+        block = {.slot = -1, .size = 0};
+        break;
+      }
     }
 
     if (should_log_progress.Count())
       LOG(DEBUG) << "Cached " << pos_ - start_pos << " bytes from " << start_pos
                  << " to " << pos_ << " in " << timer;
+
+    return block;
+  }
+
+  // Ensures the block |index| is cached. Decompresses the file up to the end of
+  // this block if necessary, and caches the decompressed blocks that are not
+  // cached yet. Returns the block |index|, pinned, or a block with a negative
+  // slot if the file ends before this block.
+  // Precondition: mutex_ is held.
+  Block CacheUpTo(const i64 index, const Progress& progress = {}) {
+    assert(index >= 0);
+    assert(index < block_count_);
+    BlockCache& cache = GetBlockCache();
+    Block block = {.slot = -1, .size = 0};
+
+    if (cache.Get({reader_id_, index}, &block))
+      return block;
+
+    const off_t offset = index * BlockCache::block_size;
+    if (!SeekBlock(offset))
+      return {.slot = -1, .size = 0};
+
+    if (inflater_ && inflate_threads_ > 1) {
+      // If the following data has been decompressed before, and seek points
+      // have been recorded, then cache the next blocks in parallel.
+      const i64 ahead =
+          inflate_threads_ *
+          std::max<off_t>(index_->span / BlockCache::block_size, 4);
+      CacheInParallel(std::min(index + ahead, block_count_ - 1), progress);
+      if (cache.Get({reader_id_, index}, &block))
+        return block;
+
+      if (!SeekBlock(offset))
+        return {.slot = -1, .size = 0};
+    }
+
+    return CacheBlocksUpTo(index, progress);
   }
 
   char* Read(char* dest, char* const dest_end, off_t offset) override {
+    const ScopedLatency latency(g_stats.cache_file_reader_latency);
     if (expected_size_ <= offset)
       return dest;
 
     ssize_t count = dest_end - dest;
     LimitSize(&count, expected_size_ - offset);
+    BlockCache& cache = GetBlockCache();
 
-    if (pos_ < offset)
-      LOG(DEBUG) << *this << ": Jump " << offset - pos_ << " from " << pos_
-                 << " to " << offset;
+    while (count > 0) {
+      const i64 index = offset / BlockCache::block_size;
+      Block block;
+      if (!cache.Get({reader_id_, index}, &block)) {
+        const std::lock_guard lock(mutex_);
+        block = CacheUpTo(index);
+        if (block.slot < 0)
+          break;
+      }
 
-    EnsureCachedUpTo(offset + count);
+      // A pinned block can be read without holding the lock.
+      const off_t start = offset - index * BlockCache::block_size;
+      ssize_t size = block.size - start;
+      LimitSize(&size, count);
+      const off_t pos = block.slot * BlockCache::block_size + start;
+      ssize_t n = 0;
+      if (size > 0 && block.slot < mapping_.slots) {
+        // A pinned block stays in its slot, and cannot be overwritten.
+        std::memcpy(dest, mapping_.data + pos, size);
+        Count(g_stats.cache_mapped_bytes, size);
+        n = size;
+      } else if (size > 0) {
+        n = pread(cache_file_, dest, size, pos);
+      }
+      cache.Release(block.slot);
+      if (n < 0)
+        ThrowSystemError("Cannot read ", size,
+                         " bytes from cache file at offset ", pos);
 
-    offset += start_offset_;
-    const ssize_t n = pread(cache_file_, dest, count, offset);
-    if (n < 0)
-      ThrowSystemError("Cannot read ", count,
-                       " bytes from cache file at offset ", offset);
+      Count(g_stats.cache_file_reader_bytes, n);
+      dest += n;
+      offset += n;
+      count -= n;
 
-    return dest + n;
+      if (n < BlockCache::block_size - start)
+        break;
+    }
+
+    return dest;
   }
 
+  // Number of blocks in the file.
+  const i64 block_count_ =
+      (expected_size_ + BlockCache::block_size - 1) / BlockCache::block_size;
+
   // Cache file descriptor.
   const int cache_file_ = GetCacheFile();
 
-  // Position at which the decompressed data is stored in the cache file.
-  const off_t start_offset_ = ReserveSpace();
+  // Cache file mapping.
+  const CacheMapping& mapping_ = GetCacheMapping();
+
+  // Seek points of the deflate stream, shared with the other readers of the
+  // same file. Null if the file is not decompressed by zlib.
+  const std::shared_ptr<DeflateIndex> index_;
+
+  // Decompression engine used with |index_|.
+  std::unique_ptr<Inflater> inflater_;
+
+  // Alternative decompression engine, or null to let libzip decompress the
+  // data.
+  Decoder::Ptr decoder_ = index_ ? nullptr : Decoder::Make(zip_, file_id_);
 };
 
-Reader::Ptr CacheFile(ZipFile file,
+Reader::Ptr CacheFile(ZipHandle* const zip,
+                      ZipFile file,
                       const i64 file_id,
                       const off_t expected_size,
-                      std::function<void(ssize_t)> progress) {
-  CacheFileReader* const p =
-      new CacheFileReader(std::move(file), file_id, expected_size);
+                      std::function<void(ssize_t)> progress,
+                      std::shared_ptr<DeflateIndex> index) {
+  CacheFileReader* const p = new CacheFileReader(
+      zip, std::move(file), file_id, expected_size, std::move(index));
   Reader::Ptr r(p);
   LOG(DEBUG) << *p << ": Caching " << expected_size << " bytes...";
-  p->CacheAll(std::move(progress));
+  p->CacheAll(progress);
+  return r;
+}
+
+Reader::Ptr MakeCachedReader(ZipHandle* const zip,
+                             ZipFile file,
+                             const i64 file_id,
+                             const off_t expected_size,
+                             std::shared_ptr<DeflateIndex> index) {
+  Reader::Ptr r(new CacheFileReader(zip, std::move(file), file_id,
+                                    expected_size, std::move(index)));
+  LOG(DEBUG) << *r << ": Created Cached " << *r;
   return r;
 }
 
@@ -325,24 +1066,271 @@ class TooFar : public std::exception {
   const char* what() const noexcept override { return "Too far"; }
 };
 
+void BufferedReader::GrowBuffer(const off_t size) {
+  // Round up to a power of 2, and to at least 4 KB. There is no need for a
+  // buffer bigger than the file.
+  const off_t needed = std::min(std::max<off_t>(size, 4096),
+                                std::max<off_t>(expected_size_, 4096));
+  const ssize_t new_size = std::min<off_t>(
+      std::bit_ceil(static_cast<std::uint64_t>(needed)), max_buffer_size_);
+  if (new_size <= buffer_size_)
+    return;
+
+  LOG(DEBUG) << *this << ": Growing rolling buffer from " << buffer_size_
+             << " to " << new_size << " bytes";
+  std::unique_ptr<char[]> buffer = std::make_unique_for_overwrite<char[]>(
+      static_cast<size_t>(new_size));
+
+  if (buffer_) {
+    // Keep the data in order, from the oldest to the newest byte.
+    const ssize_t n = buffer_size_ - buffer_start_;
+    std::memcpy(&buffer[0], &buffer_[buffer_start_], n);
+    std::memcpy(&buffer[n], &buffer_[0], buffer_start_);
+
+    // The rest of the new buffer doesn't hold any valid data yet.
+    restart_pos_ = std::max<off_t>(restart_pos_, pos_ - buffer_size_);
+  }
+
+  buffer_start_ = buffer_size_;
+  buffer_size_ = new_size;
+  buffer_ = std::move(buffer);
+}
+
 void BufferedReader::Restart() {
+  if (inflater_)
+    return Restart(nullptr);
+
   LOG(DEBUG) << *this << ": Rewind";
+  Count(g_stats.rewinds);
 
   // Restart from the file beginning.
   file_ = Open(zip_, file_id_);
   pos_ = 0;
+  restart_pos_ = 0;
+  buffer_start_ = 0;
+}
+
+void BufferedReader::Restart(const DeflateIndex::Point* const point) {
+  assert(inflater_);
+  const off_t in = point ? point->in : 0;
+
+  if (point) {
+    LOG(DEBUG) << *this << ": Restart from seek point at " << point->out;
+    Count(g_stats.seek_point_restarts);
+  } else {
+    LOG(DEBUG) << *this << ": Rewind";
+    Count(g_stats.rewinds);
+  }
+
+  bool seeked;
+  {
+    const std::lock_guard lock(zip_->mutex);
+    seeked = zip_fseek(file_.get(), in, SEEK_SET) == 0;
+  }
+
+  if (!seeked) {
+    // The compressed data is not seekable. Reopen the file and skip the
+    // compressed data up to the seek point.
+    LOG(DEBUG) << *this << ": Skipping " << in << " bytes of compressed data";
+    file_ = Open(zip_, file_id_, ZIP_FL_COMPRESSED);
+    const std::lock_guard lock(zip_->mutex);
+    for (off_t skipped = 0; skipped < in;) {
+      ssize_t count = buffer_size_;
+      LimitSize(&count, in - skipped);
+      const zip_int64_t n = zip_fread(file_.get(), buffer_.get(), count);
+      if (n < 0)
+        throw ZipError("Cannot read file", file_.get());
+      if (n == 0)
+        throw ZipError("Cannot read file", ZIP_ER_INCONS);
+      skipped += n;
+    }
+  }
+
+  inflater_->Reset(point);
+  pos_ = inflater_->pos();
+  restart_pos_ = pos_;
   buffer_start_ = 0;
 }
 
-bool BufferedReader::CreateCachedReader() const noexcept {
-  if (cached_reader_) {
+ssize_t BufferedReader::Decompress(char* const dest, const ssize_t size) {
+  const ScopedTime timer(g_stats.inflate_ns);
+  if (!inflater_) {
+    const ssize_t n = ReadAtCurrentPosition(dest, size);
+    Count(g_stats.inflated_bytes, n);
+    return n;
+  }
+
+  assert(size >= 0);
+  const auto source = [this](Bytef* const dest, const ssize_t size) {
+    const std::lock_guard lock(zip_->mutex);
+    const zip_int64_t n = zip_fread(file_.get(), dest, size);
+    if (n < 0)
+      throw ZipError("Cannot read file", file_.get());
+    return static_cast<ssize_t>(n);
+  };
+
+  if (pos_ >= expected_size_) {
+    // Check that the deflate stream ends here too, which also checks the CRC.
+    char c;
+    if (inflater_->Read(&c, 1, source) != 0)
+      throw ZipError("Cannot read file", ZIP_ER_INCONS);
+    return 0;
+  }
+
+  ssize_t n = size;
+  LimitSize(&n, expected_size_ - pos_);
+  n = inflater_->Read(dest, n, source);
+  pos_ += n;
+  assert(pos_ == inflater_->pos());
+  Count(g_stats.inflated_bytes, n);
+  return n;
+}
+
+// Background thread prefetching data for the BufferedReaders that are read
+// sequentially. The thread is started when first needed.
+class Prefetcher {
+ public:
+  static Prefetcher& Get() {
+    static Prefetcher prefetcher;
+    return prefetcher;
+  }
+
+  ~Prefetcher() {
+    {
+      const std::lock_guard lock(mutex_);
+      stop_ = true;
+    }
+
+    wake_.notify_all();
+    if (thread_.joinable())
+      thread_.join();
+  }
+
+  // Schedules the prefetching of data for the given |reader|, unless it is
+  // already scheduled.
+  void Schedule(BufferedReader* const reader) {
+    assert(reader);
+    const std::lock_guard lock(mutex_);
+    if (stop_ || reader == current_ ||
+        std::find(queue_.begin(), queue_.end(), reader) != queue_.end())
+      return;
+
+    if (!thread_.joinable())
+      thread_ = std::thread(&Prefetcher::Run, this);
+
+    queue_.push_back(reader);
+    wake_.notify_one();
+  }
+
+  // Unschedules the given |reader|. Waits for the prefetching thread to be
+  // done with it.
+  void Cancel(BufferedReader* const reader) {
+    std::unique_lock lock(mutex_);
+    std::erase(queue_, reader);
+    done_.wait(lock, [this, reader] { return current_ != reader; });
+  }
+
+ private:
+  Prefetcher() = default;
+
+  void Run() {
+    std::unique_lock lock(mutex_);
+    while (true) {
+      wake_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+      if (stop_)
+        return;
+
+      current_ = queue_.front();
+      queue_.pop_front();
+      lock.unlock();
+      current_->Prefetch();
+      lock.lock();
+      current_ = nullptr;
+      done_.notify_all();
+    }
+  }
+
+  // Mutex protecting all the following members.
+  std::mutex mutex_;
+
+  // Signaled when a reader is scheduled or when the thread has to stop.
+  std::condition_variable wake_;
+
+  // Signaled when the thread is done with |current_|.
+  std::condition_variable done_;
+
+  // Readers to prefetch data for.
+  std::deque<BufferedReader*> queue_;
+
+  // Reader currently being prefetched, if any.
+  BufferedReader* current_ = nullptr;
+
+  // Should the thread stop?
+  bool stop_ = false;
+
+  std::thread thread_;
+};
+
+BufferedReader::~BufferedReader() {
+  if (prefetch_size_ > 0)
+    Prefetcher::Get().Cancel(this);
+
+  if (shared_slot_) {
+    const std::lock_guard lock(cache_mutex);
+    if (*shared_slot_ == this)
+      *shared_slot_ = nullptr;
+  }
+}
+
+void BufferedReader::Prefetch() {
+  assert(prefetch_size_ <= max_prefetch_size);
+  try {
+    while (true) {
+      const std::lock_guard lock(mutex_);
+      const off_t end =
+          std::min<off_t>(next_offset_ + prefetch_size_, expected_size_);
+      if (cached_reader_ || pos_ >= end)
+        return;
+
+      // Keep the prefetched data and the data read so far, as long as the
+      // rolling buffer grows with the data read.
+      GrowBuffer(std::min<off_t>(end, min_buffer_size));
+
+      ssize_t count = 32 * 1024;
+      LimitSize(&count, end - pos_);
+      LimitSize(&count, buffer_size_ - buffer_start_);
+      count = Decompress(&buffer_[buffer_start_], count);
+      if (count == 0)
+        return;
+
+      buffer_start_ += count;
+      if (buffer_start_ == buffer_size_)
+        buffer_start_ = 0;
+    }
+  } catch (const std::exception& e) {
+    LOG(DEBUG) << *this << ": Cannot prefetch: " << e.what();
+  }
+}
+
+bool BufferedReader::CreateCachedReader() noexcept {
+  // Idle cached readers released to make room, deleted once cache_mutex is
+  // unlocked.
+  std::vector<Ptr> released;
+  const std::lock_guard lock(cache_mutex);
+
+  if (shared_cached_reader_) {
+    cached_reader_ = shared_cached_reader_->AddRef();
+    TouchCachedReader(&shared_cached_reader_);
     LOG(DEBUG) << *this << ": Switched to Cached " << *cached_reader_;
     return true;
   }
 
   try {
-    cached_reader_.reset(new CacheFileReader(zip_, file_id_, expected_size_));
+    shared_cached_reader_.reset(
+        new CacheFileReader(zip_, file_id_, expected_size_, index_));
+    cached_reader_ = shared_cached_reader_->AddRef();
     LOG(DEBUG) << *this << ": Created Cached " << *cached_reader_;
+    TrackCachedReader(&shared_cached_reader_, &released);
     return true;
   } catch (const std::exception& e) {
     LOG(ERROR) << *this << ": Cannot create Cached Reader: " << e.what();
@@ -356,8 +1344,25 @@ void BufferedReader::Advance(off_t jump) {
   if (jump <= 0)
     return;
 
-  if (jump > buffer_size_ && CreateCachedReader())
-    throw TooFar();
+  // Grow the rolling buffer rather than jumping too far, if possible.
+  if (jump > buffer_size_ && jump <= max_buffer_size_)
+    GrowBuffer(jump);
+
+  if (jump > buffer_size_) {
+    if (!index_) {
+      if (CreateCachedReader()) {
+        Count(g_stats.too_far);
+        throw TooFar();
+      }
+    } else if (const DeflateIndex::Point* const point =
+                   index_->Find(pos_ + jump);
+               point && point->out > pos_) {
+      // Skip to the closest seek point.
+      const off_t offset = pos_ + jump;
+      Restart(point);
+      jump = offset - pos_;
+    }
+  }
 
   const off_t start_pos = pos_;
   const off_t total_to_cache = jump;
@@ -373,7 +1378,7 @@ void BufferedReader::Advance(off_t jump) {
     LimitSize(&count, jump);
 
     assert(count > 0);
-    count = ReadAtCurrentPosition(&buffer_[buffer_start_], count);
+    count = Decompress(&buffer_[buffer_start_], count);
     if (count == 0)
       break;
 
@@ -405,10 +1410,19 @@ char* BufferedReader::ReadFromBufferAndAdvance(char* dest,
   // Jump backwards.
   assert(jump < 0);
 
-  if (jump + buffer_size_ < 0) {
-    // The backwards jump is too big and falls outside the buffer.
-    Restart();
-    Advance(offset);
+  if (jump + buffer_size_ < 0 || offset < restart_pos_) {
+    // The backwards jump is too big and falls outside the buffer. Grow the
+    // buffer for the next time, if possible.
+    if (jump + buffer_size_ < 0 && -jump <= max_buffer_size_)
+      GrowBuffer(-jump);
+
+    if (index_) {
+      Restart(index_->Find(offset));
+    } else {
+      Restart();
+    }
+
+    Advance(offset - pos_);
     return dest;
   }
 
@@ -441,21 +1455,15 @@ char* BufferedReader::ReadFromBufferAndAdvance(char* dest,
   return dest;
 }
 
-char* BufferedReader::Read(char* dest,
-                           char* const dest_end,
-                           const off_t offset) try {
-  if (dest == dest_end)
-    return dest;
-
-  if (use_cached_reader_)
-    return cached_reader_->Read(dest, dest_end, offset);
-
+char* BufferedReader::ReadAndDecompress(char* dest,
+                                        char* const dest_end,
+                                        const off_t offset) {
   // Read data from buffer if possible.
   dest = ReadFromBufferAndAdvance(dest, dest_end, offset);
 
   // Read data from file while keeping the rolling buffer up to date.
   while (
-      const ssize_t size = ReadAtCurrentPosition(
+      const ssize_t size = Decompress(
           &buffer_[buffer_start_],
           std::min<ssize_t>(dest_end - dest, buffer_size_ - buffer_start_))) {
     memcpy(dest, &buffer_[buffer_start_], size);
@@ -466,8 +1474,95 @@ char* BufferedReader::Read(char* dest,
   }
 
   return dest;
-} catch (const TooFar&) {
-  assert(cached_reader_);
-  use_cached_reader_ = true;
-  return cached_reader_->Read(dest, dest_end, offset);
+}
+
+char* BufferedReader::Read(char* const dest,
+                           char* const dest_end,
+                           const off_t offset) {
+  return Read(dest, dest_end, offset, false);
+}
+
+char* BufferedReader::ReadShared(char* const dest,
+                                 char* const dest_end,
+                                 const off_t offset) {
+  return Read(dest, dest_end, offset, true);
+}
+
+char* BufferedReader::Read(char* const dest,
+                           char* const dest_end,
+                           const off_t offset,
+                           const bool shared) {
+  if (dest == dest_end)
+    return dest;
+
+  // Only measures the read operations that are not delegated to the cached
+  // reader.
+  const Stopwatch stopwatch;
+  Reader* cached_reader;
+
+  {
+    std::unique_lock lock(mutex_);
+
+    if (!cached_reader_) {
+      // Don't restart the decompression engine if other readers are using it.
+      if (shared && ref_count_ > 1 &&
+          (offset < restart_pos_ || offset + buffer_size_ < pos_))
+        return nullptr;
+
+      try {
+        // Grow the rolling buffer with the data read, or allocate it.
+        GrowBuffer(
+            std::min<off_t>(offset + (dest_end - dest), min_buffer_size));
+        char* const end = ReadAndDecompress(dest, dest_end, offset);
+        Count(g_stats.buffered_reader_bytes, end - dest);
+        sequential_reads_ = offset == next_offset_ ? sequential_reads_ + 1 : 0;
+        next_offset_ = offset + (end - dest);
+        const bool prefetch = prefetch_size_ > 0 && sequential_reads_ >= 2 &&
+                              next_offset_ < expected_size_;
+        lock.unlock();
+        g_stats.buffered_reader_latency.Add(stopwatch.ns());
+
+        if (prefetch)
+          Prefetcher::Get().Schedule(this);
+
+        return end;
+      } catch (const TooFar&) {
+        assert(cached_reader_);
+      }
+    }
+
+    // Once set, cached_reader_ doesn't change anymore.
+    cached_reader = cached_reader_.get();
+  }
+
+  assert(cached_reader);
+  return cached_reader->Read(dest, dest_end, offset);
+}
+
+char* SharedReader::Read(char* const dest,
+                         char* const dest_end,
+                         const off_t offset) {
+  Reader* own;
+
+  {
+    const std::lock_guard lock(mutex_);
+
+    if (!own_) {
+      if (char* const end = stream_->ReadShared(dest, dest_end, offset))
+        return end;
+
+      LOG(DEBUG) << *this << ": Detaching from " << *stream_
+                 << " to read at offset " << offset;
+      Count(g_stats.shared_stream_detaches);
+      own_ = open_();
+      assert(own_);
+      stream_.reset();
+    }
+
+    // Once set, own_ doesn't change anymore.
+    own = own_.get();
+  }
+
+  assert(own);
+  return own->Read(dest, dest_end, offset);
 }
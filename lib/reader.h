@@ -16,21 +16,55 @@
 #ifndef READER_H
 #define READER_H
 
+#include <atomic>
 #include <cassert>
 #include <cstdint>
 #include <functional>
 #include <memory>
+#include <mutex>
 #include <ostream>
+#include <string>
 #include <string_view>
+#include <vector>
 
 #include <zip.h>
 
+#include "archive_file.h"
+#include "deflate_index.h"
 #include "log.h"
+#include "stats.h"
+#include "winzip_aes.h"
 
 using i64 = std::int64_t;
 
+// Handle on an open ZIP archive. The libzip objects are not thread-safe: the
+// zip_t and all the zip_file_t opened from it must only be used while holding
+// |mutex|.
+struct ZipHandle {
+  zip_t* const zip;
+  std::mutex mutex;
+
+  // ZIP archive file for direct reads, or null.
+  const ArchiveFile* const archive = nullptr;
+
+  // Password used to decrypt the files that are read directly, or null.
+  const std::string* const password = nullptr;
+};
+
 struct ZipClose {
-  void operator()(zip_file_t* const file) const { zip_fclose(file); }
+  // Handle of the ZIP archive the file was opened from, or null if the file
+  // can be closed without locking.
+  ZipHandle* zip = nullptr;
+
+  void operator()(zip_file_t* const file) const {
+    if (!zip) {
+      zip_fclose(file);
+      return;
+    }
+
+    const std::lock_guard lock(zip->mutex);
+    zip_fclose(file);
+  }
 };
 
 using ZipFile = std::unique_ptr<zip_file_t, ZipClose>;
@@ -67,6 +101,18 @@ class Reader {
     return Ptr(this);
   }
 
+  // Same as AddRef(), but returns null if the last reference has already been
+  // removed and this Reader is being deleted. The caller must make sure that
+  // this Reader hasn't been deleted yet.
+  Ptr TryAddRef() {
+    for (int n = ref_count_; n > 0;) {
+      if (ref_count_.compare_exchange_weak(n, n + 1))
+        return Ptr(this);
+    }
+
+    return nullptr;
+  }
+
   // Reads |dest_end - dest| bytes at the given file |offset| and stores them
   // into |dest|. Tries to fill the |dest| buffer, and only returns a "short
   // read" with fewer than |dest_end - dest| bytes if the end of the file is
@@ -75,13 +121,32 @@ class Reader {
   // ZipError in case of error
   virtual char* Read(char* dest, char* dest_end, off_t offset) = 0;
 
+  // Location of some data in a file.
+  struct FileRange {
+    int fd;
+    off_t pos;
+    ssize_t size;
+  };
+
+  // If the data at the given file |offset| can be read directly from a file,
+  // without going through this Reader, gets the location of up to |size|
+  // bytes of this data and returns true. The returned range is empty if the
+  // end of file has been reached.
+  virtual bool GetFileRange([[maybe_unused]] off_t offset,
+                            [[maybe_unused]] ssize_t size,
+                            [[maybe_unused]] FileRange* range) {
+    return false;
+  }
+
   // Output operator for logging.
   friend std::ostream& operator<<(std::ostream& out, const Reader& reader) {
     return out << "Reader " << reader.reader_id_;
   }
 
   // Opens the file at index |file_id|. Throws ZipError in case of error.
-  static ZipFile Open(zip_t* zip, i64 file_id);
+  // Locks |zip| while opening the file, and the returned ZipFile locks it again
+  // when closing the file.
+  static ZipFile Open(ZipHandle* zip, i64 file_id, zip_flags_t flags = 0);
 
   // Sets the cache strategy.
   static void SetCacheStrategy(CacheStrategy strategy);
@@ -89,6 +154,55 @@ class Reader {
   // Sets the cache strategy and directory.
   static void SetCacheDir(std::string_view dir);
 
+  // Sets the maximum number of bytes of decompressed data kept in the cache
+  // file, or 0 for no limit.
+  static void SetCacheSize(off_t size) { cache_size_ = size; }
+
+  // Sets the maximum size of the rolling buffer of each BufferedReader.
+  static void SetMaxBufferSize(ssize_t size) { max_buffer_size_ = size; }
+
+  // Sets the number of bytes to decompress in the background ahead of the
+  // sequential reads of compressed files, or 0 to disable prefetching.
+  static void SetPrefetchSize(ssize_t size) { prefetch_size_ = size; }
+
+  // Sets the distance between seek points in deflated files. If not zero,
+  // deflated files are decompressed with zlib and random accesses restart from
+  // the closest seek point rather than using the cache.
+  static void SetSeekSpan(off_t span) { seek_span_ = span; }
+
+  // Gets the distance between seek points in deflated files.
+  static off_t GetSeekSpan() { return seek_span_; }
+
+  // Sets the number of threads decompressing a deflated file in parallel
+  // from its seek points when caching it.
+  static void SetInflateThreads(int n) { inflate_threads_ = n; }
+
+  // Sets the number of cached files that are not open anymore and whose
+  // cached data is kept, or 0 for no limit.
+  static void SetMaxIdleCachedFiles(int n) { max_idle_cached_files_ = n; }
+
+  // Starts tracking the cached reader held in |slot|, which is shared between
+  // the readers of a same file. Then, if there are too many tracked cached
+  // readers that are not used by any other reader, releases the least recently
+  // used ones by moving them from their slots into |released|. The caller must
+  // delete them once Reader::cache_mutex is unlocked. Doesn't do anything if
+  // there is no limit on the number of idle cached files.
+  // Precondition: Reader::cache_mutex is held.
+  static void TrackCachedReader(Ptr* slot, std::vector<Ptr>* released);
+
+  // Marks the cached reader held in |slot| as the most recently used one, if
+  // it is tracked.
+  // Precondition: Reader::cache_mutex is held.
+  static void TouchCachedReader(Ptr* slot);
+
+  // Stops tracking the cached reader held in |slot|, if it is tracked.
+  // Precondition: Reader::cache_mutex is held.
+  static void UntrackCachedReader(Ptr* slot);
+
+  // Mutex protecting the cached readers shared between the readers of a same
+  // file.
+  static std::mutex cache_mutex;
+
  protected:
   virtual ~Reader() = default;
 
@@ -98,14 +212,32 @@ class Reader {
   // Directory in which the cache file is created if needed.
   static std::string cache_dir_;
 
+  // Maximum size of the cached data, or 0.
+  static off_t cache_size_;
+
+  // Distance between seek points in deflated files, or 0.
+  static off_t seek_span_;
+
+  // Number of bytes to prefetch ahead of sequential reads, or 0.
+  static ssize_t prefetch_size_;
+
+  // Maximum size of the rolling buffer of each BufferedReader.
+  static ssize_t max_buffer_size_;
+
+  // Number of threads decompressing a deflated file in parallel.
+  static int inflate_threads_;
+
+  // Maximum number of idle cached files, or 0.
+  static int max_idle_cached_files_;
+
   // Number of created Reader objects.
-  static i64 reader_count_;
+  static std::atomic<i64> reader_count_;
 
   // ID of this Reader (for debug traces).
   const i64 reader_id_ = ++reader_count_;
 
   // Reference count.
-  int ref_count_ = 1;
+  std::atomic<int> ref_count_ = 1;
 };
 
 // Reader taking its data from a string_view.
@@ -114,15 +246,73 @@ class StringReader : public Reader {
   explicit StringReader(std::string_view contents) : contents_(contents) {}
 
   char* Read(char* dest, char* dest_end, off_t offset) override {
-    return offset < contents_.size()
-               ? dest + contents_.copy(dest, dest_end - dest, offset)
-               : dest;
+    const ScopedLatency latency(g_stats.string_reader_latency);
+    if (offset >= contents_.size())
+      return dest;
+
+    const size_t n = contents_.copy(dest, dest_end - dest, offset);
+    Count(g_stats.string_reader_bytes, n);
+    return dest + n;
   }
 
  private:
   std::string_view contents_;
 };
 
+// Reader used for files that are stored without compression nor encryption
+// in the ZIP archive, and whose data position is known. It reads the data
+// directly from the ZIP archive file, without going through libzip, and it can
+// be used concurrently without locking.
+class DirectReader : public Reader {
+ public:
+  DirectReader(const int fd, const off_t data_offset, const off_t size)
+      : fd_(fd), data_offset_(data_offset), size_(size) {
+    assert(fd_ >= 0);
+    assert(data_offset_ >= 0);
+    assert(size_ >= 0);
+  }
+
+  char* Read(char* dest, char* dest_end, off_t offset) override;
+  bool GetFileRange(off_t offset, ssize_t size, FileRange* range) override;
+
+ private:
+  // File descriptor of the ZIP archive.
+  const int fd_;
+
+  // Position of the file data in the ZIP archive.
+  const off_t data_offset_;
+
+  // Size of the file data.
+  const off_t size_;
+};
+
+// Reader used for files that are stored without compression and encrypted
+// with WinZip AES in the ZIP archive, and whose data position is known. It
+// reads the encrypted data directly from the ZIP archive file, and decrypts it
+// itself, so that these files can be read in random order.
+class AesReader : public DirectReader {
+ public:
+  AesReader(const int fd,
+            const off_t data_offset,
+            const off_t size,
+            WinZipAes::Decryptor::Ptr decryptor)
+      : DirectReader(fd, data_offset, size), decryptor_(std::move(decryptor)) {
+    assert(decryptor_);
+  }
+
+  char* Read(char* dest, char* dest_end, off_t offset) override;
+
+  // The encrypted data cannot be passed as is.
+  bool GetFileRange(off_t, ssize_t, FileRange*) override { return false; }
+
+ private:
+  // Mutex protecting |decryptor_|.
+  std::mutex mutex_;
+
+  // Decryption engine, with its own cipher context.
+  const WinZipAes::Decryptor::Ptr decryptor_;
+};
+
 // Reader used for uncompressed files, ie files that are simply stored without
 // compression in the ZIP archive. These files can be accessed in random order,
 // and don't require any buffering.
@@ -130,10 +320,15 @@ class UnbufferedReader : public Reader {
  public:
   ~UnbufferedReader() override { LOG(DEBUG) << *this << ": Closed"; }
 
-  UnbufferedReader(ZipFile file, const i64 file_id, const off_t expected_size)
-      : file_id_(file_id),
+  UnbufferedReader(ZipHandle* const zip,
+                   ZipFile file,
+                   const i64 file_id,
+                   const off_t expected_size)
+      : zip_(zip),
+        file_id_(file_id),
         expected_size_(expected_size),
         file_(std::move(file)) {
+    assert(zip_);
     assert(file_);
   }
 
@@ -145,8 +340,12 @@ class UnbufferedReader : public Reader {
   // less than |size|. Returns 0 if |size| is 0. Returns 0 if the end of file
   // has been reached, and there is nothing left to be read. Updates the
   // current position pos_. Throws ZipError in case of error
+  // Precondition: mutex_ is held.
   ssize_t ReadAtCurrentPosition(char* dest, ssize_t size);
 
+  // Handle of the ZIP archive containing the file being read.
+  ZipHandle* const zip_;
+
   // ID of the file being read.
   const i64 file_id_;
 
@@ -158,41 +357,110 @@ class UnbufferedReader : public Reader {
 
   // Current position of the file being read.
   off_t pos_ = 0;
+
+  // Mutex protecting the state of this reader, since it can be accessed
+  // concurrently by several threads.
+  std::mutex mutex_;
 };
 
 // Reader used for compressed files. It features a decompression engine and a
-// rolling buffer of 256 KB holding the latest decompressed bytes.
+// rolling buffer holding the latest decompressed bytes.
 //
-// This is usually enough to accommodate the possible out-of-order read
-// operations due to the kernel's readahead optimization.
+// The rolling buffer is allocated on the first read, and grows with the data
+// read up to 256 KB (or the file size). This is usually enough to accommodate
+// the possible out-of-order read operations due to the kernel's readahead
+// optimization. It then keeps growing, up to |max_buffer_size_|, to absorb the
+// bigger jumps of the read operations.
 //
 // If a read operation starts at an offset located before the start of the
 // rolling buffer, then this BufferedReader restarts decompressing the file from
 // the beginning.
+//
+// If it is given a DeflateIndex, this BufferedReader decompresses the raw
+// deflate data of |file| with zlib, and restarts from the closest seek point
+// instead.
+//
+// If prefetching is enabled, once the file is being read sequentially, a
+// background thread decompresses the data following the last read operation
+// into the rolling buffer, where the next read operation will find it.
 class BufferedReader : public UnbufferedReader {
  public:
-  BufferedReader(zip_t* const zip,
+  BufferedReader(ZipHandle* const zip,
                  ZipFile file,
                  const i64 file_id,
                  const off_t expected_size,
-                 Reader::Ptr* const cached_reader)
-      : UnbufferedReader(std::move(file), file_id, expected_size),
-        zip_(zip),
-        cached_reader_(*cached_reader) {
-    assert(cached_reader);
-    assert(!cached_reader_);
+                 Reader::Ptr* const shared_cached_reader,
+                 std::shared_ptr<DeflateIndex> index = nullptr)
+      : UnbufferedReader(zip, std::move(file), file_id, expected_size),
+        shared_cached_reader_(*shared_cached_reader),
+        index_(std::move(index)) {
+    assert(shared_cached_reader);
+    if (index_)
+      inflater_ = std::make_unique<Inflater>(index_.get());
   }
 
+  ~BufferedReader() override;
+
   char* Read(char* dest, char* dest_end, off_t offset) override;
 
+  // Same as Read(), except when this BufferedReader is shared by several
+  // SharedReaders and |offset| is before the data held in the rolling buffer.
+  // In that case, returns null instead of restarting the decompression engine
+  // under the feet of the other readers.
+  char* ReadShared(char* dest, char* dest_end, off_t offset);
+
+  // Registers this BufferedReader in |*slot|, so that the readers opened
+  // while it is alive can attach to it. Resets |*slot| when this
+  // BufferedReader is deleted.
+  // Precondition: Reader::cache_mutex is held.
+  void Share(BufferedReader** slot) {
+    assert(slot);
+    assert(!shared_slot_);
+    shared_slot_ = slot;
+    *slot = this;
+  }
+
+  // Decompresses data into the rolling buffer, up to |prefetch_size_| bytes
+  // past the end of the last read. Releases the lock between chunks, so that
+  // a concurrent Read() doesn't have to wait long. Called by the prefetching
+  // thread.
+  void Prefetch();
+
+  // Largest allowed prefetch size. The prefetched data and the data that has
+  // been read but could be read again must both fit in the rolling buffer.
+  static const ssize_t max_prefetch_size = 128 * 1024;
+
+  // Size up to which the rolling buffer grows with the data read. Also the
+  // smallest allowed maximum size of the rolling buffer.
+  static constexpr ssize_t min_buffer_size = 256 * 1024;
+
  protected:
-  // Create cached reader if necessary.
-  bool CreateCachedReader() const noexcept;
+  // Creates the shared cached reader if necessary, and starts using it.
+  // Returns true if the cached reader is ready to be used.
+  bool CreateCachedReader() noexcept;
+
+  // Grows the rolling buffer if necessary, so that it can hold at least |size|
+  // bytes, within the limits of |max_buffer_size_| and of the file size.
+  // Keeps the data already held in the rolling buffer. Allocates the rolling
+  // buffer if it isn't allocated yet.
+  void GrowBuffer(off_t size);
 
   // Restarts decompressing from the beginning.
   // Throws a ZipError in case of error.
   void Restart();
 
+  // Restarts decompressing from the given seek |point|, or from the beginning
+  // if |point| is null.
+  // Throws a ZipError in case of error.
+  // Precondition: |inflater_| is set.
+  void Restart(const DeflateIndex::Point* point);
+
+  // Decompresses up to |size| bytes at the current position pos_ and stores
+  // them into |dest|. Returns the number of bytes actually decompressed, or 0
+  // if the end of file has been reached. Updates the current position pos_.
+  // Throws a ZipError in case of error.
+  ssize_t Decompress(char* dest, ssize_t size);
+
   // Advances the position of the decompression engine by |jump| bytes.
   // Throws a ZipError in case of error.
   // Throws a TooFar if |jump| to too big and cached reader is ready.
@@ -209,34 +477,105 @@ class BufferedReader : public UnbufferedReader {
   // Precondition: the buffer is allocated.
   char* ReadFromBufferAndAdvance(char* dest, char* dest_end, off_t offset);
 
-  // Pointer to the ZIP structure. Used when starting a second decompression
-  // pass.
-  zip_t* const zip_;
+  // Reads from the rolling buffer and from the decompression engine.
+  // Throws a TooFar if the cached reader should be used instead.
+  char* ReadAndDecompress(char* dest, char* dest_end, off_t offset);
+
+  // Implements Read() and ReadShared().
+  char* Read(char* dest, char* dest_end, off_t offset, bool shared);
+
+  // Reference to the shared cached reader. Protected by Reader::cache_mutex.
+  Reader::Ptr& shared_cached_reader_;
+
+  // Where this BufferedReader is registered for sharing, or null. Protected by
+  // Reader::cache_mutex.
+  BufferedReader** shared_slot_ = nullptr;
+
+  // Cached reader to use instead of the decompression engine, if any.
+  Reader::Ptr cached_reader_;
 
-  // Pointer to the shared cached reader.
-  Reader::Ptr& cached_reader_;
+  // Seek points of the deflate stream, shared with the other readers of the
+  // same file. Null if the file is decompressed by libzip.
+  const std::shared_ptr<DeflateIndex> index_;
 
-  // Should use the shared cached reader?
-  bool use_cached_reader_ = false;
+  // Decompression engine used with |index_|.
+  std::unique_ptr<Inflater> inflater_;
+
+  // Position at which the decompression engine last restarted, or at which the
+  // rolling buffer last grew. The rolling buffer doesn't hold any valid data
+  // before this position.
+  off_t restart_pos_ = 0;
 
   // Index of the rolling buffer where the oldest byte is currently stored
   // (and where the next decompressed byte at the file position |pos_| will be
   // stored).
-  // Invariant: 0 <= buffer_start_ < buffer_size_
+  // Invariant: 0 <= buffer_start_ < buffer_size_ once the buffer is allocated
   ssize_t buffer_start_ = 0;
 
-  // Size of the rolling buffer.
-  static const ssize_t buffer_size_ = 256 * 1024;
+  // Position following the last read data.
+  off_t next_offset_ = 0;
+
+  // Number of consecutive sequential reads.
+  int sequential_reads_ = 0;
+
+  // Size of the rolling buffer, or 0 if it isn't allocated yet.
+  ssize_t buffer_size_ = 0;
 
   // Rolling buffer.
-  char buffer_[buffer_size_];
+  std::unique_ptr<char[]> buffer_;
+};
+
+// Reader attached to a BufferedReader shared with the other readers opened
+// concurrently on the same compressed file, so that this file is only
+// decompressed once as long as these readers stay close to each other. Reads
+// lagging behind the rolling buffer of the shared BufferedReader make this
+// SharedReader detach from it and continue with a BufferedReader of its own.
+class SharedReader : public Reader {
+ public:
+  using Stream = std::unique_ptr<BufferedReader, RemoveRef>;
+
+  // Makes a new BufferedReader for a detached reader.
+  using Open = std::function<Reader::Ptr()>;
+
+  SharedReader(Stream stream, Open open)
+      : stream_(std::move(stream)), open_(std::move(open)) {
+    assert(stream_);
+    assert(open_);
+  }
+
+  char* Read(char* dest, char* dest_end, off_t offset) override;
+
+ private:
+  // Shared BufferedReader, or null once detached.
+  Stream stream_;
+
+  // Makes |own_| when detaching.
+  const Open open_;
+
+  // Reader used once detached from |stream_|. Doesn't change once set.
+  Reader::Ptr own_;
+
+  // Mutex protecting |stream_| and |own_|.
+  std::mutex mutex_;
 };
 
 // Cache the whole file contents. Returns a Reader that will be able to serve
-// the cached contents.
-Reader::Ptr CacheFile(ZipFile file,
+// the cached contents. If |index| is given, |file| must provide the raw deflate
+// data, which is decompressed with zlib.
+Reader::Ptr CacheFile(ZipHandle* zip,
+                      ZipFile file,
                       i64 file_id,
                       off_t expected_size,
-                      std::function<void(ssize_t)> progress = {});
+                      std::function<void(ssize_t)> progress = {},
+                      std::shared_ptr<DeflateIndex> index = nullptr);
+
+// Makes a Reader caching the file contents block by block as they get read,
+// rather than all at once. If |index| is given, |file| must provide the raw
+// deflate data, which is decompressed with zlib.
+Reader::Ptr MakeCachedReader(ZipHandle* zip,
+                             ZipFile file,
+                             i64 file_id,
+                             off_t expected_size,
+                             std::shared_ptr<DeflateIndex> index = nullptr);
 
 #endif
@@ -59,6 +59,9 @@ class FileMapping {
   // Start of the memory mapping.
   const void* data() const { return data_; }
 
+  // Size of the memory mapping.
+  size_t size() const { return size_; }
+
  private:
   void* data_;
   size_t size_;
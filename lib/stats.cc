@@ -0,0 +1,206 @@
+// Copyright 2021 Google LLC
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "stats.h"
+
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <cerrno>
+#include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <string_view>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "error.h"
+#include "log.h"
+
+Stats g_stats;
+
+int Histogram::GetBucket(const i64 ns) {
+  if (ns < 4)
+    return ns < 0 ? 0 : ns;
+
+  // Exponent and two most significant bits after the leading one.
+  const int e = std::bit_width(static_cast<uint64_t>(ns)) - 1;
+  const int m = static_cast<int>(ns >> (e - 2)) & 3;
+  return (e - 1) * 4 + m;
+}
+
+i64 Histogram::GetUpperBound(const int i) {
+  if (i < 4)
+    return i;
+
+  const int e = i / 4 + 1;
+  const i64 m = i % 4 + 4;
+  return ((m + 1) << (e - 2)) - 1;
+}
+
+void Histogram::Add(const i64 ns) {
+  const int i = GetBucket(ns);
+  assert(i >= 0);
+  assert(i < bucket_count_);
+  buckets_[i].fetch_add(1, std::memory_order_relaxed);
+}
+
+i64 Histogram::count() const {
+  i64 n = 0;
+  for (const std::atomic<i64>& bucket : buckets_)
+    n += bucket.load(std::memory_order_relaxed);
+  return n;
+}
+
+i64 Histogram::Quantile(const double q) const {
+  i64 counts[bucket_count_];
+  i64 total = 0;
+  for (int i = 0; i < bucket_count_; ++i)
+    total += counts[i] = buckets_[i].load(std::memory_order_relaxed);
+
+  if (total == 0)
+    return 0;
+
+  const i64 rank = std::max<i64>(1, std::ceil(q * total));
+  i64 n = 0;
+  for (int i = 0; i < bucket_count_; ++i) {
+    n += counts[i];
+    if (n >= rank)
+      return GetUpperBound(i);
+  }
+
+  return GetUpperBound(bucket_count_ - 1);
+}
+
+std::string Stats::ToString() const {
+  static const struct {
+    std::string_view name;
+    Counter Stats::*counter;
+  } counters[] = {
+      {"string_reader_bytes", &Stats::string_reader_bytes},
+      {"direct_reader_bytes", &Stats::direct_reader_bytes},
+      {"unbuffered_reader_bytes", &Stats::unbuffered_reader_bytes},
+      {"buffered_reader_bytes", &Stats::buffered_reader_bytes},
+      {"cache_file_reader_bytes", &Stats::cache_file_reader_bytes},
+      {"rewinds", &Stats::rewinds},
+      {"seek_point_restarts", &Stats::seek_point_restarts},
+      {"too_far", &Stats::too_far},
+      {"shared_stream_attaches", &Stats::shared_stream_attaches},
+      {"shared_stream_detaches", &Stats::shared_stream_detaches},
+      {"archive_reads", &Stats::archive_reads},
+      {"archive_read_bytes", &Stats::archive_read_bytes},
+      {"cache_reserved_bytes", &Stats::cache_reserved_bytes},
+      {"cache_written_bytes", &Stats::cache_written_bytes},
+      {"cache_punched_bytes", &Stats::cache_punched_bytes},
+      {"cache_mapped_bytes", &Stats::cache_mapped_bytes},
+      {"cache_evictions", &Stats::cache_evictions},
+      {"idle_cache_releases", &Stats::idle_cache_releases},
+      {"decrypted_bytes", &Stats::decrypted_bytes},
+      {"corrupted_files", &Stats::corrupted_files},
+      {"inflated_bytes", &Stats::inflated_bytes},
+      {"inflate_ns", &Stats::inflate_ns},
+      {"attribute_loads", &Stats::attribute_loads},
+      {"verified_bytes", &Stats::verified_bytes},
+      {"lookup_hits", &Stats::lookup_hits},
+      {"lookup_misses", &Stats::lookup_misses},
+  };
+
+  static const struct {
+    std::string_view name;
+    Histogram Stats::*histogram;
+  } histograms[] = {
+      {"getattr_latency", &Stats::getattr_latency},
+      {"open_latency", &Stats::open_latency},
+      {"read_latency", &Stats::read_latency},
+      {"readdir_latency", &Stats::readdir_latency},
+      {"readlink_latency", &Stats::readlink_latency},
+      {"string_reader_latency", &Stats::string_reader_latency},
+      {"direct_reader_latency", &Stats::direct_reader_latency},
+      {"unbuffered_reader_latency", &Stats::unbuffered_reader_latency},
+      {"buffered_reader_latency", &Stats::buffered_reader_latency},
+      {"cache_file_reader_latency", &Stats::cache_file_reader_latency},
+  };
+
+  // Don't use an ostream, since the global locale could add thousands
+  // separators.
+  std::string out;
+  const auto append = [&out](const std::string_view name,
+                             const std::string_view suffix, const i64 value) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), " %lld\n", static_cast<long long>(value));
+    out.append(name);
+    out.append(suffix);
+    out.append(buf);
+  };
+
+  for (const auto& [name, counter] : counters)
+    append(name, "", (this->*counter).load(std::memory_order_relaxed));
+
+  for (const auto& [name, histogram] : histograms) {
+    const Histogram& h = this->*histogram;
+    append(name, "_count", h.count());
+    append(name, "_p50_ns", h.Quantile(0.5));
+    append(name, "_p99_ns", h.Quantile(0.99));
+    append(name, "_p999_ns", h.Quantile(0.999));
+  }
+
+  return out;
+}
+
+// Write end of the pipe used by the signal handler.
+static int signal_pipe = -1;
+
+static void OnSignal(int) {
+  const int saved_errno = errno;
+  const char c = 0;
+  // Only async-signal-safe functions can be used here.
+  [[maybe_unused]] const ssize_t n = write(signal_pipe, &c, 1);
+  errno = saved_errno;
+}
+
+void LogStatsOnSignal(const int sig) {
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC) < 0)
+    ThrowSystemError("Cannot create pipe");
+
+  signal_pipe = fds[1];
+  std::thread([fd = fds[0]] {
+    char c;
+    while (true) {
+      const ssize_t n = read(fd, &c, 1);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        break;
+
+      const std::string stats = g_stats.ToString();
+      std::string_view s = stats;
+      while (!s.empty()) {
+        const size_t i = s.find('\n');
+        LOG(INFO) << "Stats: " << s.substr(0, i);
+        s.remove_prefix(i + 1);
+      }
+    }
+  }).detach();
+
+  struct sigaction sa = {};
+  sa.sa_handler = OnSignal;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(sig, &sa, nullptr) < 0)
+    ThrowSystemError("Cannot install signal handler");
+}
@@ -0,0 +1,189 @@
+// Copyright 2021 Google LLC
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+using i64 = std::int64_t;
+
+// Distribution of durations, in log-linear buckets with four buckets per power
+// of two. This gives the quantiles with a precision of 25%. This class is
+// thread-safe.
+class Histogram {
+ public:
+  // Records a duration of |ns| nanoseconds.
+  void Add(i64 ns);
+
+  // Number of recorded durations.
+  i64 count() const;
+
+  // Gets an upper bound of the quantile |q| (between 0 and 1) of the recorded
+  // durations, in nanoseconds. Returns 0 if nothing has been recorded.
+  i64 Quantile(double q) const;
+
+ private:
+  // Gets the index of the bucket holding |ns|.
+  static int GetBucket(i64 ns);
+
+  // Gets the largest duration held by the bucket |i|.
+  static i64 GetUpperBound(int i);
+
+  static constexpr int bucket_count_ = 256;
+  std::atomic<i64> buckets_[bucket_count_] = {};
+};
+
+// Performance counters. They are cheap enough to be always enabled: each one
+// is an atomic integer updated with relaxed memory ordering.
+struct Stats {
+  using Counter = std::atomic<i64>;
+
+  // Bytes served by each type of reader.
+  Counter string_reader_bytes = 0;
+  Counter direct_reader_bytes = 0;
+  Counter unbuffered_reader_bytes = 0;
+  Counter buffered_reader_bytes = 0;
+  Counter cache_file_reader_bytes = 0;
+
+  // Restarts of the decompression from the beginning of a file.
+  Counter rewinds = 0;
+
+  // Restarts of the decompression from a seek point.
+  Counter seek_point_restarts = 0;
+
+  // BufferedReaders switching to a cached reader because of a jump too far.
+  Counter too_far = 0;
+
+  // Readers attaching to the decompression stream of a file already being
+  // read, and detaching from it because they lagged behind.
+  Counter shared_stream_attaches = 0;
+  Counter shared_stream_detaches = 0;
+
+  // Reads of the ZIP archive by libzip through the read-ahead chunks, and
+  // bytes read.
+  Counter archive_reads = 0;
+  Counter archive_read_bytes = 0;
+
+  // Bytes reserved, written and given back in the cache file.
+  Counter cache_reserved_bytes = 0;
+  Counter cache_written_bytes = 0;
+  Counter cache_punched_bytes = 0;
+
+  // Bytes read from the cache file through its memory mapping.
+  Counter cache_mapped_bytes = 0;
+
+  // Blocks evicted from the cache.
+  Counter cache_evictions = 0;
+
+  // Cached files released because they were not open anymore.
+  Counter idle_cache_releases = 0;
+
+  // Bytes decrypted by AesReaders.
+  Counter decrypted_bytes = 0;
+
+  // Files failing an integrity check.
+  Counter corrupted_files = 0;
+
+  // Bytes decompressed, and time spent decompressing them in nanoseconds.
+  Counter inflated_bytes = 0;
+  Counter inflate_ns = 0;
+
+  // File nodes whose attributes have been decoded when first needed.
+  Counter attribute_loads = 0;
+
+  // Bytes checked by Tree::Verify().
+  Counter verified_bytes = 0;
+
+  // Lookups of file nodes by the FUSE operations.
+  Counter lookup_hits = 0;
+  Counter lookup_misses = 0;
+
+  // Latencies of the FUSE operations.
+  Histogram getattr_latency;
+  Histogram open_latency;
+  Histogram read_latency;
+  Histogram readdir_latency;
+  Histogram readlink_latency;
+
+  // Latencies of the read operations of each type of reader.
+  Histogram string_reader_latency;
+  Histogram direct_reader_latency;
+  Histogram unbuffered_reader_latency;
+  Histogram buffered_reader_latency;
+  Histogram cache_file_reader_latency;
+
+  // Gets all the counters, and the count and quantiles of the latencies, one
+  // per line, as "name value".
+  std::string ToString() const;
+};
+
+// Global performance counters.
+extern Stats g_stats;
+
+// Adds |n| to the given |counter|.
+inline void Count(Stats::Counter& counter, const i64 n = 1) {
+  counter.fetch_add(n, std::memory_order_relaxed);
+}
+
+// Measures the time elapsed since its construction.
+class Stopwatch {
+ public:
+  // Elapsed time in nanoseconds.
+  i64 ns() const {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() -
+                                                                start_)
+        .count();
+  }
+
+ private:
+  using Clock = std::chrono::steady_clock;
+  const Clock::time_point start_ = Clock::now();
+};
+
+// Measures the time spent in its scope, and adds it in nanoseconds to the
+// given counter.
+class ScopedTime {
+ public:
+  explicit ScopedTime(Stats::Counter& counter) : counter_(counter) {}
+  ScopedTime(const ScopedTime&) = delete;
+  ~ScopedTime() { Count(counter_, stopwatch_.ns()); }
+
+ private:
+  Stats::Counter& counter_;
+  const Stopwatch stopwatch_;
+};
+
+// Measures the time spent in its scope, and records it in the given histogram.
+class ScopedLatency {
+ public:
+  explicit ScopedLatency(Histogram& histogram) : histogram_(histogram) {}
+  ScopedLatency(const ScopedLatency&) = delete;
+  ~ScopedLatency() { histogram_.Add(stopwatch_.ns()); }
+
+ private:
+  Histogram& histogram_;
+  const Stopwatch stopwatch_;
+};
+
+// Logs all the counters whenever this process receives the signal |sig|, for
+// example SIGUSR1. Starts a background thread. Should only be called once.
+// Throws std::system_error in case of error.
+void LogStatsOnSignal(int sig);
+
+#endif  // STATS_H
@@ -23,11 +23,16 @@
 #include <cctype>
 #include <cerrno>
 #include <cstring>
+#include <exception>
 #include <functional>
 #include <iomanip>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <stdexcept>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include <termios.h>
@@ -166,6 +171,33 @@ void RemoveNumericSuffix(std::string& s) {
   s.resize(i);
 }
 
+// Compares two paths component by component. This is the lexicographic order,
+// except that the separator '/' comes before any other character. All the
+// paths starting with a given directory path are thus contiguous when sorted.
+bool ComparePaths(const std::string_view a, const std::string_view b) {
+  const auto [i, j] = std::mismatch(a.begin(), a.end(), b.begin(), b.end());
+  if (j == b.end())
+    return false;
+  if (i == a.end())
+    return true;
+  if (*i == '/' || *j == '/')
+    return *i == '/';
+  return static_cast<unsigned char>(*i) < static_cast<unsigned char>(*j);
+}
+
+// Counts the components of the normalized directory path |dir| that are not
+// components of the normalized directory path |prev|.
+size_t CountNewComponents(const std::string_view dir,
+                          const std::string_view prev) {
+  size_t i = std::mismatch(dir.begin(), dir.end(), prev.begin(), prev.end())
+                 .first -
+             dir.begin();
+  // Back off to the end of the last common component.
+  if ((i < dir.size() && dir[i] != '/') || (i < prev.size() && prev[i] != '/'))
+    i = dir.rfind('/', i - 1);
+  return std::count(dir.begin() + i, dir.end(), '/');
+}
+
 }  // namespace
 
 bool Tree::ReadPasswordFromStdIn() {
@@ -198,6 +230,7 @@ bool Tree::ReadPasswordFromStdIn() {
   if (zip_set_default_password(zip_, password.c_str()) < 0)
     throw ZipError("Cannot set password", zip_);
 
+  password_ = std::move(password);
   return true;
 }
 
@@ -241,18 +274,19 @@ using CharsetDetectorPtr = std::unique_ptr<UCharsetDetector, Closer>;
 class ConverterToUtf8 {
  public:
   // Creates a converter that will convert strings from the given encoding to
-  // UTF-8. Allocates internal buffers to handle strings up to
-  // `maxInputLength`. Throws an exception in case of error.
-  ConverterToUtf8(const char* const fromEncoding, const size_t maxInputLength)
-      : from(Open(fromEncoding)), to(Open("UTF-8")) {
-    utf16.resize(2 * maxInputLength + 1);
-    utf8.resize(3 * maxInputLength + 1);
-  }
+  // UTF-8. Throws an exception in case of error.
+  explicit ConverterToUtf8(const char* const fromEncoding)
+      : from(Open(fromEncoding)), to(Open("UTF-8")) {}
 
   // Converts the given string to UTF-8. Returns a string_view to the internal
   // buffer holding the null-terminated result. Returns an empty string_view in
-  // case of error.
+  // case of error. Grows the internal buffers as needed.
   std::string_view operator()(const std::string_view in) {
+    if (utf16.size() < 2 * in.size() + 1)
+      utf16.resize(2 * in.size() + 1);
+    if (utf8.size() < 3 * in.size() + 1)
+      utf8.resize(3 * in.size() + 1);
+
     UErrorCode error = U_ZERO_ERROR;
     const int32_t len16 = ucnv_toUChars(from.get(), utf16.data(), utf16.size(),
                                         in.data(), in.size(), &error);
@@ -327,20 +361,73 @@ std::string DetectEncoding(const std::string_view bytes) {
   return std::string();
 }
 
+// Entry of the ZIP archive, parsed independently of the other entries.
+struct Entry {
+  // Result of zip_stat_index().
+  zip_stat_t sb;
+
+  // Handle on the ZIP archive with which this entry was parsed. The names it
+  // returns are only valid as long as it stays open.
+  zip_t* zip = nullptr;
+
+  // Original path as recorded in the ZIP archive.
+  Path original_path = "-";
+
+  // Normalized UTF-8 path.
+  std::string path;
+
+  // UNIX mode and PkWare hardlink flag.
+  mode_t mode = 0;
+  bool is_hardlink = false;
+
+  // Inode data, without inode number. Not set for hardlinks.
+  std::optional<DataNode> data;
+};
+
+// Gets the stats of the entry at index |id|.
+// Throws a ZipError in case of error.
+zip_stat_t StatEntry(zip_t* const zip,
+                     const i64 id,
+                     const zip_flags_t flags) {
+  zip_stat_t sb;
+  if (zip_stat_index(zip, id, flags, &sb) < 0)
+    throw ZipError(StrCat("Cannot read entry #", id), zip);
+  return sb;
+}
+
+// Gets the name of the entry described by |sb|, or "-" if it has none.
+Path GetName(const zip_stat_t& sb) {
+  return (sb.valid & ZIP_STAT_NAME) != 0 && sb.name && *sb.name ? sb.name
+                                                                 : "-";
+}
+
+// Closes the given ZIP archive handle.
+void CloseZip(zip_t* const zip) {
+  assert(zip);
+  if (zip_close(zip) != 0)
+    LOG(ERROR) << "Error while closing archive: " << zip_strerror(zip);
+}
+
 }  // namespace
 
 Tree::~Tree() {
+  StopWarming();
+  StopScrubbing();
+
 #ifndef NDEBUG
   files_by_original_path_.clear();
 
   for (FileNode& node : files_by_path_)
     node.children.clear();
+
+  files_by_path_.clear();
 #endif
 
-  files_by_path_.clear_and_dispose(std::default_delete<FileNode>());
+  // Delete the nodes and their cached readers before closing the ZIP archive.
+  nodes_.Clear();
 
-  if (zip_close(zip_) != 0)
-    LOG(ERROR) << "Error while closing archive: " << zip_strerror(zip_);
+  for (const std::unique_ptr<ZipHandle>& handle : zips_)
+    CloseZip(handle->zip);
 }
 
 size_t Tree::GetBucketCount(zip_t* zip) {
@@ -350,215 +437,843 @@ size_t Tree::GetBucketCount(zip_t* zip) {
   return std::bit_floor(n | 16u);
 }
 
+void Tree::SetUpEncoding() {
+  std::string encoding;
+  if (opts_.encoding)
+    encoding = opts_.encoding;
+  if (encoding.empty() || encoding == "auto") {
+    // Concatenate the names of the first entries in a buffer in order to guess
+    // the encoding. Only these first entries are read twice.
+    const i64 n = zip_get_num_entries(zip_, 0);
+    std::string names;
+    names.reserve(10000);
+    for (i64 id = 0; id < n; ++id) {
+      zip_stat_t sb;
+      if (zip_stat_index(zip_, id, ZIP_FL_ENC_RAW, &sb) < 0)
+        throw ZipError(StrCat("Cannot read entry #", id), zip_);
+
+      if ((sb.valid & ZIP_STAT_NAME) == 0 || !sb.name || !*sb.name)
+        continue;
+
+      const std::string_view name = sb.name;
+      if (names.size() + name.size() > names.capacity())
+        break;
+
+      names.append(name);
+    }
+
+    encoding = DetectEncoding(names);
+  }
+
+  // By default, just rely on the conversion to UTF-8 provided by libzip.
+  zip_flags_ = ZIP_FL_ENC_GUESS;
+  encoding_.clear();
+
+  // But if the filename encoding is one of the encodings we want to convert
+  // using ICU, check that ICU can convert it.
+  if (!encoding.empty() && encoding != "libzip") {
+    try {
+      if (encoding != "raw") {
+        const ConverterToUtf8 converter(encoding.c_str());
+        encoding_ = std::move(encoding);
+      }
+      zip_flags_ = ZIP_FL_ENC_RAW;
+    } catch (const std::exception& e) {
+      LOG(ERROR) << e.what();
+    }
+  }
+}
+
+Tree::ToUtf8 Tree::MakeToUtf8() const {
+  if (encoding_.empty())
+    return [](std::string_view s) { return s; };
+
+  // The ICU converter has internal buffers.
+  return [converter = std::make_shared<ConverterToUtf8>(encoding_.c_str())](
+             std::string_view s) { return (*converter)(s); };
+}
+
 void Tree::BuildTree() {
   const i64 n = zip_get_num_entries(zip_, 0);
 
-  FileNode::Ptr root(new FileNode{
-      .zip = zip_, .data = {.nlink = 2, .mode = S_IFDIR | 0755}, .name = "/"});
+  FileNode* const root = nodes_.New([] {
+    return FileNode{.data = {.nlink = 2, .mode = S_IFDIR | 0755}, .name = "/"};
+  });
   assert(!root->parent);
   [[maybe_unused]] const auto [pos, ok] = files_by_path_.insert(*root);
   assert(ok);
-  root.release();  // Now owned by |files_by_path_|.
+
+  SetUpEncoding();
+  const zip_flags_t zipFlags = zip_flags_;
+
+  // Parses the entry at index |id| with the given ZIP archive handle. This
+  // doesn't depend on the other entries, and can be done in parallel.
+  const auto parse = [this, zipFlags](zip_t* const zip, const i64 id,
+                                      const ToUtf8& toUtf8, Entry* const e) {
+    zip_stat_t& sb = e->sb;
+    if (zip_stat_index(zip, id, zipFlags, &sb) < 0)
+      throw ZipError(StrCat("Cannot read entry #", id), zip);
+
+    e->zip = zip;
+    if ((sb.valid & ZIP_STAT_NAME) != 0 && sb.name && *sb.name)
+      e->original_path = sb.name;
+    e->path = Path(toUtf8(e->original_path)).Normalized();
+    const auto [mode, is_hardlink] =
+        GetEntryAttributes(zip, id, e->original_path);
+    e->mode = mode;
+    e->is_hardlink = is_hardlink;
+    if (!is_hardlink)
+      e->data.emplace(MakeDataNode(zip, sb, mode));
+  };
+
+  // Use several threads only if there are enough entries for each of them.
+  const i64 thread_count =
+      std::clamp<i64>(n / 4096, 1, std::max(opts_.parse_threads, 1));
+
+  // Number of entries parsed in parallel before being added to the tree.
+  const i64 batch_size = thread_count * 16384;
+
+  // Handles and converters used by the threads. The first thread uses |zip_|.
+  std::vector<std::unique_ptr<ZipHandle>> handles(thread_count);
+  std::vector<ToUtf8> converters(thread_count);
+  std::vector<std::exception_ptr> errors(thread_count);
+
+  // Closes the extra handles that are not kept, even in case of error.
+  struct HandleCloser {
+    std::vector<std::unique_ptr<ZipHandle>>& handles;
+    ~HandleCloser() {
+      for (const std::unique_ptr<ZipHandle>& handle : handles) {
+        if (handle)
+          CloseZip(handle->zip);
+      }
+    }
+  } const closer{handles};
+
+  // Parses the entries of the current batch.
+  std::vector<Entry> entries;
+  const auto parse_batch = [&](const i64 batch_start) {
+    const i64 count = entries.size();
+    const i64 chunk = (count + thread_count - 1) / thread_count;
+    const auto work = [&](const i64 i) {
+      try {
+        zip_t* zip = zip_;
+        if (i > 0) {
+          if (!handles[i])
+            handles[i] = OpenZipHandle();
+          zip = handles[i]->zip;
+        }
+
+        if (!converters[i])
+          converters[i] = MakeToUtf8();
+
+        for (i64 j = i * chunk; j < std::min(count, (i + 1) * chunk); ++j)
+          parse(zip, batch_start + j, converters[i], &entries[j]);
+      } catch (...) {
+        errors[i] = std::current_exception();
+      }
+    };
+
+    std::vector<std::thread> threads;
+    threads.reserve(thread_count - 1);
+    for (i64 i = 1; i < thread_count; ++i)
+      threads.emplace_back(work, i);
+
+    work(0);
+
+    for (std::thread& thread : threads)
+      thread.join();
+
+    // Report the error of the first entry that failed.
+    for (const std::exception_ptr& error : errors) {
+      if (error)
+        std::rethrow_exception(error);
+    }
+  };
+
+  if (thread_count > 1)
+    LOG(DEBUG) << "Parsing " << n << " entries with " << thread_count
+               << " threads";
+
+  struct Hardlink {
+    zip_stat_t sb;
+    Path original_path;
+    std::string path;
+    mode_t mode;
+  };
+
+  std::vector<Hardlink> hardlinks;
 
   // Sum of all uncompressed file sizes.
   uint64_t total_uncompressed_size = 0;
-  zip_stat_t sb;
 
-  // Concatenate all the names in a buffer in order to guess the encoding.
-  std::string all_names;
-  all_names.reserve(10000);
-  size_t max_name_length = 0;
+  // Add zip entries for all items except hardlinks, in a single pass over the
+  // central directory. The entries of a batch are parsed in parallel, and then
+  // added to the tree in order, so that name collisions are resolved
+  // deterministically.
+  for (i64 batch_start = 0; batch_start < n; batch_start += batch_size) {
+    entries.clear();
+    entries.resize(std::min(batch_size, n - batch_start));
+    parse_batch(batch_start);
+
+    for (Entry& entry : entries) {
+      const zip_stat_t& sb = entry.sb;
+      const i64 id = sb.index;
+      if (entry.zip != zip_) {
+        // Take the name from |zip_|, which stays open as long as the tree.
+        const char* const name = zip_get_name(zip_, id, zipFlags);
+        entry.original_path = name && *name ? name : "-";
+      }
+
+      if ((sb.valid & ZIP_STAT_SIZE) != 0)
+        total_uncompressed_size += sb.size;
+
+      const Path original_path = entry.original_path;
+      const std::string& path = entry.path;
+      const mode_t mode = entry.mode;
+      const FileType type = GetFileType(mode);
+
+      if (type == FileType::Directory) {
+        FileNode* const node = CreateDir(path);
+        assert(node->link == &node->data);
+        const ino_t ino = node->data.ino;
+        const nlink_t nlink = node->data.nlink;
+        assert(nlink >= 2);
+        assert(entry.data);
+        node->data = std::move(*entry.data);
+        node->data.ino = ino;
+        node->data.nlink = nlink;
+        // Keep numbering the inodes as when each entry got a new DataNode.
+        ++DataNode::ino_count;
+        node->original_path = Path(original_path).WithoutTrailingSeparator();
+        total_block_count_ += 1;
+        continue;
+      }
+
+      if (type != FileType::File &&
+          (type == FileType::Symlink ? !opts_.include_symlinks
+                                     : !opts_.include_special_files)) {
+        LOG(INFO) << "Skipped " << type << " [" << id << "] " << Path(path);
+        continue;
+      }
+
+      if (entry.is_hardlink) {
+        if (opts_.include_hardlinks) {
+          hardlinks.push_back({sb, original_path, std::move(entry.path), mode});
+        } else {
+          LOG(INFO) << "Skipped " << type << " [" << id << "] " << Path(path);
+        }
+        continue;
+      }
+
+      const auto [parent_path, name] = Path(path).Split();
+      FileNode* const parent = CreateDir(parent_path);
+      assert(entry.data);
+      FileNode* const node = CreateFile(std::move(*entry.data), parent, name);
+      assert(node->parent == parent);
+      parent->AddChild(node);
+      node->original_path = original_path;
+      files_by_original_path_.insert(*node);
+      total_block_count_ += 1;
+      total_block_count_ += node->operator DataNode::Stat().st_blocks;
+
+      if (!zip_encryption_method_supported(sb.encryption_method, 1)) {
+        ZipError e(StrCat("Cannot decrypt ", *node, ": ",
+                          EncryptionMethod(sb.encryption_method)),
+                   ZIP_ER_ENCRNOTSUPP);
+        if (opts_.check_compression)
+          throw std::move(e);
+        LOG(ERROR) << e.what();
+      }
+
+      if (!zip_compression_method_supported(sb.comp_method, 1)) {
+        ZipError e(StrCat("Cannot decompress ", *node, ": ",
+                          CompressionMethod(sb.comp_method)),
+                   ZIP_ER_COMPNOTSUPP);
+        if (opts_.check_compression)
+          throw std::move(e);
+        LOG(ERROR) << e.what();
+      }
+
+      // Check the password on encrypted files.
+      if ((sb.valid & ZIP_STAT_ENCRYPTION_METHOD) != 0 &&
+          sb.encryption_method != ZIP_EM_NONE) {
+        if (!encrypted_node_)
+          encrypted_node_ = node;
+        CheckPassword(node);
+      }
+    }
+  }
+
+  LOG(DEBUG) << "Total uncompressed size = " << total_uncompressed_size
+             << " bytes";
+
+  // Keep the extra handles for serving requests later, or close them if they
+  // are not needed.
+  for (std::unique_ptr<ZipHandle>& handle : handles) {
+    if (handle && zips_.size() < static_cast<size_t>(opts_.threads) &&
+        (password_.empty() ||
+         zip_set_default_password(handle->zip, password_.c_str()) == 0))
+      zips_.push_back(std::move(handle));
+  }
+
+  // Add hardlinks
+  for (const auto& [sb, original_path, path, mode] : hardlinks) {
+    const auto [parent_path, name] = Path(path).Split();
+    FileNode* const parent = CreateDir(parent_path);
+    FileNode* node = CreateHardlink(sb, parent, name, mode);
+    assert(node->parent == parent);
+    parent->AddChild(node);
+    node->original_path = original_path;
+    files_by_original_path_.insert(*node);
+    total_block_count_ += 1;
+  }
+
+  LOG(DEBUG) << "Nodes = " << GetNodeCount();
+  LOG(DEBUG) << "Blocks = " << total_block_count_;
+}
+
+void Tree::BuildLazyIndex() {
+  const std::lock_guard lock(mutex_);
+  const i64 n = zip_get_num_entries(zip_, 0);
+
+  FileNode* const root = nodes_.New([] {
+    return FileNode{.data = {.nlink = 2, .mode = S_IFDIR | 0755},
+                    .name = "/",
+                    .expanded = false};
+  });
+  assert(!root->parent);
+  [[maybe_unused]] const auto [pos, ok] = files_by_path_.insert(*root);
+  assert(ok);
+
+  SetUpEncoding();
+  to_utf8_ = MakeToUtf8();
 
-  // search for absolute or parent-relative paths
+  // Sum of all uncompressed file sizes.
+  uint64_t total_uncompressed_size = 0;
+
+  // First encrypted file entry, if any.
+  i64 encrypted_id = -1;
+  std::string_view encrypted_path;
+
+  // Only index the entries. Their nodes are created later, when needed.
+  lazy_entries_.reserve(n);
   for (i64 id = 0; id < n; ++id) {
-    if (zip_stat_index(zip_, id, ZIP_FL_ENC_RAW, &sb) < 0)
-      throw ZipError(StrCat("Cannot read entry #", id), zip_);
+    const zip_stat_t sb = StatEntry(zip_, id, zip_flags_);
+    const Path original_path = GetName(sb);
+    const std::string path = Path(to_utf8_(original_path)).Normalized();
+    const auto [mode, is_hardlink] =
+        GetEntryAttributes(zip_, id, original_path);
+    const FileType type = GetFileType(mode);
 
     if ((sb.valid & ZIP_STAT_SIZE) != 0)
       total_uncompressed_size += sb.size;
 
-    if ((sb.valid & ZIP_STAT_NAME) == 0 || !sb.name || !*sb.name)
+    if (type == FileType::Directory) {
+      total_block_count_ += 1;
+      if (path == "/") {
+        // Entry of the root directory.
+        const ino_t ino = root->data.ino;
+        root->data = MakeDataNode(zip_, sb, mode);
+        root->data.ino = ino;
+        root->data.nlink = 2;
+        root->original_path = original_path.WithoutTrailingSeparator();
+        continue;
+      }
+    } else if (type != FileType::File &&
+               (type == FileType::Symlink ? !opts_.include_symlinks
+                                          : !opts_.include_special_files)) {
+      LOG(INFO) << "Skipped " << type << " [" << id << "] " << Path(path);
       continue;
+    } else if (is_hardlink) {
+      if (!opts_.include_hardlinks) {
+        LOG(INFO) << "Skipped " << type << " [" << id << "] " << Path(path);
+        continue;
+      }
 
-    const std::string_view name = sb.name;
-    if (max_name_length < name.size())
-      max_name_length = name.size();
+      total_block_count_ += 1;
+    } else {
+      // The size of a special file depends on its extra fields. Only read
+      // them for these rare entries.
+      const zip_uint64_t size = type == FileType::File
+                                    ? sb.size
+                                    : MakeDataNode(zip_, sb, mode).size;
+      total_block_count_ += 1;
+      total_block_count_ += (size + block_size - 1) / block_size;
+
+      if (!zip_encryption_method_supported(sb.encryption_method, 1)) {
+        ZipError e(StrCat("Cannot decrypt ", type, " [", id, "] ", Path(path),
+                          ": ", EncryptionMethod(sb.encryption_method)),
+                   ZIP_ER_ENCRNOTSUPP);
+        if (opts_.check_compression)
+          throw std::move(e);
+        LOG(ERROR) << e.what();
+      }
 
-    if (all_names.size() + name.size() <= all_names.capacity())
-      all_names.append(name);
+      if (!zip_compression_method_supported(sb.comp_method, 1)) {
+        ZipError e(StrCat("Cannot decompress ", type, " [", id, "] ",
+                          Path(path), ": ", CompressionMethod(sb.comp_method)),
+                   ZIP_ER_COMPNOTSUPP);
+        if (opts_.check_compression)
+          throw std::move(e);
+        LOG(ERROR) << e.what();
+      }
+    }
+
+    lazy_entries_.push_back({.path = names_.Add(path),
+                             .id = id,
+                             .mode = mode,
+                             .is_hardlink = is_hardlink});
+
+    if (encrypted_id < 0 && !is_hardlink &&
+        (sb.valid & ZIP_STAT_ENCRYPTION_METHOD) != 0 &&
+        sb.encryption_method != ZIP_EM_NONE) {
+      encrypted_id = id;
+      encrypted_path = lazy_entries_.back().path;
+    }
   }
 
   LOG(DEBUG) << "Total uncompressed size = " << total_uncompressed_size
              << " bytes";
 
-  // Detect filename encoding.
-  std::string encoding;
-  if (opts_.encoding)
-    encoding = opts_.encoding;
-  if (encoding.empty() || encoding == "auto")
-    encoding = DetectEncoding(all_names);
-  all_names.clear();
+  std::sort(lazy_entries_.begin(), lazy_entries_.end(),
+            [](const LazyEntry& a, const LazyEntry& b) {
+              return a.path != b.path ? ComparePaths(a.path, b.path)
+                                      : a.id < b.id;
+            });
+
+  // Count the nodes of the full tree, including the intermediate directories,
+  // without creating them. The directories are visited in depth-first order.
+  // Only the files named like a directory come before the entries below this
+  // directory.
+  lazy_node_count_ = 1;
+  std::string_view last_dir;
+  for (const auto& [path, id, mode, is_hardlink] : lazy_entries_) {
+    const bool is_dir = GetFileType(mode) == FileType::Directory;
+    const std::string_view dir =
+        is_dir ? path : path.substr(0, path.rfind('/'));
+    if (const size_t n = CountNewComponents(dir, last_dir)) {
+      lazy_node_count_ += n;
+      last_dir = dir;
+    }
 
-  // Prepare functor to convert filenames to UTF-8.
-  // By default, just rely on the conversion to UTF-8 provided by libzip.
-  std::function<std::string_view(std::string_view)> toUtf8 =
-      [](std::string_view s) { return s; };
-  zip_flags_t zipFlags = ZIP_FL_ENC_GUESS;
+    lazy_node_count_ += !is_dir;
+  }
 
-  // But if the filename encoding is one of the encodings we want to convert
-  // using ICU, prepare and use the ICU converter.
-  if (!encoding.empty() && encoding != "libzip") {
-    try {
-      if (encoding != "raw")
-        toUtf8 = [converter = std::make_shared<ConverterToUtf8>(
-                      encoding.c_str(), max_name_length)](std::string_view s) {
-          return (*converter)(s);
-        };
-      zipFlags = ZIP_FL_ENC_RAW;
-    } catch (const std::exception& e) {
-      LOG(ERROR) << e.what();
+  Expand(root);
+
+  // Check the password on the first encrypted file.
+  if (encrypted_id >= 0) {
+    const FileNode* const parent =
+        FindLocked(Path(encrypted_path).Split().first);
+    assert(parent);
+    for (const FileNode& node : parent->children) {
+      if (node.id == encrypted_id) {
+        encrypted_node_ = &node;
+        CheckPassword(&node);
+        break;
+      }
     }
   }
 
-  struct Hardlink {
-    i64 id;
-    mode_t mode;
+  LOG(DEBUG) << "Indexed " << lazy_entries_.size() << " entries";
+  LOG(DEBUG) << "Nodes = " << GetNodeCount();
+  LOG(DEBUG) << "Blocks = " << total_block_count_;
+}
+
+void Tree::Expand(FileNode* const dir) {
+  assert(dir);
+  assert(dir->is_dir());
+  if (dir->expanded)
+    return;
+
+  // Mark it first, since creating a hardlink might look up its parent again.
+  dir->expanded = true;
+
+  std::string prefix = dir->path();
+  if (!prefix.ends_with('/'))
+    prefix += '/';
+
+  // Find the first entry below |dir|.
+  const auto end = lazy_entries_.end();
+  auto it = std::lower_bound(lazy_entries_.begin(), end, prefix,
+                             [](const LazyEntry& e, const std::string_view p) {
+                               return ComparePaths(e.path, p);
+                             });
+
+  // Is the current entry below |dir|?
+  const auto in_dir = [&] { return it != end && it->path.starts_with(prefix); };
+
+  // Is the current entry below the given |path|?
+  const auto below = [&](const std::string_view path) {
+    return in_dir() && it->path.size() > path.size() &&
+           it->path[path.size()] == '/' && it->path.starts_with(path);
   };
 
-  std::vector<Hardlink> hardlinks;
+  // Entries of the files and hardlinks directly in |dir|.
+  std::vector<const LazyEntry*> files;
+
+  nlink_t nlink = 2;
+
+  // Create the subdirectories first, so that they keep their names in case of
+  // collision, and count their own subdirectories.
+  while (in_dir()) {
+    const std::string_view rest = it->path.substr(prefix.size());
+    const std::string_view name = rest.substr(0, rest.find('/'));
+    const std::string_view path =
+        it->path.substr(0, prefix.size() + name.size());
+
+    // Entries named |path|. The last directory entry wins.
+    const LazyEntry* dir_entry = nullptr;
+    for (; in_dir() && it->path == path; ++it) {
+      if (GetFileType(it->mode) == FileType::Directory) {
+        dir_entry = &*it;
+      } else {
+        files.push_back(&*it);
+      }
+    }
+
+    // Entries below |path|, which is then a directory.
+    bool has_entries_below = false;
+    nlink_t child_nlink = 2;
+    std::string_view last_subdir;
+    for (; below(path); ++it) {
+      has_entries_below = true;
+      const std::string_view sub = it->path.substr(path.size() + 1);
+      const std::string_view sub_name = sub.substr(0, sub.find('/'));
+      if ((sub_name.size() < sub.size() ||
+           GetFileType(it->mode) == FileType::Directory) &&
+          sub_name != last_subdir) {
+        ++child_nlink;
+        last_subdir = sub_name;
+      }
+    }
+
+    if (!dir_entry && !has_entries_below)
+      continue;
+
+    FileNode* const child = nodes_.New([&] {
+      return FileNode{.data = {.nlink = child_nlink, .mode = S_IFDIR | 0755},
+                      .parent = dir,
+                      .name = names_.Add(name),
+                      .expanded = false};
+    });
+
+    if (dir_entry) {
+      const zip_stat_t sb = LockAndStat(dir_entry->id);
+      const ino_t ino = child->data.ino;
+      child->data = LockAndMakeDataNode(sb, dir_entry->mode);
+      child->data.ino = ino;
+      child->data.nlink = child_nlink;
+      child->original_path = GetName(sb).WithoutTrailingSeparator();
+    }
+
+    dir->AddChild(child);
+    [[maybe_unused]] const auto [pos, ok] = files_by_path_.insert(*child);
+    assert(ok);
+    ++nlink;
+  }
+
+  // The link counts of the other directories have been computed when creating
+  // them.
+  if (!dir->parent)
+    dir->data.nlink = nlink;
+  assert(dir->link->nlink == nlink);
+
+  // Create the files in the order of their entries, and then the hardlinks,
+  // since their targets must already exist.
+  std::sort(files.begin(), files.end(),
+            [](const LazyEntry* const a, const LazyEntry* const b) {
+              return a->is_hardlink != b->is_hardlink ? b->is_hardlink
+                                                      : a->id < b->id;
+            });
+
+  for (const LazyEntry* const e : files) {
+    const zip_stat_t sb = LockAndStat(e->id);
+    const std::string_view name = Path(e->path).Split().second;
+    FileNode* const node =
+        e->is_hardlink
+            ? CreateHardlink(sb, dir, name, e->mode)
+            : CreateFile(LockAndMakeDataNode(sb, e->mode), dir, name);
+    assert(node->parent == dir);
+    dir->AddChild(node);
+    node->original_path = GetName(sb);
+    files_by_original_path_.insert(*node);
+  }
+
+  LOG(DEBUG) << "Created the nodes of " << *dir;
+}
+
+void Tree::Clear() {
+  files_by_original_path_.clear();
+
+  for (FileNode& node : files_by_path_)
+    node.children.clear();
+
+  files_by_path_.clear();
+  nodes_.Clear();
+  names_.Clear();
+  total_block_count_ = 1;
+  encrypted_node_ = nullptr;
+}
+
+void Tree::PreCache() {
+  // Collect the nodes holding file data.
+  std::vector<FileNode*> nodes;
+  for (FileNode& node : files_by_path_) {
+    if (node.id >= 0 && node.link == &node.data && !node.is_dir())
+      nodes.push_back(&node);
+  }
+
+  if (nodes.empty())
+    return;
+
+  // Start with the biggest files, so that the work is evenly spread over the
+  // threads.
+  std::sort(nodes.begin(), nodes.end(),
+            [](const FileNode* const a, const FileNode* const b) {
+              return a->data.size != b->data.size ? a->data.size > b->data.size
+                                                  : a->id < b->id;
+            });
+
+  // Sum of all the uncompressed sizes to cache.
+  uint64_t total_size = 0;
+  for (const FileNode* const node : nodes)
+    total_size += node->data.size;
+
+  const size_t thread_count =
+      std::clamp<size_t>(opts_.pre_cache_threads, 1, nodes.size());
+  LOG(DEBUG) << "Caching " << nodes.size() << " files (" << total_size
+             << " bytes) with " << thread_count << " threads";
+
+  // Protects the progress report and the first error.
+  std::mutex mutex;
   Beat should_display_progress;
   uint64_t total_extracted_size = 0;
-  const auto progress = [&should_display_progress, &total_uncompressed_size,
-                         &total_extracted_size](const ssize_t chunk_size) {
+  std::exception_ptr error;
+
+  const auto progress = [&](const ssize_t chunk_size) {
     assert(chunk_size >= 0);
+    const std::lock_guard lock(mutex);
     total_extracted_size += chunk_size;
     if (should_display_progress)
       LOG(INFO) << "Loading "
-                << (total_extracted_size < total_uncompressed_size
-                        ? 100 * total_extracted_size / total_uncompressed_size
+                << (total_extracted_size < total_size
+                        ? 100 * total_extracted_size / total_size
                         : 100)
                 << "%";
   };
 
-  // Add zip entries for all items except hardlinks
-  for (i64 id = 0; id < n; ++id) {
-    if (zip_stat_index(zip_, id, zipFlags, &sb) < 0)
-      throw ZipError(StrCat("Cannot read entry #", id), zip_);
-
-    const Path original_path =
-        (sb.valid & ZIP_STAT_NAME) != 0 && sb.name && *sb.name ? sb.name : "-";
-    const std::string path = Path(toUtf8(original_path)).Normalized();
-    const uint64_t size = (sb.valid & ZIP_STAT_SIZE) != 0 ? sb.size : 0;
-    const auto [mode, is_hardlink] = GetEntryAttributes(id, original_path);
-    const FileType type = GetFileType(mode);
+  // Index of the next node to cache.
+  std::atomic<size_t> next = 0;
 
-    if (type == FileType::Directory) {
-      FileNode* const node = CreateDir(path);
-      assert(node->link == &node->data);
-      const ino_t ino = node->data.ino;
-      const nlink_t nlink = node->data.nlink;
-      assert(nlink >= 2);
-      node->data = DataNode::Make(zip_, id, mode);
-      node->data.ino = ino;
-      node->data.nlink = nlink;
-      node->original_path = Path(original_path).WithoutTrailingSeparator();
-      total_block_count_ += 1;
-      assert(total_uncompressed_size >= size);
-      total_uncompressed_size -= size;
-      continue;
+  // Handles opened by the worker threads.
+  std::vector<std::unique_ptr<ZipHandle>> handles(thread_count);
+
+  // Caches nodes until there is nothing left to do, or until an error occurs.
+  const auto work = [&](const size_t i) {
+    try {
+      ZipHandle* zip = zips_.front().get();
+      if (i > 0) {
+        handles[i] = OpenZipHandle();
+        zip = handles[i].get();
+      }
+
+      for (size_t j; (j = next++) < nodes.size();) {
+        FileNode* const node = nodes[j];
+        try {
+          if (!node->CacheAll(zip, progress)) {
+            const std::lock_guard lock(mutex);
+            assert(total_size >= node->data.size);
+            total_size -= node->data.size;
+          }
+        } catch (const ZipError& e) {
+          LOG(ERROR) << "Cannot cache " << *node << ": " << e.what();
+          if (opts_.check_password)
+            throw;
+        }
+      }
+    } catch (...) {
+      // Stop the other threads.
+      next = nodes.size();
+      const std::lock_guard lock(mutex);
+      if (!error)
+        error = std::current_exception();
     }
+  };
 
-    if (type != FileType::File &&
-        (type == FileType::Symlink ? !opts_.include_symlinks
-                                   : !opts_.include_special_files)) {
-      LOG(INFO) << "Skipped " << type << " [" << id << "] " << Path(path);
-      assert(total_uncompressed_size >= size);
-      total_uncompressed_size -= size;
+  std::vector<std::thread> threads;
+  threads.reserve(thread_count - 1);
+  for (size_t i = 1; i < thread_count; ++i)
+    threads.emplace_back(work, i);
+
+  work(0);
+
+  for (std::thread& thread : threads)
+    thread.join();
+
+  // Keep the extra handles for serving requests later, or close them if they
+  // are not needed.
+  for (std::unique_ptr<ZipHandle>& handle : handles) {
+    if (!handle)
       continue;
+    if (zips_.size() < static_cast<size_t>(opts_.threads)) {
+      zips_.push_back(std::move(handle));
+    } else {
+      CloseZip(handle->zip);
     }
+  }
 
-    if (is_hardlink) {
-      if (opts_.include_hardlinks) {
-        hardlinks.push_back({id, mode});
-      } else {
-        LOG(INFO) << "Skipped " << type << " [" << id << "] " << Path(path);
-      }
-      assert(total_uncompressed_size >= size);
-      total_uncompressed_size -= size;
+  if (error) {
+    if (opts_.check_password)
+      LOG(INFO) << "Use the --force option to continue even if some files "
+                   "cannot be cached";
+    std::rethrow_exception(error);
+  }
+
+  if (should_display_progress.Count())
+    LOG(INFO) << "Loaded 100%";
+}
+
+void Tree::StartWarming() {
+  if (warm_ranges_.empty() || warm_thread_.joinable())
+    return;
+
+  warm_thread_ = std::thread(&Tree::Warm, this);
+}
+
+void Tree::StopWarming() {
+  if (!warm_thread_.joinable())
+    return;
+
+  stop_warming_ = true;
+  warm_thread_.join();
+}
+
+void Tree::Warm() {
+  const Timer timer;
+
+  // Index the file nodes by entry.
+  std::unordered_map<i64, FileNode*> nodes;
+  for (FileNode& node : files_by_path_) {
+    if (node.id >= 0 && !node.is_dir())
+      nodes.emplace(node.id, &node);
+  }
+
+  i64 count = 0;
+  i64 total_size = 0;
+  for (const AccessProfile::Range& r : warm_ranges_) {
+    const auto it = nodes.find(r.id);
+    if (it == nodes.end() || it->second->original_path != r.path) {
+      LOG(DEBUG) << "Cannot warm entry [" << r.id << "] " << Path(r.path)
+                 << ": No matching file";
       continue;
     }
 
-    const auto [parent_path, name] = Path(path).Split();
-    FileNode* const parent = CreateDir(parent_path);
-    FileNode* const node = CreateFile(id, parent, name, mode);
-    assert(node->parent == parent);
-    parent->AddChild(node);
-    node->original_path = original_path;
-    files_by_original_path_.insert(*node);
-    total_block_count_ += 1;
-    total_block_count_ += node->operator DataNode::Stat().st_blocks;
-
-    if (!zip_encryption_method_supported(sb.encryption_method, 1)) {
-      ZipError e(StrCat("Cannot decrypt ", *node, ": ",
-                        EncryptionMethod(sb.encryption_method)),
-                 ZIP_ER_ENCRNOTSUPP);
-      if (opts_.check_compression)
-        throw std::move(e);
-      LOG(ERROR) << e.what();
-    }
+    FileNode* const node = it->second;
+    try {
+      // Proceed in chunks of 1 MB, so that the thread can be stopped.
+      const off_t chunk_size = 1 << 20;
+      for (off_t pos = r.offset; pos < r.offset + r.size; pos += chunk_size) {
+        if (stop_warming_)
+          return;
 
-    if (!zip_compression_method_supported(sb.comp_method, 1)) {
-      ZipError e(StrCat("Cannot decompress ", *node, ": ",
-                        CompressionMethod(sb.comp_method)),
-                 ZIP_ER_COMPNOTSUPP);
-      if (opts_.check_compression)
-        throw std::move(e);
-      LOG(ERROR) << e.what();
+        const ssize_t n = std::min<off_t>(chunk_size, r.offset + r.size - pos);
+        if (!node->Warm(GetZipHandle(), pos, n))
+          break;
+
+        total_size += n;
+      }
+
+      ++count;
+    } catch (const ZipError& e) {
+      LOG(ERROR) << "Cannot warm " << *node << ": " << e.what();
+    } catch (const std::exception& e) {
+      LOG(ERROR) << "Cannot warm " << *node << ": " << e.what();
+      return;
     }
+  }
 
-    // Check the password on encrypted files.
-    if ((sb.valid & ZIP_STAT_ENCRYPTION_METHOD) != 0 &&
-        sb.encryption_method != ZIP_EM_NONE) {
-      CheckPassword(node);
+  LOG(DEBUG) << "Warmed " << count << " ranges (" << total_size
+             << " bytes) in " << timer;
+  warm_ranges_ = {};
+}
+
+i64 Tree::Verify() {
+  const Timer timer;
+
+  // Collect the nodes holding file data.
+  std::vector<const FileNode*> nodes;
+  for (const FileNode& node : files_by_path_) {
+    if (node.id >= 0 && node.link == &node.data && !node.is_dir())
+      nodes.push_back(&node);
+  }
+
+  if (nodes.empty())
+    return 0;
+
+  const size_t thread_count =
+      std::clamp<size_t>(opts_.verify_threads, 1, nodes.size());
+  LOG(DEBUG) << "Verifying " << nodes.size() << " files with " << thread_count
+             << " threads";
+
+  // Index of the next node to verify.
+  std::atomic<size_t> next = 0;
+
+  // Number of files failing the check.
+  std::atomic<i64> corrupted_count = 0;
+
+  // Verifies nodes with a separate handle on the ZIP archive, until there is
+  // nothing left to do or until stopped.
+  const auto work = [&] {
+    std::unique_ptr<ZipHandle> zip;
+    try {
+      zip = OpenZipHandle();
+    } catch (const std::exception& e) {
+      LOG(ERROR) << "Cannot verify files: " << e.what();
+      return;
     }
 
-    // Cache file data if necessary.
-    if (opts_.pre_cache) {
+    for (size_t i; !stop_verifying_ && (i = next++) < nodes.size();) {
+      const FileNode* const node = nodes[i];
       try {
-        if (!node->CacheAll(progress)) {
-          assert(total_uncompressed_size >= size);
-          total_uncompressed_size -= size;
-        }
-      } catch (const ZipError& error) {
-        LOG(ERROR) << "Cannot cache " << *node << ": " << error.what();
-        if (opts_.check_password) {
-          LOG(INFO) << "Use the --force option to continue even if some files "
-                       "cannot be cached";
-          throw;
-        }
+        if (!node->Verify(zip.get(), stop_verifying_))
+          ++corrupted_count;
+      } catch (const std::exception& e) {
+        LOG(ERROR) << "Cannot verify " << *node << ": " << e.what();
       }
     }
-  }
 
-  // Add hardlinks
-  for (const auto [id, mode] : hardlinks) {
-    const Path original_path = zip_get_name(zip_, id, zipFlags);
-    const std::string path = Path(toUtf8(original_path)).Normalized();
-    const auto [parent_path, name] = Path(path).Split();
-    FileNode* const parent = CreateDir(parent_path);
-    FileNode* node = CreateHardlink(id, parent, name, mode);
-    assert(node->parent == parent);
-    parent->AddChild(node);
-    node->original_path = original_path;
-    files_by_original_path_.insert(*node);
-    total_block_count_ += 1;
-  }
+    CloseZip(zip->zip);
+  };
 
-  if (should_display_progress.Count())
-    LOG(INFO) << "Loaded 100%";
+  std::vector<std::thread> threads;
+  threads.reserve(thread_count - 1);
+  for (size_t i = 1; i < thread_count; ++i)
+    threads.emplace_back(work);
 
-  LOG(DEBUG) << "Nodes = " << GetNodeCount();
-  LOG(DEBUG) << "Blocks = " << total_block_count_;
+  work();
+
+  for (std::thread& thread : threads)
+    thread.join();
+
+  LOG(DEBUG) << "Verified " << nodes.size() << " files in " << timer << ": "
+             << corrupted_count << " corrupted";
+  return corrupted_count;
+}
+
+void Tree::StartScrubbing() {
+  if (!opts_.scrub || opts_.verify || verify_thread_.joinable())
+    return;
+
+  verify_thread_ = std::thread(&Tree::Verify, this);
+}
+
+void Tree::StopScrubbing() {
+  if (!verify_thread_.joinable())
+    return;
+
+  stop_verifying_ = true;
+  verify_thread_.join();
 }
 
 void Tree::CheckPassword(const FileNode* const node) {
@@ -599,13 +1314,14 @@ void Tree::CheckPassword(const FileNode* const node) {
 }
 
 Tree::EntryAttributes Tree::GetEntryAttributes(
+    zip_t* const zip,
     const zip_uint64_t id,
     const std::string_view original_path) {
   const bool is_dir = original_path.ends_with('/');
 
   zip_uint8_t opsys;
   zip_uint32_t attr;
-  zip_file_get_external_attributes(zip_, id, 0, &opsys, &attr);
+  zip_file_get_external_attributes(zip, id, 0, &opsys, &attr);
 
   mode_t mode = attr >> 16;
   bool is_hardlink = false;
@@ -670,17 +1386,17 @@ Tree::EntryAttributes Tree::GetEntryAttributes(
   return {mode, is_hardlink};
 }
 
-FileNode* Tree::Attach(FileNode::Ptr node) {
+FileNode* Tree::Attach(FileNode* const node) {
   assert(node);
   const auto [pos, ok] = files_by_path_.insert(*node);
   if (ok)
-    return node.release();  // Now owned by |files_by_path_|.
+    return node;
 
   // There is a name collision
   LOG(DEBUG) << *node << " conflicts with " << *pos;
 
   // Extract filename extension
-  std::string& f = node->name;
+  std::string f(node->name);
   const std::string::size_type e = Path(f).ExtensionPosition();
   const std::string ext(f, e);
   f.resize(e);
@@ -693,11 +1409,14 @@ FileNode* Tree::Attach(FileNode::Ptr node) {
         StrCat(" (", std::to_string(i ? ++*i + 1 : 1), ")", ext);
     f.assign(base, 0, Path(base).TruncationPosition(NAME_MAX - suffix.size()));
     f += suffix;
+    node->name = f;
 
     const auto [pos, ok] = files_by_path_.insert(*node);
     if (ok) {
+      // Store the new name. This doesn't change the hash of the node's path.
+      node->name = names_.Add(f);
       LOG(DEBUG) << "Resolved conflict for " << *node;
-      return node.release();  // Now owned by |files_by_path_|.
+      return node;
     }
 
     LOG(DEBUG) << *node << " conflicts with " << *pos;
@@ -706,44 +1425,61 @@ FileNode* Tree::Attach(FileNode::Ptr node) {
   }
 }
 
-FileNode* Tree::CreateFile(i64 id,
+FileNode* Tree::CreateFile(DataNode data,
                            FileNode* parent,
-                           std::string_view name,
-                           mode_t mode) {
+                           std::string_view name) {
   assert(parent);
   assert(!name.empty());
+  const i64 id = data.id;
   assert(id >= 0);
-  return Attach(
-      FileNode::Ptr(new FileNode{.zip = zip_,
-                                 .id = id,
-                                 .data = DataNode::Make(zip_, id, mode),
-                                 .parent = parent,
-                                 .name = std::string(name)}));
+  data.ino = ++DataNode::ino_count;
+  return Attach(nodes_.New([&] {
+    return FileNode{.id = id,
+                    .data = std::move(data),
+                    .parent = parent,
+                    .name = names_.Add(name)};
+  }));
 }
 
-FileNode* Tree::CreateHardlink(i64 id,
+zip_stat_t Tree::LockAndStat(const i64 id) {
+  const std::lock_guard lock(zips_.front()->mutex);
+  return StatEntry(zip_, id, zip_flags_);
+}
+
+DataNode Tree::LockAndMakeDataNode(const zip_stat_t& sb, const mode_t mode) {
+  const std::lock_guard lock(zips_.front()->mutex);
+  return MakeDataNode(zip_, sb, mode);
+}
+
+FileNode* Tree::CreateHardlink(const zip_stat_t& sb,
                                FileNode* parent,
                                std::string_view name,
                                mode_t mode) {
   assert(parent);
   assert(!name.empty());
+  const i64 id = sb.index;
   assert(id >= 0);
 
-  FileNode::Ptr node(new FileNode{
-      .zip = zip_, .id = id, .parent = parent, .name = std::string(name)});
+  FileNode* const node = nodes_.New([&] {
+    return FileNode{.id = id, .parent = parent, .name = names_.Add(name)};
+  });
 
   zip_uint16_t len;
-  const zip_uint8_t* field = zip_file_extra_field_get_by_id(
-      zip_, id, FZ_EF_PKWARE_UNIX, 0, &len, ZIP_FL_CENTRAL);
-
-  if (!field)
+  const zip_uint8_t* field;
+  {
+    const std::lock_guard lock(zips_.front()->mutex);
     field = zip_file_extra_field_get_by_id(zip_, id, FZ_EF_PKWARE_UNIX, 0, &len,
-                                           ZIP_FL_LOCAL);
+                                           ZIP_FL_CENTRAL);
+
+    if (!field)
+      field = zip_file_extra_field_get_by_id(zip_, id, FZ_EF_PKWARE_UNIX, 0,
+                                             &len, ZIP_FL_LOCAL);
+  }
 
   if (!field) {
     // Ignoring hardlink without PKWARE UNIX field
     LOG(INFO) << "Cannot find PkWare Unix field for hardlink " << *node;
-    return CreateFile(id, parent, name, mode);
+    return CreateFile(LockAndMakeDataNode(sb, mode), parent, name);
   }
 
   time_t mt, at;
@@ -756,22 +1492,30 @@ FileNode* Tree::CreateHardlink(i64 id,
   if (!ExtraField::parsePkWareUnixField(len, field, mode, mt, at, uid, gid, dev,
                                         link, link_len)) {
     LOG(WARNING) << "Cannot parse PkWare Unix field for hardlink " << *node;
-    return CreateFile(id, parent, name, mode);
+    return CreateFile(LockAndMakeDataNode(sb, mode), parent, name);
   }
 
   if (link_len == 0 || !link) {
     LOG(ERROR) << "Cannot get target for hardlink " << *node;
-    return CreateFile(id, parent, name, mode);
+    return CreateFile(LockAndMakeDataNode(sb, mode), parent, name);
   }
 
   const std::string_view target_path(link, link_len);
 
-  const auto it = files_by_original_path_.find(
+  auto it = files_by_original_path_.find(
       Path(target_path).WithoutTrailingSeparator());
+  if (it == files_by_original_path_.end() && opts_.lazy) {
+    // The target might be in a directory whose nodes haven't been created yet.
+    const std::string path = Path(to_utf8_(target_path)).Normalized();
+    FindLocked(Path(path).Split().first);
+    it = files_by_original_path_.find(
+        Path(target_path).WithoutTrailingSeparator());
+  }
+
   if (it == files_by_original_path_.end()) {
     LOG(ERROR) << "Cannot find target for hardlink " << *node << " -> "
                << Path(target_path);
-    return CreateFile(id, parent, name, mode);
+    return CreateFile(LockAndMakeDataNode(sb, mode), parent, name);
   }
 
   const FileNode& target = *it;
@@ -782,26 +1526,48 @@ FileNode* Tree::CreateHardlink(i64 id,
       LOG(ERROR) << "Mismatched types for hardlink " << *node << " -> "
                  << target;
 
-    return CreateFile(id, parent, name, mode);
+    return CreateFile(LockAndMakeDataNode(sb, mode), parent, name);
   }
 
   node->link = target.link;
   node->link->nlink++;
 
   LOG(DEBUG) << "Created hardlink " << *node << " -> " << target;
-  return Attach(std::move(node));
+  return Attach(node);
 }
 
-FileNode* Tree::Find(std::string_view path) {
-  const auto it = files_by_path_.find(Path(path).WithoutTrailingSeparator(),
-                                      files_by_path_.hash_function(),
-                                      files_by_path_.key_eq());
-  return it == files_by_path_.end() ? nullptr : &*it;
+FileNode* Tree::FindChildLocked(const FileNode* const parent,
+                                const std::string_view name) {
+  const auto it = files_by_path_.find(Key{parent, name});
+  if (it == files_by_path_.end())
+    return nullptr;
+
+  FileNode& node = *it;
+  if (!node.expanded)
+    Expand(&node);
+
+  return &node;
+}
+
+FileNode* Tree::FindLocked(std::string_view path) {
+  path = Path(path).WithoutTrailingSeparator();
+  if (path.empty() || path.front() != '/')
+    return nullptr;
+
+  // Walk down from the root, one path component at a time.
+  FileNode* node = FindChildLocked(nullptr, "/");
+  for (size_t i = 1; node && i < path.size();) {
+    const size_t j = std::min(path.find('/', i), path.size());
+    node = FindChildLocked(node, path.substr(i, j - i));
+    i = j + 1;
+  }
+
+  return node;
 }
 
 FileNode* Tree::CreateDir(std::string_view path) {
   const auto [parent_path, name] = Path(path).Split();
-  FileNode::Ptr to_rename;
+  FileNode* to_rename = nullptr;
   FileNode* parent;
 
   if (FileNode* const node = Find(path)) {
@@ -817,38 +1583,128 @@ FileNode* Tree::CreateDir(std::string_view path) {
     // Remove it from |files_by_path_|, in order to insert it again later with a
     // different name.
     files_by_path_.erase(files_by_path_.iterator_to(*node));
-    to_rename.reset(node);
+    to_rename = node;
   } else {
     parent = CreateDir(parent_path);
   }
 
   assert(parent);
-  FileNode::Ptr child(new FileNode{.zip = zip_,
-                                   .data = {.nlink = 2, .mode = S_IFDIR | 0755},
-                                   .parent = parent,
-                                   .name = std::string(name)});
+  FileNode* const child = nodes_.New([&] {
+    return FileNode{.data = {.nlink = 2, .mode = S_IFDIR | 0755},
+                    .parent = parent,
+                    .name = names_.Add(name)};
+  });
   assert(child->path() == path);
-  parent->AddChild(child.get());
+  parent->AddChild(child);
   [[maybe_unused]] const auto [pos, ok] = files_by_path_.insert(*child);
   assert(ok);
-  FileNode* const ret = child.release();  // Now owned by |files_by_path_|.
   parent->link->nlink++;
 
   if (to_rename)
-    Attach(std::move(to_rename));
+    Attach(to_rename);
 
-  return ret;
+  return child;
 }
 
 Tree::Ptr Tree::Init(const char* const filename, Options opts) {
   assert(filename);
-  int err;
-  zip_t* const zip_file = zip_open(filename, ZIP_RDONLY, &err);
+  if (opts.lazy && (opts.pre_cache || opts.index_file || opts.warm_file ||
+                    opts.verify || opts.scrub)) {
+    LOG(INFO) << "Building the whole tree, since it is needed for "
+              << (opts.pre_cache    ? "pre-caching data"
+                  : opts.index_file ? "the index file"
+                  : opts.warm_file  ? "the access profile"
+                                    : "verifying the files");
+    opts.lazy = false;
+  }
+
+  if (opts.lazy_attributes && opts.index_file) {
+    LOG(INFO) << "Decoding all the attributes, since they are needed for the "
+                 "index file";
+    opts.lazy_attributes = false;
+  }
+
+  Ptr tree(new Tree(filename, std::move(opts)));
+  if (tree->opts_.lazy) {
+    tree->BuildLazyIndex();
+  } else if (!tree->LoadIndex()) {
+    tree->BuildTree();
+    tree->SaveIndex();
+  }
 
-  if (!zip_file)
-    throw ZipError(StrCat("Cannot open ZIP archive ", Path(filename)), err);
+  if (tree->opts_.verify) {
+    const i64 n = tree->Verify();
+    if (n > 0 && tree->opts_.check_password) {
+      LOG(INFO) << "Use the --force option to mount even if some files are "
+                   "corrupted";
+      throw ZipError(StrCat("Cannot mount ", Path(filename), ": ", n,
+                            " corrupted files"),
+                     ZIP_ER_CRC);
+    }
+  }
 
-  Ptr tree(new Tree(zip_file, std::move(opts)));
-  tree->BuildTree();
+  if (tree->opts_.pre_cache) {
+    tree->PreCache();
+  } else if (tree->opts_.warm_file) {
+    try {
+      tree->warm_ranges_ = AccessProfile::Load(tree->opts_.warm_file);
+    } catch (const std::exception& e) {
+      LOG(ERROR) << "Cannot load access profile " << Path(tree->opts_.warm_file)
+                 << ": " << e.what();
+    }
+  }
+
+  tree->OpenZipHandles();
   return tree;
 }
+
+zip_t* Tree::OpenZip() const {
+  if (opts_.read_ahead > 0) {
+    zip_error_t error;
+    zip_error_init(&error);
+    zip_source_t* const source = archive_.MakeSource(opts_.read_ahead, &error);
+    zip_t* const zip =
+        source ? zip_open_from_source(source, ZIP_RDONLY, &error) : nullptr;
+    const int err = zip_error_code_zip(&error);
+    zip_error_fini(&error);
+
+    if (zip)
+      return zip;
+
+    if (source) {
+      zip_source_free(source);
+      throw ZipError(StrCat("Cannot open ZIP archive ", Path(filename_)), err);
+    }
+
+    // The ZIP archive file couldn't be opened. Let libzip report the error.
+  }
+
+  int err;
+  zip_t* const zip = zip_open(filename_.c_str(), ZIP_RDONLY, &err);
+  if (!zip)
+    throw ZipError(StrCat("Cannot open ZIP archive ", Path(filename_)), err);
+
+  return zip;
+}
+
+std::unique_ptr<ZipHandle> Tree::OpenZipHandle() const {
+  zip_t* const zip = OpenZip();
+  if (!password_.empty() &&
+      zip_set_default_password(zip, password_.c_str()) < 0) {
+    const ZipError e("Cannot set password", zip);
+    zip_discard(zip);
+    throw e;
+  }
+
+  return std::unique_ptr<ZipHandle>(
+      new ZipHandle{.zip = zip, .archive = &archive_, .password = &password_});
+}
+
+void Tree::OpenZipHandles() {
+  const size_t n = std::max(opts_.threads, 1);
+  zips_.reserve(n);
+  while (zips_.size() < n)
+    zips_.push_back(OpenZipHandle());
+
+  LOG(DEBUG) << "Opened " << zips_.size() << " handles on the ZIP archive";
+}
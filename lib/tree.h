@@ -16,11 +16,20 @@
 #ifndef TREE_H
 #define TREE_H
 
+#include <atomic>
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <string_view>
+#include <thread>
+#include <vector>
 
+#include "access_profile.h"
+#include "arena.h"
+#include "archive_file.h"
 #include "file_node.h"
+#include "scoped_file.h"
 
 // Holds the ZIP filesystem tree.
 class Tree {
@@ -52,6 +61,59 @@ class Tree {
 
     // Pre-cache data?
     bool pre_cache = false;
+
+    // Number of threads used to pre-cache data. Each of them gets a separate
+    // handle on the ZIP archive.
+    int pre_cache_threads = 1;
+
+    // Number of threads that can concurrently read files. Each of them gets a
+    // separate handle on the ZIP archive.
+    int threads = 1;
+
+    // Number of threads parsing the entries of the ZIP archive when building
+    // the tree. Each of them gets a separate handle on the ZIP archive.
+    int parse_threads = 1;
+
+    // Path of the index file in which the tree structure is saved, and from
+    // which it is loaded if the ZIP archive hasn't changed. Null if no index
+    // file should be used.
+    const char* index_file = nullptr;
+
+    // Create the nodes of a directory only when this directory is first looked
+    // up, rather than building the whole tree upfront? Ignored when
+    // pre-caching data or when using an index file, since they need the whole
+    // tree.
+    bool lazy = false;
+
+    // Decode the timestamps, owner and group of the regular files and
+    // directories from the extra fields of their ZIP entries only when they
+    // are first needed, rather than when building the tree? This avoids
+    // reading all the local headers of the ZIP archive. Ignored when using an
+    // index file, since it needs all the attributes.
+    bool lazy_attributes = false;
+
+    // Size of the chunks in which libzip reads the ZIP archive. If not zero,
+    // the next chunk is read ahead in the background while the current one is
+    // decompressed. If zero, libzip reads the ZIP archive by itself.
+    ssize_t read_ahead = 0;
+
+    // Path of an access profile whose byte ranges are decompressed and cached
+    // in the background once the filesystem is mounted, or null.
+    const char* warm_file = nullptr;
+
+    // Check the CRC-32 of all the files before mounting? The files failing this
+    // check cannot be opened. Mounting fails if there are any, unless
+    // |check_password| is false.
+    bool verify = false;
+
+    // Check the CRC-32 of all the files in the background once mounted? The
+    // files failing this check cannot be opened anymore. Ignored if |verify|
+    // is set.
+    bool scrub = false;
+
+    // Number of threads checking the CRC-32 of the files. Each of them gets a
+    // separate handle on the ZIP archive.
+    int verify_threads = 1;
   };
 
   using Ptr = std::unique_ptr<Tree>;
@@ -63,19 +125,140 @@ class Tree {
 
   // Finds an existing node with the given |path|.
   // Returns a null pointer if no matching node can be found.
-  FileNode* Find(std::string_view path);
+  // In lazy mode, the children of the returned directory node are created if
+  // they haven't been yet. This can be called from several threads.
+  FileNode* Find(std::string_view path) {
+    const std::unique_lock lock = Lock();
+    return FindLocked(path);
+  }
+
+  // Finds the child node with the given |name| in the given |parent| node.
+  // Returns the root node if |parent| is null and |name| is "/".
+  // Returns a null pointer if no matching node can be found.
+  // In lazy mode, the children of the returned directory node are created if
+  // they haven't been yet. This can be called from several threads.
+  FileNode* FindChild(const FileNode* parent, std::string_view name) {
+    const std::unique_lock lock = Lock();
+    return FindChildLocked(parent, name);
+  }
+
+  // Starts decompressing and caching the byte ranges of the access profile
+  // in a background thread, in the recorded order. Doesn't do anything if
+  // there is no access profile.
+  void StartWarming();
+
+  // Stops the thread started by StartWarming(), if any, and waits for it.
+  // Also called by the destructor.
+  void StopWarming();
+
+  // Starts checking the CRC-32 of all the files in a background thread, if
+  // requested by the options.
+  void StartScrubbing();
+
+  // Stops the thread started by StartScrubbing(), if any, and waits for it.
+  // Also called by the destructor.
+  void StopScrubbing();
+
+  // Gets a handle on the ZIP archive to read files from. Spreads the readers
+  // over all the handles opened on the ZIP archive.
+  ZipHandle* GetZipHandle() {
+    return zips_[next_zip_++ % zips_.size()].get();
+  }
 
   static const blksize_t block_size = DataNode::block_size;
   blkcnt_t GetBlockCount() const { return total_block_count_; }
-  fsfilcnt_t GetNodeCount() const { return files_by_path_.size(); }
+  fsfilcnt_t GetNodeCount() const {
+    return opts_.lazy ? lazy_node_count_ : files_by_path_.size();
+  }
 
  private:
   // Constructor.
-  Tree(zip_t* zip, Options opts) : zip_(zip), opts_(std::move(opts)) {}
+  // Throws ZipError if the ZIP archive cannot be opened.
+  Tree(std::string filename, Options opts)
+      : filename_(std::move(filename)),
+        archive_(filename_.c_str()),
+        opts_(std::move(opts)),
+        zip_(OpenZip()) {
+    zips_.emplace_back(new ZipHandle{
+        .zip = zip_, .archive = &archive_, .password = &password_});
+  }
+
+  // Functor converting file names to UTF-8.
+  using ToUtf8 = std::function<std::string_view(std::string_view)>;
+
+  // Detects the encoding of the file names, and sets |zip_flags_| and
+  // |encoding_| accordingly.
+  void SetUpEncoding();
+
+  // Makes a functor converting file names to UTF-8. Each thread needs its own.
+  ToUtf8 MakeToUtf8() const;
 
   // Builds internal tree structure.
   void BuildTree();
 
+  // Builds the sorted index of the entries used in lazy mode, and the nodes
+  // of the root directory.
+  void BuildLazyIndex();
+
+  // Creates the child nodes of the given directory |dir|, if this hasn't been
+  // done yet. Only used in lazy mode.
+  // Precondition: |mutex_| is held.
+  void Expand(FileNode* dir);
+
+  // Locks |mutex_| in lazy mode. Doesn't lock anything otherwise, since the
+  // tree doesn't change once built.
+  std::unique_lock<std::mutex> Lock() {
+    return opts_.lazy ? std::unique_lock(mutex_)
+                      : std::unique_lock<std::mutex>();
+  }
+
+  // Same as Find() and FindChild().
+  // Precondition: |mutex_| is held in lazy mode.
+  FileNode* FindLocked(std::string_view path);
+  FileNode* FindChildLocked(const FileNode* parent, std::string_view name);
+
+  // Loads the tree structure from the index file.
+  // Returns false if there is no usable index file.
+  // Throws ZipError if the password doesn't match.
+  bool LoadIndex();
+
+  // Saves the tree structure to the index file, if any.
+  void SaveIndex() const;
+
+  // Gets the key identifying the ZIP archive and the extraction options in the
+  // index file. Returns an empty string in case of error.
+  std::string GetIndexKey() const;
+
+  // Deletes all the nodes.
+  void Clear();
+
+  // Decompresses and caches the data of all the file nodes, using up to
+  // |opts_.pre_cache_threads| threads.
+  // Throws a ZipError if a file cannot be cached and |opts_.check_password|
+  // is set.
+  void PreCache();
+
+  // Decompresses and caches the byte ranges in |warm_ranges_|, until done or
+  // until |stop_warming_| is set.
+  void Warm();
+
+  // Checks the CRC-32 of all the file nodes, using up to
+  // |opts_.verify_threads| threads, until done or until |stop_verifying_| is
+  // set. Returns the number of files failing this check.
+  i64 Verify();
+
+  // Opens a new handle on the ZIP archive.
+  // Throws a ZipError in case of error.
+  std::unique_ptr<ZipHandle> OpenZipHandle() const;
+
+  // Opens the ZIP archive, possibly through a source reading it ahead.
+  // Throws ZipError in case of error.
+  zip_t* OpenZip() const;
+
+  // Opens additional handles on the ZIP archive, up to the requested number of
+  // threads.
+  void OpenZipHandles();
+
   // Returned by GetEntryAttributes.
   struct EntryAttributes {
     mode_t mode;       // Unix mode
@@ -84,28 +267,40 @@ class Tree {
 
   // Gets the UNIX mode and the PkWare hardlink flag from the entry external
   // attributes field.
-  EntryAttributes GetEntryAttributes(zip_uint64_t id,
-                                     std::string_view original_path);
+  static EntryAttributes GetEntryAttributes(zip_t* zip,
+                                            zip_uint64_t id,
+                                            std::string_view original_path);
+
+  // Makes a DataNode for the entry described by |sb|, deferring the decoding of
+  // its attributes if requested by the options.
+  DataNode MakeDataNode(zip_t* zip, const zip_stat_t& sb, mode_t mode) const {
+    return DataNode::Make(zip, sb, mode, opts_.lazy_attributes);
+  }
+
+  // Same as zip_stat_index() and MakeDataNode() on |zip_|, while holding the
+  // mutex of its handle. In lazy mode, nodes are created while other threads
+  // read files through this handle.
+  // Throws ZipError if the entry cannot be read.
+  zip_stat_t LockAndStat(i64 id);
+  DataNode LockAndMakeDataNode(const zip_stat_t& sb, mode_t mode);
 
   // Finds an existing dir node with the given |path|, or create one (and all
   // the needed intermediary nodes).
   FileNode* CreateDir(std::string_view path);
 
-  // Creates and attaches a node for an existing file or dir entry.
-  FileNode* CreateFile(i64 id,
-                       FileNode* parent,
-                       std::string_view name,
-                       mode_t mode);
+  // Creates and attaches a node for an existing file or dir entry, with the
+  // given inode |data|. Gives it a new inode number.
+  FileNode* CreateFile(DataNode data, FileNode* parent, std::string_view name);
 
-  // Creates and attaches a hardlink node.
-  FileNode* CreateHardlink(i64 id,
+  // Creates and attaches a hardlink node for the entry described by |sb|.
+  FileNode* CreateHardlink(const zip_stat_t& sb,
                            FileNode* parent,
                            std::string_view name,
                            mode_t mode);
 
   // Attaches the given |node|, renaming it if necessary to prevent name
   // collisions.
-  FileNode* Attach(FileNode::Ptr node);
+  FileNode* Attach(FileNode* node);
 
   // Reads the password from the standard input.
   // Returns true if a non-empty password was read.
@@ -119,16 +314,57 @@ class Tree {
   // given ZIP archive.
   static size_t GetBucketCount(zip_t* zip);
 
-  // ZIP archive.
-  zip_t* const zip_;
+  // Path of the ZIP archive.
+  const std::string filename_;
+
+  // ZIP archive file, for direct reads of stored files.
+  const ArchiveFile archive_;
 
   // Extraction options.
   const Options opts_;
 
-  // Path extractor for FileNode.
-  struct GetPath {
-    using type = std::string;
-    std::string operator()(const FileNode& node) const { return node.path(); }
+  // ZIP archive.
+  zip_t* const zip_;
+
+  // Handles on the ZIP archive. The first one is for |zip_|. They are all
+  // closed by the destructor.
+  std::vector<std::unique_ptr<ZipHandle>> zips_;
+
+  // Index of the next handle to return from GetZipHandle().
+  std::atomic<size_t> next_zip_ = 0;
+
+  // Password used to decrypt files, if any.
+  std::string password_;
+
+  // Storage of all the FileNodes and of their names.
+  Arena<FileNode> nodes_;
+  StringPool names_;
+
+  // Key identifying a FileNode by its parent and its name. This is equivalent
+  // to its full path, but without having to build the full path.
+  struct Key {
+    const FileNode* parent;
+    std::string_view name;
+
+    bool operator==(const Key&) const = default;
+  };
+
+  // Key extractor for FileNode.
+  struct GetKey {
+    using type = Key;
+    Key operator()(const FileNode& node) const {
+      return {node.parent, node.name};
+    }
+  };
+
+  // Hash function for Key.
+  struct HashKey {
+    size_t operator()(const Key& key) const {
+      size_t h = std::hash<std::string_view>()(key.name);
+      h ^= std::hash<const FileNode*>()(key.parent) + 0x9e3779b97f4a7c15 +
+           (h << 6) + (h >> 2);
+      return h;
+    }
   };
 
   // Original path extractor for FileNode.
@@ -145,9 +381,9 @@ class Tree {
       bi::constant_time_size<true>,
       bi::power_2_buckets<true>,
       bi::compare_hash<true>,
-      bi::key_of_value<GetPath>,
-      bi::equal<std::equal_to<std::string_view>>,
-      bi::hash<std::hash<std::string_view>>>;
+      bi::key_of_value<GetKey>,
+      bi::equal<std::equal_to<Key>>,
+      bi::hash<HashKey>>;
 
   using FilesByOriginalPath = bi::unordered_set<
       FileNode,
@@ -169,8 +405,7 @@ class Tree {
   const std::unique_ptr<BucketByOriginalPath[]> buckets_by_original_path_{
       new BucketByOriginalPath[bucket_count_]};
 
-  // Collection of all FileNodes indexed by full path.
-  // Owns the nodes it references.
+  // Collection of all FileNodes indexed by parent and name.
   FilesByPath files_by_path_{{buckets_by_path_.get(), bucket_count_}};
 
   // Collection of FileNodes indexed by original path.
@@ -181,6 +416,58 @@ class Tree {
 
   // Has the password been verified?
   bool checked_password_ = false;
+
+  // First encrypted file node, if any.
+  const FileNode* encrypted_node_ = nullptr;
+
+  // Memory mapping of the index file the tree has been loaded from, if any.
+  std::unique_ptr<FileMapping> index_mapping_;
+
+  // Flags passed to libzip to get the file names.
+  zip_flags_t zip_flags_ = ZIP_FL_ENC_GUESS;
+
+  // Encoding the file names are converted from with ICU. Empty if the file
+  // names don't need to be converted with ICU.
+  std::string encoding_;
+
+  // Entry of the ZIP archive in the lazy index.
+  struct LazyEntry {
+    // Normalized UTF-8 path, stored in |names_|.
+    std::string_view path;
+
+    // Index of the entry in the ZIP archive.
+    i64 id;
+
+    // UNIX mode and PkWare hardlink flag.
+    mode_t mode;
+    bool is_hardlink;
+  };
+
+  // In lazy mode, the entries that are not the root directory, sorted by path
+  // component by component, and then by index. The entries of a directory are
+  // contiguous.
+  std::vector<LazyEntry> lazy_entries_;
+
+  // In lazy mode, the number of nodes the tree has once fully built.
+  fsfilcnt_t lazy_node_count_ = 0;
+
+  // Converts file names to UTF-8 in lazy mode.
+  ToUtf8 to_utf8_;
+
+  // Protects the nodes and the indices in lazy mode.
+  std::mutex mutex_;
+
+  // Byte ranges of the access profile to warm.
+  std::vector<AccessProfile::Range> warm_ranges_;
+
+  // Thread warming the byte ranges, and flag telling it to stop.
+  std::thread warm_thread_;
+  std::atomic<bool> stop_warming_ = false;
+
+  // Thread checking the CRC-32 of the files in the background, and flag telling
+  // it to stop.
+  std::thread verify_thread_;
+  std::atomic<bool> stop_verifying_ = false;
 };
 
 #endif  // TREE_H
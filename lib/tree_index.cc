@@ -0,0 +1,542 @@
+// Copyright 2021 Google LLC
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// Saving and loading of the tree structure to and from an index file.
+//
+// The index file starts with an IndexHeader, followed by an IndexRecord for
+// each node, followed by the strings referenced by the records. The first of
+// these strings is the key identifying the ZIP archive and the extraction
+// options. The parent of a node is always recorded before the node itself.
+//
+// The index file is only meant to be read by the same build of mount-zip on the
+// same machine. It uses the native byte order.
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "error.h"
+#include "log.h"
+#include "path.h"
+#include "tree.h"
+
+namespace {
+
+// Version of the index file format. Increment it whenever the format changes.
+const uint32_t index_version = 2;
+
+const char index_magic[8] = {'M', 'Z', 'I', 'P', 'I', 'D', 'X', '\n'};
+
+struct IndexHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+  uint64_t node_count;
+  uint64_t block_count;
+  int64_t encrypted_node;  // Index of the first encrypted node, or -1
+  uint64_t key_size;       // Size of the key at the start of the strings
+  uint64_t strings_size;   // Total size of the strings
+};
+
+struct IndexTime {
+  int64_t sec;
+  int64_t nsec;
+};
+
+struct IndexString {
+  uint64_t offset;
+  uint64_t size;
+};
+
+struct IndexRecord {
+  int64_t id;
+  int64_t data_id;
+  int64_t parent;  // Index of the parent node, or -1 for the root
+  int64_t link;    // Index of the node holding the hardlink target, or -1
+  uint64_t ino;
+  uint64_t nlink;
+  uint64_t dev;
+  uint64_t size;
+  uint32_t mode;
+  uint32_t uid;
+  uint32_t gid;
+  int32_t collision_count;
+  IndexTime mtime;
+  IndexTime atime;
+  IndexTime ctime;
+  IndexString name;
+  IndexString original_path;
+  IndexString target;
+  uint32_t flags;
+  uint32_t padding;
+};
+
+// Flag set on nodes indexed by original path.
+const uint32_t by_original_path_flag = 1;
+
+IndexTime ToIndexTime(const timespec& t) {
+  return {.sec = t.tv_sec, .nsec = t.tv_nsec};
+}
+
+timespec ToTimespec(const IndexTime& t) {
+  return {.tv_sec = static_cast<time_t>(t.sec), .tv_nsec = t.nsec};
+}
+
+// Gets a little-endian integer stored at |p|.
+template <typename T>
+T GetLittleEndian(const unsigned char* const p) {
+  T n = 0;
+  for (size_t i = sizeof(T); i-- > 0;)
+    n = (n << 8) | p[i];
+  return n;
+}
+
+// Reads |size| bytes at |offset| in the file |fd|.
+// Returns false in case of error or if the end of the file is reached.
+bool ReadAt(const int fd, void* const dest, size_t size, off_t offset) {
+  char* p = static_cast<char*>(dest);
+  while (size > 0) {
+    const ssize_t n = pread(fd, p, size, offset);
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR)
+        continue;
+      return false;
+    }
+
+    p += n;
+    size -= n;
+    offset += n;
+  }
+
+  return true;
+}
+
+// Writes |data| to the file |fd|.
+// Throws a system_error in case of error.
+void WriteAll(const int fd, std::string_view data) {
+  while (!data.empty()) {
+    const ssize_t n = write(fd, data.data(), data.size());
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      ThrowSystemError("Cannot write index");
+    }
+
+    data.remove_prefix(n);
+  }
+}
+
+// Location of the central directory in a ZIP archive.
+struct CentralDirectory {
+  uint64_t offset;
+  uint64_t size;
+};
+
+// Finds the central directory of the ZIP archive |fd| of size |file_size| by
+// looking for the end of central directory record, and for its ZIP64 variant.
+// Returns false if it cannot be found.
+bool FindCentralDirectory(const int fd,
+                          const off_t file_size,
+                          CentralDirectory* const cd) {
+  // The end of central directory record has a fixed size of 22 bytes, followed
+  // by a comment of up to 65535 bytes.
+  const off_t eocd_size = 22;
+  std::vector<unsigned char> tail(
+      std::min<off_t>(file_size, eocd_size + 0xFFFF));
+  const off_t tail_offset = file_size - tail.size();
+  if (tail.size() < eocd_size ||
+      !ReadAt(fd, tail.data(), tail.size(), tail_offset))
+    return false;
+
+  for (off_t i = tail.size() - eocd_size; i >= 0; --i) {
+    const unsigned char* const p = &tail[i];
+    if (GetLittleEndian<uint32_t>(p) != 0x06054b50)
+      continue;
+
+    cd->size = GetLittleEndian<uint32_t>(p + 12);
+    cd->offset = GetLittleEndian<uint32_t>(p + 16);
+    if (cd->size != 0xFFFFFFFF && cd->offset != 0xFFFFFFFF)
+      return true;
+
+    // Look for the ZIP64 end of central directory locator, just before the
+    // end of central directory record.
+    unsigned char locator[20];
+    if (tail_offset + i < sizeof(locator) ||
+        !ReadAt(fd, locator, sizeof(locator),
+                tail_offset + i - sizeof(locator)) ||
+        GetLittleEndian<uint32_t>(locator) != 0x07064b50)
+      return false;
+
+    unsigned char record[56];
+    if (!ReadAt(fd, record, sizeof(record),
+                GetLittleEndian<uint64_t>(locator + 8)) ||
+        GetLittleEndian<uint32_t>(record) != 0x06064b50)
+      return false;
+
+    cd->size = GetLittleEndian<uint64_t>(record + 40);
+    cd->offset = GetLittleEndian<uint64_t>(record + 48);
+    return true;
+  }
+
+  return false;
+}
+
+}  // namespace
+
+std::string Tree::GetIndexKey() const {
+  const ScopedFile file(open(filename_.c_str(), O_RDONLY | O_CLOEXEC));
+  if (!file.IsValid()) {
+    PLOG(ERROR) << "Cannot open " << Path(filename_);
+    return std::string();
+  }
+
+  const int fd = file.GetDescriptor();
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    PLOG(ERROR) << "Cannot stat " << Path(filename_);
+    return std::string();
+  }
+
+#if __APPLE__
+  const timespec mtime = st.st_mtimespec;
+#else
+  const timespec mtime = st.st_mtim;
+#endif
+
+  CentralDirectory cd;
+  if (!FindCentralDirectory(fd, st.st_size, &cd) ||
+      cd.offset + cd.size > static_cast<uint64_t>(st.st_size)) {
+    LOG(ERROR) << "Cannot find central directory of " << Path(filename_);
+    return std::string();
+  }
+
+  // Compute the CRC-32 of the central directory.
+  const Timer timer;
+  uLong crc = crc32(0, Z_NULL, 0);
+  std::vector<Bytef> buffer(1 << 20);
+  for (uint64_t pos = 0; pos < cd.size;) {
+    const size_t n = std::min<uint64_t>(buffer.size(), cd.size - pos);
+    if (!ReadAt(fd, buffer.data(), n, cd.offset + pos)) {
+      PLOG(ERROR) << "Cannot read central directory of " << Path(filename_);
+      return std::string();
+    }
+
+    crc = crc32(crc, buffer.data(), n);
+    pos += n;
+  }
+
+  LOG(DEBUG) << "Hashed central directory of " << cd.size << " bytes in "
+             << timer;
+
+  return StrCat("version=", index_version, "\nsize=", st.st_size,
+                "\nmtime=", mtime.tv_sec, ".", mtime.tv_nsec,
+                "\ncd=", cd.offset, "+", cd.size, "\ncrc=", crc,
+                "\nencoding=", opts_.encoding ? opts_.encoding : "",
+                "\nsymlinks=", opts_.include_symlinks,
+                "\nhardlinks=", opts_.include_hardlinks,
+                "\nspecials=", opts_.include_special_files,
+                "\ncheck_compression=", opts_.check_compression, "\n");
+}
+
+void Tree::SaveIndex() const {
+  if (!opts_.index_file)
+    return;
+
+  const char* const path = opts_.index_file;
+
+  try {
+    const Timer timer;
+    std::string strings = GetIndexKey();
+    if (strings.empty())
+      return;
+
+    const size_t key_size = strings.size();
+
+    // List the nodes in an order where the parents come before their children.
+    // Siblings are listed in reverse order, so that adding them one by one to
+    // their parent puts them back in their original order.
+    std::vector<const FileNode*> nodes;
+    nodes.reserve(GetNodeCount());
+    std::unordered_map<const DataNode*, int64_t> data_indices;
+    data_indices.reserve(GetNodeCount());
+
+    {
+      std::vector<const FileNode*> stack;
+      for (const FileNode& node : files_by_path_) {
+        if (!node.parent)
+          stack.push_back(&node);
+      }
+
+      if (stack.size() != 1)
+        throw std::logic_error("Cannot find root node");
+
+      while (!stack.empty()) {
+        const FileNode* const node = stack.back();
+        stack.pop_back();
+        data_indices[&node->data] = nodes.size();
+        nodes.push_back(node);
+        for (const FileNode& child : node->children)
+          stack.push_back(&child);
+      }
+    }
+
+    if (nodes.size() != GetNodeCount())
+      throw std::logic_error("Disconnected nodes");
+
+    std::vector<IndexRecord> records;
+    records.reserve(nodes.size());
+
+    const auto add_string = [&strings](const std::string_view s) {
+      const IndexString is = {.offset = strings.size(), .size = s.size()};
+      strings.append(s);
+      return is;
+    };
+
+    std::unordered_map<const FileNode*, int64_t> node_indices;
+    node_indices.reserve(nodes.size());
+    for (const FileNode* const node : nodes) {
+      node_indices[node] = records.size();
+      const DataNode& d = node->data;
+      int64_t link = -1;
+      if (node->link != &node->data) {
+        const auto it = data_indices.find(node->link);
+        if (it == data_indices.end())
+          throw std::logic_error("Cannot find hardlink target");
+        link = it->second;
+      }
+
+      records.push_back(
+          {.id = node->id,
+           .data_id = d.id,
+           .parent = node->parent ? node_indices.at(node->parent) : -1,
+           .link = link,
+           .ino = d.ino,
+           .nlink = d.nlink,
+           .dev = d.dev,
+           .size = d.size,
+           .mode = d.mode,
+           .uid = d.uid,
+           .gid = d.gid,
+           .collision_count = node->collision_count,
+           .mtime = ToIndexTime(d.mtime),
+           .atime = ToIndexTime(d.atime),
+           .ctime = ToIndexTime(d.ctime),
+           .name = add_string(node->name),
+           .original_path = add_string(node->original_path),
+           .target = add_string(d.target ? *d.target : std::string_view()),
+           .flags = node->by_original_path.is_linked() ? by_original_path_flag
+                                                       : 0});
+    }
+
+    IndexHeader header = {
+        .version = index_version,
+        .record_size = sizeof(IndexRecord),
+        .node_count = records.size(),
+        .block_count = static_cast<uint64_t>(total_block_count_),
+        .encrypted_node =
+            encrypted_node_ ? node_indices.at(encrypted_node_) : -1,
+        .key_size = key_size,
+        .strings_size = strings.size()};
+    std::memcpy(header.magic, index_magic, sizeof(header.magic));
+
+    // Write to a temporary file, and rename it once complete.
+    const std::string tmp_path = StrCat(path, ".", getpid(), ".tmp");
+    const ScopedFile file(open(tmp_path.c_str(),
+                               O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+    if (!file.IsValid())
+      ThrowSystemError("Cannot create ", Path(tmp_path));
+
+    try {
+      const int fd = file.GetDescriptor();
+      WriteAll(fd, std::string_view(reinterpret_cast<const char*>(&header),
+                                    sizeof(header)));
+      WriteAll(fd, std::string_view(
+                       reinterpret_cast<const char*>(records.data()),
+                       records.size() * sizeof(IndexRecord)));
+      WriteAll(fd, strings);
+
+      if (rename(tmp_path.c_str(), path) < 0)
+        ThrowSystemError("Cannot rename ", Path(tmp_path));
+    } catch (...) {
+      unlink(tmp_path.c_str());
+      throw;
+    }
+
+    LOG(DEBUG) << "Saved " << records.size() << " nodes to index "
+               << Path(path) << " in " << timer;
+  } catch (const std::exception& e) {
+    LOG(ERROR) << "Cannot save index " << Path(path) << ": " << e.what();
+  }
+}
+
+bool Tree::LoadIndex() {
+  if (!opts_.index_file)
+    return false;
+
+  const char* const path = opts_.index_file;
+
+  try {
+    const Timer timer;
+    std::unique_ptr<FileMapping> mapping;
+    try {
+      mapping = std::make_unique<FileMapping>(path);
+    } catch (const std::system_error& e) {
+      if (e.code().value() != ENOENT)
+        throw;
+      LOG(DEBUG) << "No index " << Path(path);
+      return false;
+    }
+
+    const char* const data = static_cast<const char*>(mapping->data());
+    const size_t size = mapping->size();
+
+    IndexHeader header;
+    if (size < sizeof(header))
+      throw std::runtime_error("Truncated header");
+
+    std::memcpy(&header, data, sizeof(header));
+    if (std::memcmp(header.magic, index_magic, sizeof(header.magic)) != 0 ||
+        header.version != index_version ||
+        header.record_size != sizeof(IndexRecord))
+      throw std::runtime_error("Unsupported format");
+
+    const IndexRecord* const records =
+        reinterpret_cast<const IndexRecord*>(data + sizeof(header));
+    if (header.node_count == 0 ||
+        header.node_count > (size - sizeof(header)) / sizeof(IndexRecord))
+      throw std::runtime_error("Truncated records");
+
+    const std::string_view strings(
+        reinterpret_cast<const char*>(records + header.node_count),
+        size - sizeof(header) - header.node_count * sizeof(IndexRecord));
+    if (strings.size() != header.strings_size ||
+        header.key_size > strings.size())
+      throw std::runtime_error("Truncated strings");
+
+    if (strings.substr(0, header.key_size) != GetIndexKey()) {
+      LOG(INFO) << "Index " << Path(path) << " is out of date";
+      return false;
+    }
+
+    const auto get_string = [strings](const IndexString& is) {
+      if (is.offset > strings.size() || is.size > strings.size() - is.offset)
+        throw std::runtime_error("Bad string");
+      return strings.substr(is.offset, is.size);
+    };
+
+    // Create the nodes.
+    std::vector<FileNode*> nodes;
+    nodes.reserve(header.node_count);
+    ino_t max_ino = 0;
+
+    try {
+      for (uint64_t i = 0; i < header.node_count; ++i) {
+        const IndexRecord& r = records[i];
+        if (i == 0 ? r.parent != -1 : r.parent < 0 || r.parent >= i ||
+                                          !nodes[r.parent]->is_dir())
+          throw std::runtime_error("Bad parent");
+
+        const std::string_view name = get_string(r.name);
+        if (name.empty())
+          throw std::runtime_error("Bad name");
+
+        const std::string_view target = get_string(r.target);
+        FileNode* const node = nodes_.New([&] {
+          return FileNode{
+              .id = r.id,
+              .data = {.ino = static_cast<ino_t>(r.ino),
+                       .nlink = static_cast<nlink_t>(r.nlink),
+                       .id = r.data_id,
+                       .mode = static_cast<mode_t>(r.mode),
+                       .uid = static_cast<uid_t>(r.uid),
+                       .gid = static_cast<gid_t>(r.gid),
+                       .dev = static_cast<dev_t>(r.dev),
+                       .size = r.size,
+                       .mtime = ToTimespec(r.mtime),
+                       .atime = ToTimespec(r.atime),
+                       .ctime = ToTimespec(r.ctime),
+                       .target = target.empty()
+                                     ? nullptr
+                                     : std::make_unique<const std::string>(
+                                           target)},
+              .parent = r.parent < 0 ? nullptr : nodes[r.parent],
+              .name = names_.Add(name),
+              .original_path = get_string(r.original_path),
+              .collision_count = r.collision_count};
+        });
+
+        if (!files_by_path_.insert(*node).second)
+          throw std::runtime_error("Duplicate path");
+
+        nodes.push_back(node);
+        if (node->parent)
+          node->parent->AddChild(node);
+        if ((r.flags & by_original_path_flag) != 0)
+          files_by_original_path_.insert(*node);
+        max_ino = std::max(max_ino, node->data.ino);
+      }
+
+      // Resolve hardlinks.
+      for (uint64_t i = 0; i < header.node_count; ++i) {
+        const int64_t link = records[i].link;
+        if (link < 0)
+          continue;
+        if (link >= header.node_count || records[link].link >= 0)
+          throw std::runtime_error("Bad hardlink");
+        nodes[i]->link = &nodes[link]->data;
+      }
+
+      if (header.encrypted_node >= static_cast<int64_t>(header.node_count))
+        throw std::runtime_error("Bad encrypted node");
+    } catch (...) {
+      Clear();
+      throw;
+    }
+
+    total_block_count_ = header.block_count;
+    DataNode::ino_count = std::max(DataNode::ino_count, max_ino);
+    index_mapping_ = std::move(mapping);
+
+    LOG(DEBUG) << "Loaded " << nodes.size() << " nodes from index "
+               << Path(path) << " in " << timer;
+
+    // Check the password on the first encrypted file.
+    if (header.encrypted_node >= 0) {
+      encrypted_node_ = nodes[header.encrypted_node];
+      CheckPassword(encrypted_node_);
+    }
+
+    return true;
+  } catch (const ZipError&) {
+    throw;
+  } catch (const std::exception& e) {
+    LOG(ERROR) << "Cannot load index " << Path(path) << ": " << e.what();
+    return false;
+  }
+}
@@ -0,0 +1,251 @@
+// Copyright 2021 Google LLC
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "winzip_aes.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+#include <unistd.h>
+
+#ifdef WITH_OPENSSL
+#include <openssl/evp.h>
+#endif
+
+#include "error.h"
+#include "log.h"
+
+// Gets the size in bytes of the AES key used by the given encryption |method|,
+// or 0 if |method| is not a WinZip AES method.
+static ssize_t GetKeySize(const zip_uint16_t method) {
+  switch (method) {
+    case ZIP_EM_AES_128:
+      return 16;
+    case ZIP_EM_AES_192:
+      return 24;
+    case ZIP_EM_AES_256:
+      return 32;
+    default:
+      return 0;
+  }
+}
+
+// Size of the password verifier following the salt.
+static constexpr ssize_t verifier_size = 2;
+
+ssize_t WinZipAes::GetHeaderSize(const zip_uint16_t method) {
+  // The salt is half as long as the key.
+  const ssize_t key_size = GetKeySize(method);
+  return key_size > 0 ? key_size / 2 + verifier_size : 0;
+}
+
+#ifdef WITH_OPENSSL
+
+// Decryptor generating the key stream with OpenSSL, which uses the AES
+// instructions of the processor if available.
+class OpenSslDecryptor : public WinZipAes::Decryptor {
+ public:
+  // Creates an OpenSslDecryptor encrypting the counter blocks with the given
+  // AES |cipher| and |key|.
+  // Throws std::runtime_error in case of error.
+  OpenSslDecryptor(const EVP_CIPHER* const cipher,
+                   const unsigned char* const key)
+      : ctx_(EVP_CIPHER_CTX_new()) {
+    if (!ctx_ ||
+        EVP_EncryptInit_ex(ctx_.get(), cipher, nullptr, key, nullptr) != 1 ||
+        EVP_CIPHER_CTX_set_padding(ctx_.get(), 0) != 1)
+      throw std::runtime_error("Cannot initialize AES cipher");
+  }
+
+  void Decrypt(char* data, ssize_t size, off_t offset) override {
+    assert(data);
+    assert(size >= 0);
+    assert(offset >= 0);
+
+    while (size > 0) {
+      // Fill a batch of counter blocks. The counter of the first block of the
+      // data is 1, and it is stored as a little-endian number.
+      const off_t first = offset / block_size;
+      const ssize_t skip = offset % block_size;
+      const ssize_t n = std::min<ssize_t>(
+          batch_size, (skip + size + block_size - 1) / block_size);
+      std::memset(counters_, 0, n * block_size);
+      for (ssize_t i = 0; i < n; ++i) {
+        std::uint64_t counter = first + i + 1;
+        for (unsigned char* p = counters_ + i * block_size; counter != 0;
+             counter >>= 8)
+          *p++ = static_cast<unsigned char>(counter);
+      }
+
+      // Encrypt them all at once to get the key stream.
+      int len;
+      if (EVP_EncryptUpdate(ctx_.get(), key_stream_, &len, counters_,
+                            n * block_size) != 1 ||
+          len != n * block_size)
+        throw std::runtime_error("Cannot generate AES key stream");
+
+      const ssize_t m = std::min<ssize_t>(size, n * block_size - skip);
+      for (ssize_t i = 0; i < m; ++i)
+        data[i] ^= static_cast<char>(key_stream_[skip + i]);
+
+      data += m;
+      size -= m;
+      offset += m;
+    }
+  }
+
+ private:
+  // Size of an AES block.
+  static constexpr ssize_t block_size = 16;
+
+  // Number of blocks of key stream generated at once.
+  static constexpr ssize_t batch_size = 1024;
+
+  struct FreeContext {
+    void operator()(EVP_CIPHER_CTX* const ctx) const {
+      EVP_CIPHER_CTX_free(ctx);
+    }
+  };
+
+  const std::unique_ptr<EVP_CIPHER_CTX, FreeContext> ctx_;
+
+  // Counter blocks and key stream of the current batch.
+  unsigned char counters_[batch_size * block_size];
+  unsigned char key_stream_[batch_size * block_size];
+};
+
+WinZipAes::Ptr WinZipAes::Make(const zip_uint16_t method,
+                               const std::string_view password,
+                               const std::string_view header) {
+  const ssize_t key_size = GetKeySize(method);
+  if (key_size == 0 || header.size() != GetHeaderSize(method))
+    return nullptr;
+
+  // Derive the AES key, the authentication key and the password verifier from
+  // the password and the salt.
+  const std::string_view salt = header.substr(0, key_size / 2);
+  std::string keys(2 * key_size + verifier_size, '\0');
+  if (PKCS5_PBKDF2_HMAC_SHA1(
+          password.data(), static_cast<int>(password.size()),
+          reinterpret_cast<const unsigned char*>(salt.data()),
+          static_cast<int>(salt.size()), 1000, static_cast<int>(keys.size()),
+          reinterpret_cast<unsigned char*>(keys.data())) != 1)
+    throw std::runtime_error("Cannot derive AES key");
+
+  if (std::string_view(keys).substr(2 * key_size) !=
+      header.substr(salt.size())) {
+    LOG(DEBUG) << "Wrong password for AES decryption";
+    return nullptr;
+  }
+
+  keys.resize(2 * key_size);
+  return Ptr(new WinZipAes(key_size, std::move(keys)));
+}
+
+WinZipAes::Decryptor::Ptr WinZipAes::MakeDecryptor() const {
+  const EVP_CIPHER* const cipher = key_size_ == 16   ? EVP_aes_128_ecb()
+                                   : key_size_ == 24 ? EVP_aes_192_ecb()
+                                                     : EVP_aes_256_ecb();
+  return std::make_unique<OpenSslDecryptor>(
+      cipher, reinterpret_cast<const unsigned char*>(keys_.data()));
+}
+
+// Reads |size| bytes at |offset| in the file |fd|.
+// Throws std::runtime_error in case of error.
+static void ReadAt(const int fd, char* dest, ssize_t size, off_t offset) {
+  while (size > 0) {
+    const ssize_t n = pread(fd, dest, size, offset);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      ThrowSystemError("Cannot read ", size, " bytes from ZIP archive at ",
+                       offset);
+    }
+
+    if (n == 0)
+      throw std::runtime_error("Cannot read truncated ZIP archive");
+
+    dest += n;
+    size -= n;
+    offset += n;
+  }
+}
+
+bool WinZipAes::Authenticate(const int fd,
+                             const off_t offset,
+                             const off_t size) const {
+  struct FreePkey {
+    void operator()(EVP_PKEY* const pkey) const { EVP_PKEY_free(pkey); }
+  };
+
+  struct FreeContext {
+    void operator()(EVP_MD_CTX* const ctx) const { EVP_MD_CTX_free(ctx); }
+  };
+
+  // The authentication code is the start of the HMAC-SHA1 of the encrypted
+  // data.
+  const std::unique_ptr<EVP_PKEY, FreePkey> pkey(EVP_PKEY_new_mac_key(
+      EVP_PKEY_HMAC, nullptr,
+      reinterpret_cast<const unsigned char*>(keys_.data() + key_size_),
+      static_cast<int>(key_size_)));
+  const std::unique_ptr<EVP_MD_CTX, FreeContext> ctx(EVP_MD_CTX_new());
+  if (!pkey || !ctx ||
+      EVP_DigestSignInit(ctx.get(), nullptr, EVP_sha1(), nullptr,
+                         pkey.get()) != 1)
+    throw std::runtime_error("Cannot initialize HMAC-SHA1");
+
+  const ssize_t buffer_size = 1 << 20;
+  const std::unique_ptr<char[]> buffer(new char[buffer_size]);
+  for (off_t pos = 0; pos < size;) {
+    const ssize_t n = std::min<off_t>(buffer_size, size - pos);
+    ReadAt(fd, buffer.get(), n, offset + pos);
+    if (EVP_DigestSignUpdate(ctx.get(), buffer.get(), n) != 1)
+      throw std::runtime_error("Cannot compute HMAC-SHA1");
+    pos += n;
+  }
+
+  unsigned char mac[EVP_MAX_MD_SIZE];
+  size_t mac_size = sizeof(mac);
+  if (EVP_DigestSignFinal(ctx.get(), mac, &mac_size) != 1 ||
+      mac_size < trailer_size)
+    throw std::runtime_error("Cannot compute HMAC-SHA1");
+
+  char code[trailer_size];
+  ReadAt(fd, code, trailer_size, offset + size);
+  return std::memcmp(mac, code, trailer_size) == 0;
+}
+
+#else  // WITH_OPENSSL
+
+WinZipAes::Ptr WinZipAes::Make([[maybe_unused]] const zip_uint16_t method,
+                               [[maybe_unused]] const std::string_view password,
+                               [[maybe_unused]] const std::string_view header) {
+  return nullptr;
+}
+
+// Never called, since no WinZipAes can be made.
+WinZipAes::Decryptor::Ptr WinZipAes::MakeDecryptor() const {
+  throw std::logic_error("Built without WITH_OPENSSL");
+}
+
+bool WinZipAes::Authenticate(int, off_t, off_t) const {
+  throw std::logic_error("Built without WITH_OPENSSL");
+}
+
+#endif  // WITH_OPENSSL
@@ -0,0 +1,101 @@
+// Copyright 2021 Google LLC
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef WINZIP_AES_H
+#define WINZIP_AES_H
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include <sys/types.h>
+
+#include <zip.h>
+
+// Decryption of the data encrypted with the WinZip AES method. This method
+// uses AES in counter mode, so that any part of the data can be decrypted
+// without decrypting what precedes it. The key stream is generated in
+// batches of blocks, which lets the AES instructions of the processor
+// (AES-NI or ARMv8 crypto extensions) process several blocks in parallel.
+//
+// The encrypted data of a file starts with a header made of a salt and a
+// password verifier, and ends with an authentication code covering the whole
+// encrypted data.
+//
+// A WinZipAes holds the keys derived from the password and the salt, which is
+// costly to do. It can then make as many Decryptors as needed.
+//
+// Only available if built with WITH_OPENSSL.
+class WinZipAes {
+ public:
+  using Ptr = std::shared_ptr<const WinZipAes>;
+
+#ifdef WITH_OPENSSL
+  static constexpr bool available = true;
+#else
+  static constexpr bool available = false;
+#endif
+
+  // Size of the authentication code at the end of the encrypted data.
+  static constexpr ssize_t trailer_size = 10;
+
+  // Gets the size of the header at the start of the data encrypted with the
+  // given encryption |method|. Returns 0 if |method| is not a WinZip AES
+  // method.
+  static ssize_t GetHeaderSize(zip_uint16_t method);
+
+  // Derives the keys decrypting data encrypted with |method| and |password|.
+  // The |header| must hold the GetHeaderSize(method) bytes found at the start
+  // of the encrypted data. Returns a null pointer if |password| doesn't match,
+  // or if built without WITH_OPENSSL.
+  static Ptr Make(zip_uint16_t method,
+                  std::string_view password,
+                  std::string_view header);
+
+  // Decrypts data with its own cipher context. Not thread-safe.
+  class Decryptor {
+   public:
+    using Ptr = std::unique_ptr<Decryptor>;
+
+    virtual ~Decryptor() = default;
+
+    // Decrypts in place the |size| bytes of |data| found at |offset| in the
+    // encrypted data following the header.
+    virtual void Decrypt(char* data, ssize_t size, off_t offset) = 0;
+  };
+
+  // Makes a Decryptor using the derived AES key.
+  // Throws std::runtime_error in case of error.
+  Decryptor::Ptr MakeDecryptor() const;
+
+  // Checks the authentication code of the |size| bytes of encrypted data found
+  // at |offset| in the file |fd|, which are followed by this code. Returns
+  // false if it doesn't match.
+  // Throws std::runtime_error in case of error.
+  bool Authenticate(int fd, off_t offset, off_t size) const;
+
+ private:
+  WinZipAes(ssize_t key_size, std::string keys)
+      : key_size_(key_size), keys_(std::move(keys)) {}
+
+  // Size of the AES key.
+  const ssize_t key_size_;
+
+  // AES key followed by the authentication key, each |key_size_| bytes long.
+  const std::string keys_;
+};
+
+#endif  // WINZIP_AES_H
@@ -20,14 +20,20 @@
 #include <algorithm>
 #include <cassert>
 #include <cerrno>
+#include <csignal>
 #include <cstdlib>
 #include <exception>
 #include <limits>
 #include <locale>
+#include <memory>
 #include <new>
+#include <optional>
+#include <string>
 #include <string_view>
+#include <utility>
 
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <fuse_opt.h>
 #include <libgen.h>
 #include <limits.h>
@@ -39,11 +45,14 @@
 #include <syslog.h>
 #include <unistd.h>
 
+#include "access_profile.h"
 #include "data_node.h"
+#include "decoder.h"
 #include "error.h"
 #include "log.h"
 #include "path.h"
 #include "reader.h"
+#include "stats.h"
 #include "tree.h"
 
 #if (LIBZIP_VERSION_MAJOR < 1)
@@ -70,15 +79,72 @@ General options:
     --force                mount ZIP even if password is wrong or missing, or
                            if the encryption or compression method is unsupported
     --precache             preemptively decompress and cache data
+    --precache-threads=N   decompress data with N threads when using
+                           --precache (default 1)
     --cache=DIR            cache dir (default is $TMPDIR or /tmp)
     --memcache             cache decompressed data in memory
     --nocache              no caching of decompressed data
+    --cache-size=N         keep at most N MB of decompressed data in the cache,
+                           evicting the least recently used data (default 0,
+                           no limit)
+    --idle-files=N         keep the cached data of at most N files that are not
+                           open anymore, and give the space of the other ones
+                           back to the system (default 0, no limit)
+    --seek-span=N          index deflated files with a seek point every N MB
+                           for fast random access without caching (default 0)
+    --prefetch=N           decompress up to N KB ahead of sequential reads of
+                           compressed files in the background (default 0,
+                           at most 128)
+    --buffer-size=N        let the rolling buffer of each compressed file being
+                           read grow up to N KB to absorb the jumps of the read
+                           operations (default 1024, at least 256)
+    --inflate=ENGINE       decompress deflated files with ENGINE: libzip or
+                           libdeflate (default libzip)
+    --inflate-threads=N    decompress a deflated file with N threads from its
+                           seek points when caching it (default 1)
+    --slow-op=N            log the file operations taking longer than N ms
+                           (default 0, no logging)
+    --index=FILE           save the tree structure to FILE, and load it from
+                           FILE next time if the ZIP hasn't changed
+    --record=FILE          record the byte ranges read from the files, and
+                           save them to FILE when unmounting
+    --warm=FILE            decompress and cache the byte ranges recorded in
+                           FILE in the background once mounted
+    --read-ahead=N         let libzip read the ZIP archive in chunks of N KB,
+                           reading the next chunk in the background while the
+                           current one is decompressed (default 0, disabled)
+    --threads=N            serve requests concurrently with N threads and
+                           N handles on the ZIP archive (default 1)
+    --parse-threads=N      parse the ZIP entries with N threads and N handles
+                           on the ZIP archive when mounting it (default 1)
+    --lowlevel             use the FUSE low-level API, which finds files by
+                           inode rather than by path
+    --lazy                 only build the tree of a directory when it is first
+                           looked up, for a faster mount of big ZIP archives
+    --lazy-attributes      only decode the precise timestamps, owner and group
+                           of a file when it is first stat'ed, without reading
+                           all the local headers when mounting
+    --verify               check the CRC-32 of all the files before mounting,
+                           and refuse to mount if some files are corrupted
+    --scrub                check the CRC-32 of all the files in the background
+                           once mounted
+    --verify-threads=N     check the files with N threads and N handles on the
+                           ZIP archive when using --verify or --scrub
+                           (default 1)
     -o dmask=M             directory permission mask in octal (default 0022)
     -o fmask=M             file permission mask in octal (default 0022)
     -o encoding=CHARSET    original encoding of file names
     -o nospecials          no special files (FIFOs, sockets, devices)
     -o nosymlinks          no symbolic links
     -o nohardlinks         no hard links
+    -o nokernelcache       don't keep file data in the kernel page cache when
+                           a file is opened again
+    -o entry_timeout=T     cache names in the kernel for T seconds
+                           (default 86400)
+    -o attr_timeout=T      cache attributes in the kernel for T seconds
+                           (default 86400)
+    -o negative_timeout=T  cache failed lookups in the kernel for T seconds
+                           (default 86400)
 )",
           PROGRAM);
 }
@@ -89,6 +155,20 @@ void print_version() {
   fprintf(stderr, "libzip version: %s\n", LIBZIP_VERSION);
 }
 
+// Kernel caching options. Since the mounted archive doesn't change, the
+// kernel can keep names, attributes and file data cached for a long time.
+struct CacheOptions {
+  // Let the kernel keep the cached data of a file when it is opened again?
+  bool keep_cache = true;
+  // Validity periods of the cached names, attributes and failed lookups, in
+  // seconds.
+  double entry_timeout = 86400;
+  double attr_timeout = 86400;
+  double negative_timeout = 86400;
+};
+
+static CacheOptions cache_options;
+
 // Parameters for command-line argument processing function.
 struct Param {
   // Number of string arguments
@@ -99,92 +179,361 @@ struct Param {
   std::string mount_point;
   // Cache dir
   char* cache_dir = nullptr;
+  // Decompression engine
+  char* inflate = nullptr;
+  // Access profile to record
+  char* record_file = nullptr;
   // Access mask for directories.
   unsigned int dmask = 0022;
   // Access mask for files.
   unsigned int fmask = 0022;
+  // Distance between seek points in deflated files, in MB.
+  int seek_span = 0;
+  // Maximum size of the cached data, in MB.
+  int cache_size = 0;
+  // Maximum number of files not open anymore whose cached data is kept.
+  int idle_files = 0;
+  // Size of the data to prefetch, in KB.
+  int prefetch = 0;
+  // Maximum size of the rolling buffer of each compressed file, in KB.
+  int buffer_size = 1024;
+  // Number of threads decompressing a deflated file in parallel.
+  int inflate_threads = 1;
+  // Size of the chunks in which the ZIP archive is read ahead, in KB.
+  int read_ahead = 0;
+  // Threshold above which file operations are logged as slow, in ms.
+  int slow_op = 0;
+  // Use the FUSE low-level API?
+  bool low_level = false;
+  // Kernel caching options.
+  CacheOptions cache;
   // Conversion options.
   Tree::Options opts;
 
   ~Param() {
     if (cache_dir)
       free(cache_dir);
+    if (inflate)
+      free(inflate);
+    if (record_file)
+      free(record_file);
   }
 };
 
-// FUSE operations
-struct Operations : fuse_operations {
+// Converts a C++ exception into a negative error code.
+// Also logs the error about |what|.
+// Must be called from within a catch block.
+template <typename T>
+static int ToError(std::string_view action, const T& what) {
+  try {
+    throw;
+  } catch (const std::bad_alloc&) {
+    LOG(ERROR) << "Cannot " << action << ' ' << what << ": No memory";
+    return -ENOMEM;
+  } catch (const std::exception& e) {
+    LOG(ERROR) << "Cannot " << action << ' ' << what << ": " << e.what();
+    return -EIO;
+  } catch (...) {
+    LOG(ERROR) << "Cannot " << action << ' ' << what << ": Unexpected error";
+    return -EIO;
+  }
+}
+
+// Lets FUSE splice the data that is read directly from the ZIP archive file,
+// if the kernel supports it.
+static void EnableSplice(fuse_conn_info* const conn) {
+#if FUSE_VERSION >= 29
+  conn->want |= conn->capable & FUSE_CAP_SPLICE_WRITE;
+#endif
+}
+
+// Logs the performance counters whenever the daemon receives SIGUSR1.
+// Must be called once, after the daemon has been started.
+static void EnableStats() {
+  try {
+    LogStatsOnSignal(SIGUSR1);
+  } catch (const std::exception& e) {
+    LOG(ERROR) << "Cannot enable stats: " << e.what();
+  }
+}
+
+// Access profile recording the byte ranges read, or null.
+static std::unique_ptr<AccessProfile> access_profile;
+
+// Records a read of |size| bytes at |offset| in |node|, if an access profile
+// is being recorded.
+static void RecordRead(const FileNode* const node,
+                       const off_t offset,
+                       const size_t size) {
+  if (access_profile && node)
+    access_profile->Record(node->id, node->original_path, offset, size);
+}
+
+// Threshold above which a FUSE operation is logged as slow, in nanoseconds, or
+// 0 if slow operations aren't logged.
+static i64 slow_op_ns = 0;
+
+// Snapshot of the global counters describing the work done by the readers.
+struct ReaderWork {
+  i64 rewinds = g_stats.rewinds;
+  i64 seek_point_restarts = g_stats.seek_point_restarts;
+  i64 too_far = g_stats.too_far;
+  i64 cache_reserved_bytes = g_stats.cache_reserved_bytes;
+  i64 inflated_bytes = g_stats.inflated_bytes;
+};
+
+// Measures the latency of a FUSE operation and adds it to a histogram. Logs
+// the operation if it takes longer than |slow_op_ns|. The |describe| function
+// is only called for slow operations, and returns a description of what the
+// operation was working on.
+//
+// The work done by the readers during a slow operation is derived from the
+// global counters, and therefore also includes the work done by the other
+// operations running at the same time.
+template <typename Describe>
+class OpTracer {
+ public:
+  OpTracer(Histogram& histogram, const char* const op, Describe describe)
+      : histogram_(histogram), op_(op), describe_(std::move(describe)) {
+    if (slow_op_ns > 0)
+      work_.emplace();
+  }
+
+  OpTracer(const OpTracer&) = delete;
+
+  ~OpTracer() {
+    const i64 ns = stopwatch_.ns();
+    histogram_.Add(ns);
+    if (!work_ || ns < slow_op_ns)
+      return;
+
+    const ReaderWork work;
+    LOG(INFO) << "Slow " << op_ << ' ' << describe_() << ": " << ns / 1000000
+              << " ms, " << work.rewinds - work_->rewinds << " rewinds, "
+              << work.seek_point_restarts - work_->seek_point_restarts
+              << " seek point restarts, " << work.too_far - work_->too_far
+              << " too far, "
+              << work.cache_reserved_bytes - work_->cache_reserved_bytes
+              << " bytes reserved in cache, "
+              << work.inflated_bytes - work_->inflated_bytes
+              << " bytes inflated";
+  }
+
  private:
-  // Converts a C++ exception into a negative error code.
-  // Also logs the error.
-  // Must be called from within a catch block.
-  static int ToError(std::string_view action, Path path) {
-    try {
-      throw;
-    } catch (const std::bad_alloc&) {
-      LOG(ERROR) << "Cannot " << action << ' ' << path << ": No memory";
-      return -ENOMEM;
-    } catch (const std::exception& e) {
-      LOG(ERROR) << "Cannot " << action << ' ' << path << ": " << e.what();
-      return -EIO;
-    } catch (...) {
-      LOG(ERROR) << "Cannot " << action << ' ' << path << ": Unexpected error";
-      return -EIO;
+  Histogram& histogram_;
+  const char* const op_;
+  const Describe describe_;
+  std::optional<ReaderWork> work_;
+  const Stopwatch stopwatch_;
+};
+
+// Describes a read operation of |size| bytes at |offset| by |reader|.
+template <typename T>
+static std::string DescribeRead(const T& what,
+                                const Reader& reader,
+                                const size_t size,
+                                const off_t offset) {
+  return StrCat(what, " at offset ", offset, " of size ", size, " by ",
+                reader);
+}
+
+#if FUSE_VERSION >= 29
+// Makes a FUSE buffer telling FUSE to read the given file |range|.
+static fuse_bufvec MakeFileBuf(const Reader::FileRange& range) {
+  return {.count = 1,
+          .buf = {{.size = static_cast<size_t>(range.size),
+                   .flags = static_cast<fuse_buf_flags>(FUSE_BUF_IS_FD |
+                                                        FUSE_BUF_FD_SEEK),
+                   .mem = nullptr,
+                   .fd = range.fd,
+                   .pos = range.pos}}};
+}
+#endif
+
+// Gets the file system statistics of the given |tree|.
+static void GetStatFs(const Tree& tree, struct statvfs* const st) {
+  assert(st);
+  st->f_bsize = Tree::block_size;
+  st->f_frsize = Tree::block_size;
+  st->f_blocks = tree.GetBlockCount();
+  st->f_bfree = 0;
+  st->f_bavail = 0;
+  st->f_files = tree.GetNodeCount();
+  st->f_ffree = 0;
+  st->f_favail = 0;
+  st->f_flag = ST_RDONLY;
+  st->f_namemax = NAME_MAX;
+}
+
+// Open directory. Keeps track of the position in the directory listing, so
+// that a listing split over several calls can resume without walking the
+// children list again.
+class DirHandle {
+ public:
+  explicit DirHandle(const FileNode* const dir) : dir_(dir) {
+    assert(dir_);
+    assert(dir_->is_dir());
+  }
+
+  // Position of the current entry. Entries 0 and 1 are "." and "..", then come
+  // the children.
+  off_t pos() const { return pos_; }
+
+  // Moves to the entry at position |offset|, or to the end of the listing.
+  void Seek(const off_t offset) {
+    if (offset < pos_) {
+      // Rewind.
+      pos_ = 0;
     }
+
+    while (pos_ < offset && !AtEnd())
+      Next();
   }
 
-  static const FileNode* GetNode(std::string_view fname) {
+  // Gets the |name| and the |node| of the current entry. The |node| is null for
+  // the ".." entry of the root directory. Returns false at the end of the
+  // listing.
+  bool Get(const char** const name, const FileNode** const node) const {
+    switch (pos_) {
+      case 0:
+        *name = ".";
+        *node = dir_;
+        return true;
+
+      case 1:
+        *name = "..";
+        *node = dir_->parent;
+        return true;
+
+      default:
+        if (AtEnd())
+          return false;
+
+        // The name is NUL-terminated.
+        *name = next_->name.data();
+        *node = &*next_;
+        return true;
+    }
+  }
+
+  // Moves to the next entry.
+  // Precondition: not at the end of the listing.
+  void Next() {
+    assert(!AtEnd());
+    if (pos_ == 1) {
+      next_ = dir_->children.begin();
+    } else if (pos_ > 1) {
+      ++next_;
+    }
+
+    ++pos_;
+  }
+
+ private:
+  bool AtEnd() const { return pos_ > 1 && next_ == dir_->children.end(); }
+
+  // Directory being listed.
+  const FileNode* const dir_;
+
+  // Position of the current entry.
+  off_t pos_ = 0;
+
+  // Current child if |pos_ > 1|.
+  FileNode::Children::const_iterator next_;
+};
+
+// FUSE operations
+struct Operations : fuse_operations {
+ private:
+  static Tree* GetTree() {
     Tree* const tree = static_cast<Tree*>(fuse_get_context()->private_data);
     assert(tree);
-    const FileNode* const node = tree->Find(fname);
+    return tree;
+  }
+
+  static const FileNode* GetNode(std::string_view fname) {
+    const FileNode* const node = GetTree()->Find(fname);
+    Count(node ? g_stats.lookup_hits : g_stats.lookup_misses);
     if (!node)
       LOG(DEBUG) << "Cannot find " << Path(fname);
     return node;
   }
 
+  static void* Init(fuse_conn_info* const conn) {
+    EnableSplice(conn);
+    EnableStats();
+    GetTree()->StartWarming();
+    GetTree()->StartScrubbing();
+    return GetTree();
+  }
+
   static int GetAttr(const char* path, struct stat* st) try {
+    const OpTracer tracer(g_stats.getattr_latency, "stat",
+                          [path] { return StrCat(Path(path)); });
     const FileNode* const node = GetNode(path);
     if (!node)
       return -ENOENT;
 
+    node->LoadAttributes(GetTree()->GetZipHandle());
     *st = *node;
     return 0;
   } catch (...) {
-    return ToError("stat", path);
+    return ToError("stat", Path(path));
   }
 
-  static int ReadDir(const char* path,
-                     void* buf,
-                     fuse_fill_dir_t filler,
-                     [[maybe_unused]] off_t offset,
-                     [[maybe_unused]] fuse_file_info* fi) try {
+  static int OpenDir(const char* path, fuse_file_info* fi) try {
     const FileNode* const node = GetNode(path);
     if (!node)
       return -ENOENT;
 
-    {
-      const struct stat st = *node;
-      filler(buf, ".", &st, 0);
-    }
+    if (!node->is_dir())
+      return -ENOTDIR;
 
-    if (const FileNode* const parent = node->parent) {
-      const struct stat st = *parent;
-      filler(buf, "..", &st, 0);
-    } else {
-      filler(buf, "..", nullptr, 0);
-    }
+    fi->fh = reinterpret_cast<uint64_t>(new DirHandle(node));
+    return 0;
+  } catch (...) {
+    return ToError("open dir", Path(path));
+  }
+
+  static int ReadDir(const char* path,
+                     void* buf,
+                     fuse_fill_dir_t filler,
+                     off_t offset,
+                     fuse_file_info* fi) try {
+    const OpTracer tracer(g_stats.readdir_latency, "read dir", [path, offset] {
+      return StrCat(Path(path), " at offset ", offset);
+    });
+    DirHandle& dir = *reinterpret_cast<DirHandle*>(fi->fh);
+    dir.Seek(offset);
+
+    const char* name;
+    const FileNode* node;
+    while (dir.Get(&name, &node)) {
+      struct stat st;
+      if (node)
+        st = node->GetEntryStat();
+
+      // Stop when the buffer is full.
+      if (filler(buf, name, node ? &st : nullptr, dir.pos() + 1))
+        break;
 
-    for (const FileNode& child : node->children) {
-      const struct stat st = child;
-      filler(buf, child.name.c_str(), &st, 0);
+      dir.Next();
     }
 
     return 0;
   } catch (...) {
-    return ToError("read dir", path);
+    return ToError("read dir", Path(path));
+  }
+
+  static int ReleaseDir([[maybe_unused]] const char* path,
+                        fuse_file_info* fi) {
+    delete reinterpret_cast<DirHandle*>(fi->fh);
+    return 0;
   }
 
   static int Open(const char* path, fuse_file_info* fi) try {
+    const OpTracer tracer(g_stats.open_latency, "open",
+                          [path] { return StrCat(Path(path)); });
     const FileNode* const node = GetNode(path);
     if (!node)
       return -ENOENT;
@@ -192,11 +541,12 @@ struct Operations : fuse_operations {
     if (node->is_dir())
       return -EISDIR;
 
-    Reader::Ptr reader = node->GetReader();
+    Reader::Ptr reader = node->GetReader(GetTree()->GetZipHandle());
     fi->fh = reinterpret_cast<uint64_t>(reader.release());
+    fi->keep_cache = cache_options.keep_cache;
     return 0;
   } catch (...) {
-    return ToError("open", path);
+    return ToError("open", Path(path));
   }
 
   static int Read(const char* path,
@@ -207,14 +557,60 @@ struct Operations : fuse_operations {
     if (offset < 0)
       return -EINVAL;
 
-    return static_cast<int>(
-        reinterpret_cast<Reader*>(fi->fh)->Read(
-            buf, buf + std::min<size_t>(size, std::numeric_limits<int>::max()),
-            offset) -
-        buf);
+    size = std::min<size_t>(size, std::numeric_limits<int>::max());
+    Reader* const reader = reinterpret_cast<Reader*>(fi->fh);
+    const OpTracer tracer(g_stats.read_latency, "read", [&] {
+      return DescribeRead(Path(path), *reader, size, offset);
+    });
+    if (access_profile)
+      RecordRead(GetTree()->Find(path), offset, size);
+    return static_cast<int>(reader->Read(buf, buf + size, offset) - buf);
+  } catch (...) {
+    return ToError("read", Path(path));
+  }
+
+#if FUSE_VERSION >= 29
+  // Same as Read(), but lets FUSE read the data directly from the ZIP archive
+  // file when possible. The returned buffer is freed by FUSE.
+  static int ReadBuf(const char* path,
+                     fuse_bufvec** const bufp,
+                     size_t size,
+                     off_t offset,
+                     fuse_file_info* fi) try {
+    if (offset < 0)
+      return -EINVAL;
+
+    size = std::min<size_t>(size, std::numeric_limits<int>::max());
+    Reader* const reader = reinterpret_cast<Reader*>(fi->fh);
+    const OpTracer tracer(g_stats.read_latency, "read", [&] {
+      return DescribeRead(Path(path), *reader, size, offset);
+    });
+    if (access_profile)
+      RecordRead(GetTree()->Find(path), offset, size);
+    fuse_bufvec* const bufv =
+        static_cast<fuse_bufvec*>(std::malloc(sizeof(fuse_bufvec)));
+    if (!bufv)
+      throw std::bad_alloc();
+
+    if (Reader::FileRange range; reader->GetFileRange(offset, size, &range)) {
+      *bufv = MakeFileBuf(range);
+      *bufp = bufv;
+      return 0;
+    }
+
+    *bufv = {.count = 1, .buf = {{.size = 0, .mem = nullptr, .fd = -1}}};
+    *bufp = bufv;
+    char* const buf = static_cast<char*>(std::malloc(size));
+    if (!buf)
+      throw std::bad_alloc();
+
+    bufv->buf[0].mem = buf;
+    bufv->buf[0].size = reader->Read(buf, buf + size, offset) - buf;
+    return 0;
   } catch (...) {
-    return ToError("read", path);
+    return ToError("read", Path(path));
   }
+#endif
 
   static int Release([[maybe_unused]] const char* path, fuse_file_info* fi) {
     const Reader::Ptr p(reinterpret_cast<Reader*>(fi->fh));
@@ -222,6 +618,8 @@ struct Operations : fuse_operations {
   }
 
   static int ReadLink(const char* path, char* buf, size_t size) try {
+    const OpTracer tracer(g_stats.readlink_latency, "read link",
+                          [path] { return StrCat(Path(path)); });
     const FileNode* const node = GetNode(path);
     if (!node)
       return -ENOENT;
@@ -229,42 +627,33 @@ struct Operations : fuse_operations {
     if (node->type() != FileType::Symlink)
       return -EINVAL;
 
-    const Reader::Ptr reader = node->GetReader();
+    const Reader::Ptr reader = node->GetReader(GetTree()->GetZipHandle());
     buf = reader->Read(buf, buf + size - 1, 0);
     *buf = '\0';
     return 0;
   } catch (...) {
-    return ToError("read link", path);
+    return ToError("read link", Path(path));
   }
 
   static int StatFs([[maybe_unused]] const char* const path,
                     struct statvfs* const st) {
-    assert(st);
-    const Tree* const tree =
-        static_cast<const Tree*>(fuse_get_context()->private_data);
-    assert(tree);
-    st->f_bsize = Tree::block_size;
-    st->f_frsize = Tree::block_size;
-    st->f_blocks = tree->GetBlockCount();
-    st->f_bfree = 0;
-    st->f_bavail = 0;
-    st->f_files = tree->GetNodeCount();
-    st->f_ffree = 0;
-    st->f_favail = 0;
-    st->f_flag = ST_RDONLY;
-    st->f_namemax = NAME_MAX;
+    GetStatFs(*GetTree(), st);
     return 0;
   }
 
  public:
   Operations() : fuse_operations {
     .getattr = GetAttr, .readlink = ReadLink, .open = Open, .read = Read,
-    .statfs = StatFs, .release = Release, .readdir = ReadDir,
+    .statfs = StatFs, .release = Release, .opendir = OpenDir,
+    .readdir = ReadDir, .releasedir = ReleaseDir, .init = Init,
 #if FUSE_VERSION >= 28
     .flag_nullpath_ok = 0,  // Don't allow null path
 #endif
 #if FUSE_VERSION == 29
         .flag_utime_omit_ok = 1,
+#endif
+#if FUSE_VERSION >= 29
+        .read_buf = ReadBuf,
 #endif
   }
   {}
@@ -272,6 +661,275 @@ struct Operations : fuse_operations {
 
 static const Operations operations;
 
+// FUSE low-level operations. The nodes are identified by the address of their
+// FileNode, except for the root node which is identified by FUSE_ROOT_ID. The
+// FileNodes are never deleted while the filesystem is mounted, so there is no
+// need to keep track of the lookup counts.
+struct LowLevelOperations : fuse_lowlevel_ops {
+ private:
+  static Tree* GetTree(fuse_req_t req) {
+    Tree* const tree = static_cast<Tree*>(fuse_req_userdata(req));
+    assert(tree);
+    return tree;
+  }
+
+  static const FileNode* GetNode(fuse_req_t req, fuse_ino_t ino) {
+    const FileNode* const node =
+        ino == FUSE_ROOT_ID ? GetTree(req)->FindChild(nullptr, "/")
+                            : reinterpret_cast<const FileNode*>(ino);
+    assert(node);
+    return node;
+  }
+
+  static void ReplyError(fuse_req_t req,
+                         std::string_view action,
+                         const FileNode& node) {
+    fuse_reply_err(req, -ToError(action, node));
+  }
+
+  static void Init(void* userdata, fuse_conn_info* conn) {
+    EnableSplice(conn);
+    EnableStats();
+    static_cast<Tree*>(userdata)->StartWarming();
+    static_cast<Tree*>(userdata)->StartScrubbing();
+  }
+
+  static void Lookup(fuse_req_t req, fuse_ino_t parent, const char* name) try {
+    const FileNode* const node = GetNode(req, parent);
+    const FileNode* const child = GetTree(req)->FindChild(node, name);
+    Count(child ? g_stats.lookup_hits : g_stats.lookup_misses);
+    if (!child) {
+      LOG(DEBUG) << "Cannot find " << Path(name) << " in " << *node;
+      // Let the kernel cache the failed lookup.
+      const fuse_entry_param e = {
+          .ino = 0, .entry_timeout = cache_options.negative_timeout};
+      fuse_reply_entry(req, &e);
+      return;
+    }
+
+    child->LoadAttributes(GetTree(req)->GetZipHandle());
+    const fuse_entry_param e = {
+        .ino = reinterpret_cast<fuse_ino_t>(child),
+        .attr = *child,
+        .attr_timeout = cache_options.attr_timeout,
+        .entry_timeout = cache_options.entry_timeout};
+    fuse_reply_entry(req, &e);
+  } catch (...) {
+    fuse_reply_err(req, -ToError("look up", Path(name)));
+  }
+
+  static void Forget(fuse_req_t req,
+                     [[maybe_unused]] fuse_ino_t ino,
+                     [[maybe_unused]] unsigned long nlookup) {
+    fuse_reply_none(req);
+  }
+
+  static void GetAttr(fuse_req_t req,
+                      fuse_ino_t ino,
+                      [[maybe_unused]] fuse_file_info* fi) try {
+    const FileNode* const node = GetNode(req, ino);
+    const OpTracer tracer(g_stats.getattr_latency, "stat",
+                          [node] { return StrCat(*node); });
+    node->LoadAttributes(GetTree(req)->GetZipHandle());
+    const struct stat st = *node;
+    fuse_reply_attr(req, &st, cache_options.attr_timeout);
+  } catch (...) {
+    ReplyError(req, "stat", *GetNode(req, ino));
+  }
+
+  static void OpenDir(fuse_req_t req, fuse_ino_t ino, fuse_file_info* fi) try {
+    const FileNode* const node = GetNode(req, ino);
+    if (!node->is_dir()) {
+      fuse_reply_err(req, ENOTDIR);
+      return;
+    }
+
+    std::unique_ptr<DirHandle> dir(new DirHandle(node));
+    fi->fh = reinterpret_cast<uint64_t>(dir.get());
+    if (fuse_reply_open(req, fi) == 0)
+      dir.release();
+  } catch (...) {
+    ReplyError(req, "open dir", *GetNode(req, ino));
+  }
+
+  static void ReadDir(fuse_req_t req,
+                      fuse_ino_t ino,
+                      size_t size,
+                      off_t offset,
+                      fuse_file_info* fi) try {
+    const OpTracer tracer(
+        g_stats.readdir_latency, "read dir", [req, ino, offset] {
+          return StrCat(*GetNode(req, ino), " at offset ", offset);
+        });
+    DirHandle& dir = *reinterpret_cast<DirHandle*>(fi->fh);
+    dir.Seek(offset);
+
+    const std::unique_ptr<char[]> buf(new char[size]);
+    size_t n = 0;
+    const char* name;
+    const FileNode* node;
+    while (dir.Get(&name, &node)) {
+      struct stat st = {.st_mode = S_IFDIR};
+      if (node)
+        st = node->GetEntryStat();
+
+      const size_t m = fuse_add_direntry(req, buf.get() + n, size - n, name,
+                                         &st, dir.pos() + 1);
+      // Stop when the buffer is full.
+      if (m > size - n)
+        break;
+
+      n += m;
+      dir.Next();
+    }
+
+    fuse_reply_buf(req, buf.get(), n);
+  } catch (...) {
+    ReplyError(req, "read dir", *GetNode(req, ino));
+  }
+
+  static void ReleaseDir(fuse_req_t req,
+                         [[maybe_unused]] fuse_ino_t ino,
+                         fuse_file_info* fi) {
+    delete reinterpret_cast<DirHandle*>(fi->fh);
+    fuse_reply_err(req, 0);
+  }
+
+  static void Open(fuse_req_t req, fuse_ino_t ino, fuse_file_info* fi) try {
+    const FileNode* const node = GetNode(req, ino);
+    const OpTracer tracer(g_stats.open_latency, "open",
+                          [node] { return StrCat(*node); });
+    if (node->is_dir()) {
+      fuse_reply_err(req, EISDIR);
+      return;
+    }
+
+    Reader::Ptr reader = node->GetReader(GetTree(req)->GetZipHandle());
+    fi->fh = reinterpret_cast<uint64_t>(reader.get());
+    fi->keep_cache = cache_options.keep_cache;
+    if (fuse_reply_open(req, fi) == 0)
+      reader.release();
+  } catch (...) {
+    ReplyError(req, "open", *GetNode(req, ino));
+  }
+
+  static void Read(fuse_req_t req,
+                   fuse_ino_t ino,
+                   size_t size,
+                   off_t offset,
+                   fuse_file_info* fi) try {
+    if (offset < 0) {
+      fuse_reply_err(req, EINVAL);
+      return;
+    }
+
+    Reader* const reader = reinterpret_cast<Reader*>(fi->fh);
+    const OpTracer tracer(g_stats.read_latency, "read", [&] {
+      return DescribeRead(*GetNode(req, ino), *reader, size, offset);
+    });
+    if (access_profile)
+      RecordRead(GetNode(req, ino), offset, size);
+
+#if FUSE_VERSION >= 29
+    // Let FUSE read the data directly from the ZIP archive file if possible.
+    if (Reader::FileRange range; reader->GetFileRange(offset, size, &range)) {
+      fuse_bufvec bufv = MakeFileBuf(range);
+      fuse_reply_data(req, &bufv, FUSE_BUF_SPLICE_MOVE);
+      return;
+    }
+#endif
+
+    const std::unique_ptr<char[]> buf(new char[size]);
+    const char* const end = reader->Read(buf.get(), buf.get() + size, offset);
+    fuse_reply_buf(req, buf.get(), end - buf.get());
+  } catch (...) {
+    ReplyError(req, "read", *GetNode(req, ino));
+  }
+
+  static void Release(fuse_req_t req,
+                      [[maybe_unused]] fuse_ino_t ino,
+                      fuse_file_info* fi) {
+    const Reader::Ptr p(reinterpret_cast<Reader*>(fi->fh));
+    fuse_reply_err(req, 0);
+  }
+
+  static void ReadLink(fuse_req_t req, fuse_ino_t ino) try {
+    const FileNode* const node = GetNode(req, ino);
+    const OpTracer tracer(g_stats.readlink_latency, "read link",
+                          [node] { return StrCat(*node); });
+    if (node->type() != FileType::Symlink) {
+      fuse_reply_err(req, EINVAL);
+      return;
+    }
+
+    const Reader::Ptr reader = node->GetReader(GetTree(req)->GetZipHandle());
+    char buf[PATH_MAX + 1];
+    *reader->Read(buf, buf + PATH_MAX, 0) = '\0';
+    fuse_reply_readlink(req, buf);
+  } catch (...) {
+    ReplyError(req, "read link", *GetNode(req, ino));
+  }
+
+  static void StatFs(fuse_req_t req, [[maybe_unused]] fuse_ino_t ino) {
+    struct statvfs st = {};
+    GetStatFs(*GetTree(req), &st);
+    fuse_reply_statfs(req, &st);
+  }
+
+ public:
+  LowLevelOperations()
+      : fuse_lowlevel_ops{.init = Init,
+                          .lookup = Lookup,
+                          .forget = Forget,
+                          .getattr = GetAttr,
+                          .readlink = ReadLink,
+                          .open = Open,
+                          .read = Read,
+                          .release = Release,
+                          .opendir = OpenDir,
+                          .readdir = ReadDir,
+                          .releasedir = ReleaseDir,
+                          .statfs = StatFs} {}
+};
+
+static const LowLevelOperations low_level_operations;
+
+// Mounts the |tree| using the FUSE low-level API, and serves requests until
+// the filesystem is unmounted. Returns the exit code of the program.
+static int MountLowLevel(fuse_args* const args, Tree* const tree) {
+  static_assert(sizeof(const FileNode*) <= sizeof(fuse_ino_t));
+  char* mount_point = nullptr;
+  int multithreaded, foreground;
+  if (fuse_parse_cmdline(args, &mount_point, &multithreaded, &foreground) < 0)
+    return EXIT_FAILURE;
+
+  const std::unique_ptr<char, decltype(&free)> cleanup(mount_point, &free);
+  fuse_chan* const chan = fuse_mount(mount_point, args);
+  if (!chan)
+    return EXIT_FAILURE;
+
+  int ret = EXIT_FAILURE;
+  if (fuse_session* const session =
+          fuse_lowlevel_new(args, &low_level_operations,
+                            sizeof(low_level_operations), tree)) {
+    if (fuse_set_signal_handlers(session) == 0) {
+      fuse_session_add_chan(session, chan);
+      if (fuse_daemonize(foreground) == 0 &&
+          (multithreaded ? fuse_session_loop_mt(session)
+                         : fuse_session_loop(session)) == 0)
+        ret = EXIT_SUCCESS;
+
+      fuse_remove_signal_handlers(session);
+      fuse_session_remove_chan(chan);
+    }
+
+    fuse_session_destroy(session);
+  }
+
+  fuse_unmount(mount_point, chan);
+  return ret;
+}
+
 enum {
   KEY_HELP,
   KEY_VERSION,
@@ -287,6 +945,12 @@ enum {
   KEY_NO_SYMLINKS,
   KEY_NO_HARDLINKS,
   KEY_DEFAULT_PERMISSIONS,
+  KEY_LOW_LEVEL,
+  KEY_LAZY,
+  KEY_LAZY_ATTRIBUTES,
+  KEY_VERIFY,
+  KEY_SCRUB,
+  KEY_NO_KERNEL_CACHE,
 };
 
 // Processes command line arguments.
@@ -383,6 +1047,30 @@ static int ProcessArg(void* data,
       param.opts.include_hardlinks = false;
       return DISCARD;
 
+    case KEY_NO_KERNEL_CACHE:
+      param.cache.keep_cache = false;
+      return DISCARD;
+
+    case KEY_LOW_LEVEL:
+      param.low_level = true;
+      return DISCARD;
+
+    case KEY_LAZY:
+      param.opts.lazy = true;
+      return DISCARD;
+
+    case KEY_LAZY_ATTRIBUTES:
+      param.opts.lazy_attributes = true;
+      return DISCARD;
+
+    case KEY_VERIFY:
+      param.opts.verify = true;
+      return DISCARD;
+
+    case KEY_SCRUB:
+      param.opts.scrub = true;
+      return DISCARD;
+
     case KEY_DEFAULT_PERMISSIONS:
       DataNode::original_permissions = true;
       return KEEP;
@@ -447,20 +1135,148 @@ int main(int argc, char* argv[]) try {
       FUSE_OPT_KEY("--precache", KEY_PRE_CACHE),
       FUSE_OPT_KEY("--memcache", KEY_MEM_CACHE),
       FUSE_OPT_KEY("--nocache", KEY_NO_CACHE),
+      FUSE_OPT_KEY("--lowlevel", KEY_LOW_LEVEL),
+      FUSE_OPT_KEY("--lazy", KEY_LAZY),
+      FUSE_OPT_KEY("--lazy-attributes", KEY_LAZY_ATTRIBUTES),
+      FUSE_OPT_KEY("--verify", KEY_VERIFY),
+      FUSE_OPT_KEY("--scrub", KEY_SCRUB),
       FUSE_OPT_KEY("nospecials", KEY_NO_SPECIALS),
       FUSE_OPT_KEY("nosymlinks", KEY_NO_SYMLINKS),
       FUSE_OPT_KEY("nohardlinks", KEY_NO_HARDLINKS),
+      FUSE_OPT_KEY("nokernelcache", KEY_NO_KERNEL_CACHE),
       FUSE_OPT_KEY("default_permissions", KEY_DEFAULT_PERMISSIONS),
       {"--cache=%s", offsetof(Param, cache_dir)},
       {"encoding=%s", offsetof(Param, opts.encoding)},
       {"dmask=%o", offsetof(Param, dmask)},
       {"fmask=%o", offsetof(Param, fmask)},
+      {"--threads=%d", offsetof(Param, opts.threads)},
+      {"--parse-threads=%d", offsetof(Param, opts.parse_threads)},
+      {"--precache-threads=%d", offsetof(Param, opts.pre_cache_threads)},
+      {"--verify-threads=%d", offsetof(Param, opts.verify_threads)},
+      {"--seek-span=%d", offsetof(Param, seek_span)},
+      {"--cache-size=%d", offsetof(Param, cache_size)},
+      {"--idle-files=%d", offsetof(Param, idle_files)},
+      {"--prefetch=%d", offsetof(Param, prefetch)},
+      {"--buffer-size=%d", offsetof(Param, buffer_size)},
+      {"--inflate=%s", offsetof(Param, inflate)},
+      {"--inflate-threads=%d", offsetof(Param, inflate_threads)},
+      {"--read-ahead=%d", offsetof(Param, read_ahead)},
+      {"--slow-op=%d", offsetof(Param, slow_op)},
+      {"--index=%s", offsetof(Param, opts.index_file)},
+      {"--record=%s", offsetof(Param, record_file)},
+      {"--warm=%s", offsetof(Param, opts.warm_file)},
+      {"entry_timeout=%lf", offsetof(Param, cache.entry_timeout)},
+      {"attr_timeout=%lf", offsetof(Param, cache.attr_timeout)},
+      {"negative_timeout=%lf", offsetof(Param, cache.negative_timeout)},
       FUSE_OPT_END,
   };
 
   if (fuse_opt_parse(&args, &param, opts, ProcessArg))
     return EXIT_FAILURE;
 
+  if (param.opts.threads < 1) {
+    fprintf(stderr, "%s: the number of threads must be at least 1\n",
+            PROGRAM);
+    return EXIT_FAILURE;
+  }
+
+  if (param.opts.parse_threads < 1) {
+    fprintf(stderr, "%s: the number of parse threads must be at least 1\n",
+            PROGRAM);
+    return EXIT_FAILURE;
+  }
+
+  if (param.opts.pre_cache_threads < 1) {
+    fprintf(stderr, "%s: the number of precache threads must be at least 1\n",
+            PROGRAM);
+    return EXIT_FAILURE;
+  }
+
+  if (param.opts.verify_threads < 1) {
+    fprintf(stderr, "%s: the number of verify threads must be at least 1\n",
+            PROGRAM);
+    return EXIT_FAILURE;
+  }
+
+  if (param.seek_span < 0) {
+    fprintf(stderr, "%s: the seek span cannot be negative\n", PROGRAM);
+    return EXIT_FAILURE;
+  }
+
+  Reader::SetSeekSpan(static_cast<off_t>(param.seek_span) << 20);
+
+  if (param.cache_size < 0) {
+    fprintf(stderr, "%s: the cache size cannot be negative\n", PROGRAM);
+    return EXIT_FAILURE;
+  }
+
+  Reader::SetCacheSize(static_cast<off_t>(param.cache_size) << 20);
+
+  if (param.idle_files < 0) {
+    fprintf(stderr, "%s: the number of idle files cannot be negative\n",
+            PROGRAM);
+    return EXIT_FAILURE;
+  }
+
+  Reader::SetMaxIdleCachedFiles(param.idle_files);
+
+  if (param.prefetch < 0 ||
+      param.prefetch > BufferedReader::max_prefetch_size >> 10) {
+    fprintf(stderr, "%s: the prefetch size must be between 0 and %d KB\n",
+            PROGRAM, static_cast<int>(BufferedReader::max_prefetch_size >> 10));
+    return EXIT_FAILURE;
+  }
+
+  Reader::SetPrefetchSize(static_cast<ssize_t>(param.prefetch) << 10);
+
+  if (param.buffer_size < BufferedReader::min_buffer_size >> 10) {
+    fprintf(stderr, "%s: the buffer size must be at least %d KB\n", PROGRAM,
+            static_cast<int>(BufferedReader::min_buffer_size >> 10));
+    return EXIT_FAILURE;
+  }
+
+  Reader::SetMaxBufferSize(static_cast<ssize_t>(param.buffer_size) << 10);
+
+  if (param.inflate) {
+    try {
+      Decoder::SetEngine(param.inflate);
+    } catch (const std::exception& e) {
+      fprintf(stderr, "%s: %s\n", PROGRAM, e.what());
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (param.inflate_threads < 1) {
+    fprintf(stderr, "%s: the number of inflate threads must be at least 1\n",
+            PROGRAM);
+    return EXIT_FAILURE;
+  }
+
+  Reader::SetInflateThreads(param.inflate_threads);
+
+  if (param.read_ahead < 0) {
+    fprintf(stderr, "%s: the read-ahead size cannot be negative\n", PROGRAM);
+    return EXIT_FAILURE;
+  }
+
+  param.opts.read_ahead = static_cast<ssize_t>(param.read_ahead) << 10;
+
+  if (param.slow_op < 0) {
+    fprintf(stderr, "%s: the slow operation threshold cannot be negative\n",
+            PROGRAM);
+    return EXIT_FAILURE;
+  }
+
+  slow_op_ns = static_cast<i64>(param.slow_op) * 1000000;
+
+  if (param.cache.entry_timeout < 0 || param.cache.attr_timeout < 0 ||
+      param.cache.negative_timeout < 0) {
+    fprintf(stderr, "%s: the cache timeouts cannot be negative\n", PROGRAM);
+    return EXIT_FAILURE;
+  }
+
+  cache_options = param.cache;
+
   DataNode::dmask = param.dmask & 0777;
   DataNode::fmask = param.fmask & 0777;
 
@@ -480,6 +1296,22 @@ int main(int argc, char* argv[]) try {
     Reader::SetCacheDir(p);
   }
 
+  // The daemon changes its working directory, so the access profile has to be
+  // saved with an absolute path.
+  std::string record_path;
+  if (param.record_file) {
+    if (param.record_file[0] != '/') {
+      const std::unique_ptr<char, decltype(&free)> cwd(getcwd(nullptr, 0),
+                                                       &free);
+      if (!cwd)
+        ThrowSystemError("Cannot get current directory");
+      record_path = cwd.get();
+    }
+
+    Path::Append(&record_path, param.record_file);
+    access_profile = std::make_unique<AccessProfile>();
+  }
+
   // Open and index the ZIP archive.
   LOG(DEBUG) << "Indexing " << Path(param.filename) << "...";
   Timer timer;
@@ -526,16 +1358,39 @@ int main(int argc, char* argv[]) try {
     }
   }
 
-  // Respect inode numbers.
-  fuse_opt_add_arg(&args, "-ouse_ino");
-
   // Read-only mounting.
   fuse_opt_add_arg(&args, "-r");
 
-  // Single-threaded operation.
-  fuse_opt_add_arg(&args, "-s");
+  // Single-threaded operation, unless several threads have been requested.
+  if (param.opts.threads == 1)
+    fuse_opt_add_arg(&args, "-s");
+
+  int ret;
+  if (param.low_level) {
+    ret = MountLowLevel(&args, &tree);
+  } else {
+    // Respect inode numbers.
+    fuse_opt_add_arg(&args, "-ouse_ino");
+
+    // Kernel caching timeouts. Not using StrCat, since the global locale adds
+    // thousands separators.
+    char timeouts[128];
+    snprintf(timeouts, sizeof(timeouts),
+             "-oentry_timeout=%g,attr_timeout=%g,negative_timeout=%g",
+             cache_options.entry_timeout, cache_options.attr_timeout,
+             cache_options.negative_timeout);
+    fuse_opt_add_arg(&args, timeouts);
+
+    ret = fuse_main(args.argc, args.argv, &operations, &tree);
+  }
+
+  tree.StopWarming();
+  tree.StopScrubbing();
+
+  if (access_profile)
+    access_profile->Save(record_path.c_str());
 
-  return fuse_main(args.argc, args.argv, &operations, &tree);
+  return ret;
 } catch (const ZipError& e) {
   LOG(ERROR) << e.what();
   // Shift libzip error codes in order to avoid collision with FUSE errors.
@@ -0,0 +1,289 @@
+// Copyright 2021 Google LLC
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// Micro-benchmarks of the tree indexing and of the readers, without FUSE.
+//
+// Usage: bench.x [FILTER]
+//
+// Runs the benchmarks whose name contains FILTER, from the directory holding
+// the test archives in data/ and ../blackbox/data/. Prints one line per
+// benchmark in the Go benchmark format, so that results can be compared with
+// tools like benchstat:
+//
+//   <name> <iterations> <time> ns/op [<throughput> MB/s]
+//
+// The random access patterns use a fixed seed, so that every run performs
+// the same operations.
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "file_node.h"
+#include "log.h"
+#include "path.h"
+#include "reader.h"
+#include "stats.h"
+#include "tree.h"
+
+namespace {
+
+// Only the benchmarks whose name contains this filter are run.
+std::string_view filter;
+
+bool IsEnabled(std::string_view name) {
+  return name.find(filter) != std::string_view::npos;
+}
+
+// Prints the result of the benchmark |name|, which performed |n| operations
+// processing |bytes| bytes in total in |ns| nanoseconds.
+void Report(std::string_view name, i64 n, i64 ns, i64 bytes = 0) {
+  // Don't use an ostream, since the global locale could add thousands
+  // separators.
+  std::printf("%.*s %lld %.1f ns/op", static_cast<int>(name.size()),
+              name.data(), static_cast<long long>(n),
+              static_cast<double>(ns) / std::max<i64>(n, 1));
+  if (bytes > 0)
+    std::printf(" %.2f MB/s", 1e3 * bytes / std::max<i64>(ns, 1));
+  std::printf("\n");
+  std::fflush(stdout);
+}
+
+// Indexes the ZIP archive |path| |n| times with the given options.
+void BenchTreeInit(std::string_view name,
+                   const std::string& path,
+                   int n,
+                   const Tree::Options& opts = {}) {
+  if (!IsEnabled(name))
+    return;
+
+  const Stopwatch stopwatch;
+  for (int i = 0; i < n; ++i)
+    Tree::Init(path.c_str(), opts);
+  Report(name, n, stopwatch.ns());
+}
+
+// Collects the paths of |node| and of all its descendants.
+void GetPaths(const FileNode& node, std::vector<std::string>* paths) {
+  paths->push_back(node.path());
+  for (const FileNode& child : node.children)
+    GetPaths(child, paths);
+}
+
+// Looks up |n| paths of the ZIP archive |path| in random order. Half of these
+// paths don't exist.
+void BenchTreeFind(std::string_view name, const std::string& path, i64 n) {
+  if (!IsEnabled(name))
+    return;
+
+  const Tree::Ptr tree = Tree::Init(path.c_str());
+  std::vector<std::string> paths;
+  GetPaths(*tree->Find("/"), &paths);
+  const size_t m = paths.size();
+  for (size_t i = 0; i < m; ++i)
+    paths.push_back(paths[i] + " (missing)");
+
+  std::mt19937_64 rng(42);
+  std::shuffle(paths.begin(), paths.end(), rng);
+
+  i64 found = 0;
+  const Stopwatch stopwatch;
+  for (i64 i = 0; i < n; ++i)
+    found += tree->Find(paths[i % paths.size()]) != nullptr;
+  Report(name, n, stopwatch.ns());
+
+  if (found == 0)
+    std::abort();
+}
+
+// Access patterns.
+enum class Pattern {
+  // Reads of 128 KB from the beginning to the end of the file.
+  Sequential,
+  // Reads of 4 KB every 256 KB from the beginning to the end of the file.
+  Strided,
+  // Reads of 4 KB at random positions.
+  Random,
+};
+
+// Reads |reader| following the given |pattern|. The |size| of the file must
+// be at least 1 MB.
+void BenchRead(std::string_view name,
+               Reader& reader,
+               const off_t size,
+               const Pattern pattern) {
+  assert(size >= 1 << 20);
+  const ssize_t chunk = pattern == Pattern::Sequential ? 128 << 10 : 4 << 10;
+  const off_t stride = pattern == Pattern::Strided ? 256 << 10 : chunk;
+  const std::unique_ptr<char[]> buf(new char[chunk]);
+  std::mt19937_64 rng(42);
+  std::uniform_int_distribution<off_t> random_offset(0, size - chunk);
+
+  i64 n = 0;
+  i64 bytes = 0;
+  const Stopwatch stopwatch;
+  for (off_t offset = 0; offset < size; offset += stride) {
+    const off_t pos = pattern == Pattern::Random ? random_offset(rng) : offset;
+    const char* const end = reader.Read(buf.get(), buf.get() + chunk, pos);
+    bytes += end - buf.get();
+    ++n;
+
+    // Stop after 10,000 random reads.
+    if (pattern == Pattern::Random && n == 10000)
+      break;
+  }
+
+  Report(name, n, stopwatch.ns(), bytes);
+}
+
+// Names of the access patterns.
+const struct {
+  std::string_view name;
+  Pattern pattern;
+} patterns[] = {
+    {"Sequential", Pattern::Sequential},
+    {"Strided", Pattern::Strided},
+    {"Random", Pattern::Random},
+};
+
+// Is any of the read benchmarks starting with |prefix| enabled?
+bool IsReadEnabled(std::string_view prefix) {
+  for (const auto& [name, pattern] : patterns) {
+    if (IsEnabled(StrCat(prefix, "/", name)))
+      return true;
+  }
+
+  return false;
+}
+
+// Runs all the access patterns on readers made by |make_reader|. Each
+// pattern uses a new reader.
+template <typename MakeReader>
+void BenchReads(std::string_view prefix,
+                const off_t size,
+                MakeReader make_reader) {
+  for (const auto& [name, pattern] : patterns) {
+    const std::string full_name = StrCat(prefix, "/", name);
+    if (!IsEnabled(full_name))
+      continue;
+
+    const Reader::Ptr reader = make_reader();
+    BenchRead(full_name, *reader, size, pattern);
+  }
+}
+
+// Gets the node |path| in |tree|.
+const FileNode& GetNode(Tree& tree, std::string_view path) {
+  const FileNode* const node = tree.Find(path);
+  if (!node)
+    throw std::runtime_error(StrCat("Cannot find ", Path(path)));
+  return *node;
+}
+
+void BenchBufferedReader(const std::string& path) {
+  if (!IsReadEnabled("BenchmarkRead/Buffered"))
+    return;
+
+  const Tree::Ptr tree = Tree::Init(path.c_str());
+  ZipHandle* const zip = tree->GetZipHandle();
+  const FileNode& node = GetNode(*tree, "/deflated.txt");
+  const off_t size = node.link->size;
+  // The random reads make the BufferedReader cache the file.
+  Reader::Ptr shared_cached_reader;
+  BenchReads("BenchmarkRead/Buffered", size, [&] {
+    shared_cached_reader.reset();
+    return Reader::Ptr(new BufferedReader(zip, Reader::Open(zip, node.id),
+                                          node.id, size,
+                                          &shared_cached_reader));
+  });
+}
+
+void BenchCacheFileReader(const std::string& path) {
+  if (!IsReadEnabled("BenchmarkRead/CacheFile") &&
+      !IsEnabled("BenchmarkRead/CacheFile/Cache"))
+    return;
+
+  const Tree::Ptr tree = Tree::Init(path.c_str());
+  ZipHandle* const zip = tree->GetZipHandle();
+  const FileNode& node = GetNode(*tree, "/deflated.txt");
+  const off_t size = node.link->size;
+
+  // Caches the file once, and reads it with new references to the same
+  // reader.
+  Reader::Ptr cached;
+  {
+    const Stopwatch stopwatch;
+    cached = CacheFile(zip, Reader::Open(zip, node.id), node.id, size);
+    Report("BenchmarkRead/CacheFile/Cache", 1, stopwatch.ns(), size);
+  }
+
+  BenchReads("BenchmarkRead/CacheFile", size,
+             [&cached] { return cached->AddRef(); });
+}
+
+void BenchUnbufferedReader(const std::string& path) {
+  if (!IsReadEnabled("BenchmarkRead/Unbuffered"))
+    return;
+
+  const Tree::Ptr tree = Tree::Init(path.c_str());
+  ZipHandle* const zip = tree->GetZipHandle();
+  const FileNode& node = GetNode(*tree, "/stored.txt");
+  const off_t size = node.link->size;
+  BenchReads("BenchmarkRead/Unbuffered", size, [&] {
+    return Reader::Ptr(
+        new UnbufferedReader(zip, Reader::Open(zip, node.id), node.id, size));
+  });
+}
+
+}  // namespace
+
+int main(int argc, char** argv) try {
+  if (argc > 1)
+    filter = argv[1];
+
+  SetLogLevel(LogLevel::WARNING);
+
+  const std::string data = "data/";
+  const std::string blackbox_data = "../blackbox/data/";
+
+  BenchTreeInit("BenchmarkTreeInit/files=10000", data + "files-10000.zip", 10);
+  BenchTreeInit("BenchmarkTreeInit/files=1000000", data + "files-1000000.zip",
+                1);
+  BenchTreeInit("BenchmarkTreeInit/collisions",
+                blackbox_data + "collisions.zip", 1);
+  BenchTreeInit("BenchmarkTreeInit/files=1000000/lazy",
+                data + "files-1000000.zip", 1, {.lazy = true});
+
+  BenchTreeFind("BenchmarkTreeFind/files=10000", data + "files-10000.zip",
+                1000000);
+  BenchTreeFind("BenchmarkTreeFind/files=1000000", data + "files-1000000.zip",
+                1000000);
+
+  BenchBufferedReader(data + "read.zip");
+  BenchCacheFileReader(data + "read.zip");
+  BenchUnbufferedReader(data + "read.zip");
+  return EXIT_SUCCESS;
+} catch (const std::exception& e) {
+  std::fprintf(stderr, "Error: %s\n", e.what());
+  return EXIT_FAILURE;
+}
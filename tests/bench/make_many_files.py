@@ -0,0 +1,45 @@
+#!/bin/python3
+
+# Copyright 2021 Google LLC
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+# Usage: make_many_files.py COUNT
+#
+# Writes data/files-COUNT.zip with COUNT small files spread over two levels of
+# directories, a hundred files per directory.
+
+import os
+import os.path
+import sys
+from zipfile import ZIP_DEFLATED, ZipFile
+
+count = int(sys.argv[1])
+dir = os.path.join(os.path.dirname(os.path.realpath(__file__)), 'data')
+name = 'files-%d.zip' % count
+tmp = os.path.join(dir, name + '~')
+
+try:
+  with ZipFile(tmp, 'w', compression=ZIP_DEFLATED, allowZip64=True) as z:
+    for i in range(count):
+      if i % 1000 == 0:
+        print('\rWriting %s... %3d %%' % (name, 100 * i // count), end='',
+              flush=True)
+      z.writestr('%03d/%03d/file %d.txt' % (i // 100000, i // 100 % 1000, i),
+                 b'%d\n' % i)
+
+  print('\r\033[2KDone', flush=True)
+  os.replace(tmp, os.path.join(dir, name))
+except:
+  os.remove(tmp)
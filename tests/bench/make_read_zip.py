@@ -0,0 +1,45 @@
+#!/bin/python3
+
+# Copyright 2021 Google LLC
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+# Writes data/read.zip with two files of 108 MB, one deflated and one stored
+# without compression.
+
+import os
+import os.path
+from zipfile import ZIP_DEFLATED, ZIP_STORED, ZipFile, ZipInfo
+
+dir = os.path.join(os.path.dirname(os.path.realpath(__file__)), 'data')
+tmp = os.path.join(dir, 'read.zip~')
+
+try:
+  with ZipFile(tmp, 'w', allowZip64=True) as z:
+    for name, compression in [('deflated.txt', ZIP_DEFLATED),
+                              ('stored.txt', ZIP_STORED)]:
+      info = ZipInfo(name)
+      info.compress_type = compression
+      with z.open(info, mode='w', force_zip64=True) as f:
+        for i in range(100):
+          print('\rWriting read.zip... %s %3d %%' % (name, i), end='',
+                flush=True)
+          f.write(b''.join(
+              b'%02d%06d The quick brown fox jumps over the lazy dog.\n'
+              % (i, j) for j in range(20000)))
+
+  print('\r\033[2KDone', flush=True)
+  os.replace(tmp, os.path.join(dir, 'read.zip'))
+except:
+  os.remove(tmp)
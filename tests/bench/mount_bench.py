@@ -0,0 +1,275 @@
+#!/usr/bin/python3
+
+# Copyright 2021 Google LLC
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+# Benchmarks of the mounted filesystem, through FUSE.
+#
+# Usage: mount_bench.py [--runs=N] [--program=PROGRAM] [--baseline=PROGRAM]
+#                        [FILTER]
+#
+# Mounts the test archives in data/ with each cache strategy, and measures the
+# mount time, the time taken by find and ls -lR, the throughput of sequential
+# and random reads, and the peak RSS of mount-zip (../../mount-zip unless
+# --program is given). Runs the benchmarks whose name contains FILTER. Prints
+# one line per benchmark in the Go benchmark format, like bench.x:
+#
+#   <name> <iterations> <time> ns/op [<throughput> MB/s] [<rss> peak-KB]
+#
+# Each benchmark is run N times (default 3), and the median is reported. With
+# --baseline, each benchmark is also run with the given mount-zip PROGRAM, and
+# the results of both programs are printed side by side with their difference.
+
+import argparse
+import os
+import os.path
+import random
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+dir = os.path.dirname(os.path.realpath(__file__))
+
+# Path of the FUSE mounter being benchmarked.
+mount_program = os.path.join(dir, '..', '..', 'mount-zip')
+
+# Cache strategies, and the options selecting them. The cache directory is
+# substituted for {cache_dir}.
+strategies = [
+    ('nocache', ['--nocache']),
+    ('memcache', ['--memcache']),
+    ('cache', ['--cache={cache_dir}']),
+    ('precache', ['--cache={cache_dir}', '--precache']),
+]
+
+# Archives whose tree is listed.
+tree_zips = ['files-10000.zip', 'files-1000000.zip']
+
+# Archive whose files are read, and their names.
+read_zip = 'read.zip'
+read_files = ['deflated.txt', 'stored.txt']
+
+# Maximum number of random reads per file.
+max_random_reads = 10000
+
+
+# Result of a benchmark run.
+class Result:
+
+  def __init__(self, ns, bytes=0, rss=0):
+    self.ns = ns
+    self.bytes = bytes
+    self.rss = rss
+
+
+# Mounted ZIP archive. Runs mount-zip in the foreground, so that its peak RSS
+# can be read before unmounting.
+class Mount:
+
+  def __init__(self, program, zip_name, options):
+    self.zip_path = os.path.join(dir, 'data', zip_name)
+    self.mount_point = tempfile.mkdtemp()
+    self.cache_dir = tempfile.mkdtemp()
+    options = [o.format(cache_dir=self.cache_dir) for o in options]
+    start = time.perf_counter_ns()
+    self.process = subprocess.Popen(
+        [program, '-f', *options, self.zip_path, self.mount_point],
+        stdout=subprocess.DEVNULL,
+        stderr=subprocess.DEVNULL,
+    )
+
+    while not os.path.ismount(self.mount_point):
+      if self.process.poll() is not None:
+        self.Clean()
+        raise RuntimeError(
+            f'Cannot mount {zip_name!r} with {program!r}: exit code'
+            f' {self.process.returncode}'
+        )
+      time.sleep(0.001)
+
+    # Mount time.
+    self.ns = time.perf_counter_ns() - start
+
+  # Gets the peak RSS of mount-zip in KB.
+  def PeakRss(self):
+    with open(f'/proc/{self.process.pid}/status') as f:
+      for line in f:
+        if line.startswith('VmHWM:'):
+          return int(line.split()[1])
+    return 0
+
+  def Path(self, name):
+    return os.path.join(self.mount_point, name)
+
+  def Clean(self):
+    os.rmdir(self.mount_point)
+    os.rmdir(self.cache_dir)
+
+  def __enter__(self):
+    return self
+
+  def __exit__(self, *args):
+    subprocess.run(['fusermount', '-u', '-z', self.mount_point], check=True)
+    self.process.wait()
+    self.Clean()
+
+
+# Runs |command| on the mounted archive. Returns the time taken.
+def RunCommand(mount, command):
+  start = time.perf_counter_ns()
+  subprocess.run(
+      [*command, mount.mount_point], check=True, stdout=subprocess.DEVNULL
+  )
+  return time.perf_counter_ns() - start
+
+
+# Reads the file |name| with reads of 128 KB from the beginning to the end.
+# Returns the time taken and the number of bytes read.
+def ReadSequential(mount, name):
+  n = 0
+  start = time.perf_counter_ns()
+  with open(mount.Path(name), 'rb', buffering=0) as f:
+    while chunk := f.read(128 << 10):
+      n += len(chunk)
+  return time.perf_counter_ns() - start, n
+
+
+# Reads the file |name| with reads of 4 KB at random positions, chosen with a
+# fixed seed. Returns the time taken and the number of bytes read.
+def ReadRandom(mount, name):
+  size = os.path.getsize(mount.Path(name))
+  rng = random.Random(42)
+  n = 0
+  start = time.perf_counter_ns()
+  with open(mount.Path(name), 'rb', buffering=0) as f:
+    for _ in range(max_random_reads):
+      n += len(os.pread(f.fileno(), 4 << 10, rng.randrange(size - (4 << 10))))
+  return time.perf_counter_ns() - start, n
+
+
+# Gets the benchmarks as (name, function) pairs. Each function mounts an
+# archive with the given program, performs its operations, and returns a
+# Result.
+def GetBenchmarks():
+  benchmarks = []
+
+  def Add(name, zip_name, options, operation=None):
+    def Run(program):
+      with Mount(program, zip_name, options) as mount:
+        if operation is None:
+          ns, n = mount.ns, 0
+        else:
+          ns, n = operation(mount)
+        return Result(ns, n, mount.PeakRss())
+
+    benchmarks.append((name, Run))
+
+  for strategy, options in strategies:
+    for zip_name in tree_zips:
+      Add(f'Mount/{zip_name}/{strategy}', zip_name, options)
+      Add(
+          f'Find/{zip_name}/{strategy}',
+          zip_name,
+          options,
+          lambda mount: (RunCommand(mount, ['find']), 0),
+      )
+      Add(
+          f'LsR/{zip_name}/{strategy}',
+          zip_name,
+          options,
+          lambda mount: (RunCommand(mount, ['ls', '-lR']), 0),
+      )
+
+    for name in read_files:
+      # Each read pattern gets a fresh mount, so that the data isn't already
+      # in the cache or in the kernel page cache.
+      Add(
+          f'ReadSequential/{name}/{strategy}',
+          read_zip,
+          options,
+          lambda mount, name=name: ReadSequential(mount, name),
+      )
+      Add(
+          f'ReadRandom/{name}/{strategy}',
+          read_zip,
+          options,
+          lambda mount, name=name: ReadRandom(mount, name),
+      )
+
+  return benchmarks
+
+
+# Gets the median of the given Results.
+def Median(results):
+  return Result(
+      statistics.median(r.ns for r in results),
+      results[0].bytes,
+      int(statistics.median(r.rss for r in results)),
+  )
+
+
+# Formats |result| in the Go benchmark format.
+def Format(name, result, runs):
+  s = f'{name} {runs} {result.ns:.1f} ns/op'
+  if result.bytes > 0:
+    s += f' {1e3 * result.bytes / max(result.ns, 1):.2f} MB/s'
+  if result.rss > 0:
+    s += f' {result.rss} peak-KB'
+  return s
+
+
+# Formats the relative difference between |new| and |old|.
+def Delta(new, old):
+  return f'{100 * (new - old) / old:+.1f}%' if old else '~'
+
+
+def main():
+  parser = argparse.ArgumentParser(
+      description='Benchmarks the mounted filesystem.'
+  )
+  parser.add_argument('--runs', type=int, default=3)
+  parser.add_argument('--program', default=mount_program)
+  parser.add_argument('--baseline')
+  parser.add_argument('filter', nargs='?', default='')
+  args = parser.parse_args()
+
+  for name, benchmark in GetBenchmarks():
+    if args.filter not in name:
+      continue
+
+    if not args.baseline:
+      results = [benchmark(args.program) for _ in range(args.runs)]
+      print(Format(name, Median(results), args.runs), flush=True)
+      continue
+
+    # Alternate between the programs, so that they run in similar conditions.
+    new_results, old_results = [], []
+    for _ in range(args.runs):
+      new_results.append(benchmark(args.program))
+      old_results.append(benchmark(args.baseline))
+
+    result, old = Median(new_results), Median(old_results)
+    print(
+        f'{name}: time {old.ns / 1e6:.1f} -> {result.ns / 1e6:.1f} ms'
+        f' ({Delta(result.ns, old.ns)}), peak RSS {old.rss} -> {result.rss} KB'
+        f' ({Delta(result.rss, old.rss)})',
+        flush=True,
+    )
+
+
+if __name__ == '__main__':
+  sys.exit(main())
@@ -24,6 +24,8 @@ import stat
 import subprocess
 import sys
 import tempfile
+import time
+import zipfile
 
 
 # Computes the MD5 hash of the given file.
@@ -1441,7 +1443,7 @@ def TestMasks():
 
 
 # Tests the ZIP with lots of files.
-def TestZipWithManyFiles():
+def TestZipWithManyFiles(options=[]):
   # Only check a few files: the first one, the last one, and one in the middle.
   want_tree = {
       '1': {
@@ -1471,6 +1473,7 @@ def TestZipWithManyFiles():
       want_inodes=65537,
       strict=False,
       use_md5=False,
+      options=options,
   )
 
   want_tree = {
@@ -1516,10 +1519,252 @@ def TestZipWithManyFiles():
       want_inodes=100014,
       strict=False,
       use_md5=False,
+      options=options,
   )
 
 
-# Tests that a big file can be accessed in random order.
+# Tests that the tree loaded from an index file is the same as the tree that was
+# built and saved to this index file.
+def TestIndexFile():
+  with tempfile.TemporaryDirectory() as index_dir:
+    for zip_name in [
+        'collisions.zip',
+        'file-dir-same-name.zip',
+        'hlink-chain.zip',
+        'mixed-paths.zip',
+        'sjis-filename.zip',
+        'symlink.zip',
+    ]:
+      index_path = os.path.join(index_dir, zip_name + '.index')
+      options = ['--force', f'--index={index_path}']
+      logging.info(f'Test {zip_name!r}, options = {" ".join(options)!r}')
+      try:
+        want_tree, want_st = MountZipAndGetTree(
+            zip_name, options=options, use_md5=False
+        )
+        if not os.path.exists(index_path):
+          LogError(f'Index file {index_path!r} was not created')
+          continue
+
+        got_tree, got_st = MountZipAndGetTree(
+            zip_name, options=options, use_md5=False
+        )
+        if got_st.f_blocks != want_st.f_blocks:
+          LogError(
+              f'Mismatch for st.f_blocks: got: {got_st.f_blocks}, want:'
+              f' {want_st.f_blocks}'
+          )
+
+        CheckTree(got_tree, want_tree, strict=True)
+      except subprocess.CalledProcessError as e:
+        LogError(f'Cannot test {zip_name}: {e.stderr}')
+
+
+# Tests that the byte ranges read are recorded to an access profile, and that
+# the same trees are obtained when warming the cache from this profile.
+def TestAccessProfile():
+  with tempfile.TemporaryDirectory() as profile_dir:
+    for zip_name in [
+        'hlink-chain.zip',
+        'mixed-paths.zip',
+        'symlink.zip',
+    ]:
+      for api in [[], ['--lowlevel']]:
+        profile_path = os.path.join(profile_dir, zip_name + '.profile')
+        options = ['--force', *api, f'--record={profile_path}']
+        logging.info(f'Test {zip_name!r}, options = {" ".join(options)!r}')
+        try:
+          want_tree, _ = MountZipAndGetTree(zip_name, options=options)
+
+          # The profile is saved once the daemon notices the lazy unmount.
+          for i in range(50):
+            if os.path.exists(profile_path):
+              break
+            time.sleep(0.1)
+          else:
+            LogError(f'Access profile {profile_path!r} was not created')
+            continue
+
+          with open(profile_path, 'rb') as f:
+            lines = f.read().splitlines()
+          if lines[0] != b'mount-zip access profile 1' or len(lines) < 2:
+            LogError(f'Unexpected access profile: {lines!r}')
+
+          options = ['--force', *api, f'--warm={profile_path}']
+          logging.info(f'Test {zip_name!r}, options = {" ".join(options)!r}')
+          got_tree, _ = MountZipAndGetTree(zip_name, options=options)
+          CheckTree(got_tree, want_tree, strict=True)
+          os.remove(profile_path)
+        except subprocess.CalledProcessError as e:
+          LogError(f'Cannot test {zip_name}: {e.stderr}')
+
+
+# Tests that mounting with the FUSE low-level API gives the same trees as with
+# the high-level API.
+def TestLowLevelApi():
+  for zip_name in [
+      '65536-files.zip',
+      'file-dir-same-name.zip',
+      'hlink-before-target.zip',
+      'hlink-chain.zip',
+      'mixed-paths.zip',
+      'not-full-path-deep.zip',
+      'pkware-symlink.zip',
+      'symlink.zip',
+  ]:
+    options = ['--force', '--lowlevel']
+    logging.info(f'Test {zip_name!r}, options = {" ".join(options)!r}')
+    try:
+      want_tree, want_st = MountZipAndGetTree(zip_name, options=['--force'])
+      got_tree, got_st = MountZipAndGetTree(zip_name, options=options)
+      for field in ['f_blocks', 'f_files']:
+        got = getattr(got_st, field)
+        want = getattr(want_st, field)
+        if got != want:
+          LogError(f'Mismatch for st.{field}: got: {got}, want: {want}')
+
+      CheckTree(got_tree, want_tree, strict=True)
+    except subprocess.CalledProcessError as e:
+      LogError(f'Cannot test {zip_name}: {e.stderr}')
+
+
+# Tests that mounting with the --lazy option gives the same trees, except for
+# the inode numbers and the times of the intermediate directories.
+def TestLazyTree():
+  def Strip(tree):
+    for entry in tree.values():
+      entry.pop('ino', None)
+      if entry['mode'].startswith('d'):
+        for key in ['atime', 'mtime', 'ctime']:
+          entry.pop(key, None)
+    return tree
+
+  for zip_name in [
+      '65536-files.zip',
+      'collisions.zip',
+      'file-dir-same-name.zip',
+      'hlink-before-target.zip',
+      'hlink-chain.zip',
+      'hlink-dir.zip',
+      'mixed-paths.zip',
+      'not-full-path-deep.zip',
+      'pkware-symlink.zip',
+      'symlink.zip',
+  ]:
+    for options in [
+        ['--force', '--lazy'],
+        ['--force', '--lazy', '--lowlevel'],
+        ['--force', '--lazy', '--threads=4'],
+    ]:
+      logging.info(f'Test {zip_name!r}, options = {" ".join(options)!r}')
+      try:
+        want_tree, want_st = MountZipAndGetTree(
+            zip_name, options=['--force'], use_md5=False
+        )
+        got_tree, got_st = MountZipAndGetTree(
+            zip_name, options=options, use_md5=False
+        )
+        for field in ['f_blocks', 'f_files']:
+          got = getattr(got_st, field)
+          want = getattr(want_st, field)
+          if got != want:
+            LogError(f'Mismatch for st.{field}: got: {got}, want: {want}')
+
+        CheckTree(Strip(got_tree), Strip(want_tree), strict=True)
+      except subprocess.CalledProcessError as e:
+        LogError(f'Cannot test {zip_name}: {e.stderr}')
+
+
+# Tests that mounting with the --lazy-attributes option gives the same trees.
+def TestLazyAttributes():
+  for zip_name in [
+      'extrafld.zip',
+      'hlink-chain.zip',
+      'ntfs-extrafld.zip',
+      'pkware-specials.zip',
+      'unix-perm.zip',
+      'with-and-without-precise-time.zip',
+  ]:
+    for options in [
+        ['--force', '-o', 'default_permissions'],
+        ['--force', '-o', 'default_permissions', '--lowlevel'],
+    ]:
+      got_options = options + ['--lazy-attributes']
+      logging.info(f'Test {zip_name!r}, options = {" ".join(got_options)!r}')
+      try:
+        want_tree, _ = MountZipAndGetTree(zip_name, options=options)
+        got_tree, _ = MountZipAndGetTree(zip_name, options=got_options)
+        CheckTree(got_tree, want_tree, strict=True)
+      except subprocess.CalledProcessError as e:
+        LogError(f'Cannot test {zip_name}: {e.stderr}')
+
+
+# Tests that the --verify and --scrub options detect the corrupted files, and
+# only them.
+def TestVerify():
+  # Neither --verify nor --scrub finds anything wrong in good ZIP archives.
+  for zip_name in ['mixed-paths.zip', 'symlink.zip', 'hlink-chain.zip']:
+    for options in [
+        ['--force', '--verify'],
+        ['--force', '--verify', '--verify-threads=4'],
+        ['--force', '--scrub', '--verify-threads=2'],
+    ]:
+      logging.info(f'Test {zip_name!r}, options = {" ".join(options)!r}')
+      try:
+        want_tree, _ = MountZipAndGetTree(zip_name, options=['--force'])
+        got_tree, _ = MountZipAndGetTree(zip_name, options=options)
+        CheckTree(got_tree, want_tree, strict=True)
+      except subprocess.CalledProcessError as e:
+        LogError(f'Cannot test {zip_name}: {e.stderr}')
+
+  # The encrypted files are checked too, including the ones encrypted with
+  # WinZip AES.
+  zip_name = 'different-encryptions.zip'
+  logging.info(f'Test {zip_name!r}, options = \'--verify\'')
+  try:
+    want_tree, _ = MountZipAndGetTree(zip_name, password='password')
+    got_tree, _ = MountZipAndGetTree(
+        zip_name, options=['--verify'], password='password'
+    )
+    CheckTree(got_tree, want_tree, strict=True)
+  except subprocess.CalledProcessError as e:
+    LogError(f'Cannot test {zip_name}: {e.stderr}')
+
+  CheckZipMountingError('bad-crc.zip', 17, options=['--verify'])
+
+  with tempfile.TemporaryDirectory() as zip_dir:
+    # A stored file is read directly from the ZIP archive, without checking its
+    # CRC-32. Corrupt one byte of its data.
+    zip_path = os.path.join(zip_dir, 'bad-stored.zip')
+    with zipfile.ZipFile(zip_path, 'w', zipfile.ZIP_STORED) as z:
+      z.writestr('good.txt', b'Good data\n')
+      z.writestr('bad.txt', b'Bad data\n')
+    with open(zip_path, 'r+b') as f:
+      data = f.read()
+      pos = data.index(b'Bad data')
+      f.seek(pos)
+      f.write(b'b')
+
+    CheckZipMountingError(zip_path, 17, options=['--verify'])
+    CheckZipMountingError(
+        zip_path, 17, options=['--verify', '--verify-threads=2']
+    )
+
+    MountZipAndCheckTree(
+        zip_path,
+        {
+            '.': {'ino': 1, 'mode': 'drwxr-xr-x', 'nlink': 2},
+            'good.txt': {
+                'size': 10,
+                'md5': hashlib.md5(b'Good data\n').hexdigest(),
+            },
+            'bad.txt': {'size': 9, 'errno': 5},
+        },
+        options=['--verify', '--force'],
+        strict=False,
+    )
+
+
 def TestBigZip(options=[]):
   zip_name = 'big.zip'
   s = f'Test {zip_name!r}'
@@ -1622,6 +1867,53 @@ def TestBigZipNoCache(options=['--nocache']):
       logging.debug(f'Unmounted {zip_path!r} from {mount_point!r}')
 
 
+# Tests several readers reading the same compressed file at the same time.
+def TestBigZipConcurrentReaders(options=['--nocache']):
+  zip_name = 'big.zip'
+  s = f'Test {zip_name!r} with concurrent readers'
+  if options:
+    s += f', options = {" ".join(options)!r}'
+  logging.info(s)
+  line = lambda j: b'%08d The quick brown fox jumps over the lazy dog.\n' % j
+  with tempfile.TemporaryDirectory() as mount_point:
+    zip_path = os.path.join(script_dir, 'data', zip_name)
+    logging.debug(f'Mounting {zip_path!r} on {mount_point!r}...')
+    subprocess.run(
+        [mount_program] + options + [zip_path, mount_point],
+        check=True,
+        capture_output=True,
+        input='',
+        encoding='UTF-8',
+    )
+    try:
+      logging.debug(f'Mounted ZIP {zip_path!r} on {mount_point!r}')
+      path = os.path.join(mount_point, 'big.txt')
+      fds = [os.open(path, os.O_RDONLY) for i in range(4)]
+      try:
+        # The readers follow each other at a short distance, and then the
+        # last one goes back to the beginning.
+        line_size = len(line(0))
+        chunk = 1000
+        for k in range(20):
+          for i, fd in enumerate(fds):
+            start = (k - i) * chunk
+            if start < 0:
+              continue
+            if i == len(fds) - 1 and k == 19:
+              start = 0
+            want = b''.join(line(j) for j in range(start, start + chunk))
+            got = os.pread(fd, len(want), start * line_size)
+            if got != want:
+              LogError(f'Reader {i}: Mismatch at line {start}')
+      finally:
+        for fd in fds:
+          os.close(fd)
+    finally:
+      logging.debug(f'Unmounting {zip_path!r} from {mount_point!r}...')
+      subprocess.run(['fusermount', '-u', '-z', mount_point], check=True)
+      logging.debug(f'Unmounted {zip_path!r} from {mount_point!r}')
+
+
 # Tests encrypted ZIP.
 def TestEncryptedZip():
   zip_name = 'different-encryptions.zip'
@@ -2230,9 +2522,41 @@ TestEncryptedZip()
 TestInvalidZip()
 TestMasks()
 TestZipWithManyFiles()
+TestIndexFile()
+TestLowLevelApi()
 TestBigZip()
 TestBigZip(options=['--precache'])
+TestBigZip(options=['--precache', '--precache-threads=4'])
+TestBigZip(options=['--threads=4'])
 TestBigZipNoCache()
+TestBigZip(options=['--seek-span=1'])
+TestBigZipNoCache(options=['--nocache', '--seek-span=1'])
+TestBigZip(options=['--lowlevel'])
+TestBigZip(options=['--lowlevel', '--threads=4'])
+TestBigZip(options=['-o', 'nokernelcache'])
+TestBigZip(options=['--lowlevel', '-o', 'nokernelcache,attr_timeout=0'])
+TestBigZipNoCache(options=['--cache-size=16'])
+TestBigZipNoCache(options=['--memcache', '--cache-size=16', '--threads=4'])
+TestBigZip(options=['--prefetch=128'])
+TestBigZipNoCache(options=['--nocache', '--prefetch=64', '--threads=4'])
+TestBigZip(options=['--precache', '--inflate=libzip'])
+TestBigZipNoCache(options=['--seek-span=1', '--cache-size=16', '--inflate-threads=4'])
+TestBigZip(options=['--slow-op=1'])
+TestZipWithManyFiles(options=['--parse-threads=4'])
+TestZipWithManyFiles(options=['--lazy'])
+TestZipWithManyFiles(options=['--lazy', '--threads=4'])
+TestLazyTree()
+TestLazyAttributes()
+TestVerify()
+TestBigZipConcurrentReaders()
+TestBigZipConcurrentReaders(
+    options=['--nocache', '--threads=4', '-o', 'nokernelcache']
+)
+TestBigZip(options=['--buffer-size=4096'])
+TestBigZipNoCache(options=['--nocache', '--buffer-size=256'])
+TestBigZip(options=['--read-ahead=256'])
+TestBigZipNoCache(options=['--nocache', '--read-ahead=64', '--threads=4'])
+TestAccessProfile()
 
 if error_count:
   LogError(f'FAIL: There were {error_count} errors')
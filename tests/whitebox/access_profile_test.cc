@@ -0,0 +1,99 @@
+// Copyright 2021 Google LLC
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "access_profile.h"
+
+using Range = AccessProfile::Range;
+
+bool operator==(const Range& a, const Range& b) {
+  return a.id == b.id && a.path == b.path && a.offset == b.offset &&
+         a.size == b.size;
+}
+
+void TestRecord() {
+  AccessProfile profile;
+  profile.Record(3, "a", 0, 100);
+  profile.Record(5, "dir/b", 1000, 10);
+  // Contiguous and overlapping reads extend the last range of the file.
+  profile.Record(3, "a", 100, 100);
+  profile.Record(3, "a", 150, 100);
+  // Reads contained in the last range are ignored.
+  profile.Record(3, "a", 10, 10);
+  // A jump starts a new range.
+  profile.Record(3, "a", 1000, 50);
+  profile.Record(5, "dir/b", 0, 10);
+  // Invalid reads are ignored.
+  profile.Record(-1, "", 0, 10);
+  profile.Record(5, "dir/b", 20, 0);
+
+  const std::vector<Range> want = {{3, "a", 0, 250},
+                                   {5, "dir/b", 1000, 10},
+                                   {3, "a", 1000, 50},
+                                   {5, "dir/b", 0, 10}};
+  assert(profile.ranges() == want);
+}
+
+void TestSaveAndLoad() {
+  char dir_template[] = "/tmp/access_profile_test_XXXXXX";
+  const char* const dir = mkdtemp(dir_template);
+  assert(dir);
+  const std::string path = std::string(dir) + "/profile";
+
+  AccessProfile profile;
+  profile.Record(1, "with spaces/file.txt", 0, 4096);
+  profile.Record(7, "big", 1 << 30, 131072);
+  profile.Record(2, "new\nline", 0, 10);
+  profile.Save(path.c_str());
+
+  // Paths containing a newline are not saved.
+  const std::vector<Range> want = {{1, "with spaces/file.txt", 0, 4096},
+                                   {7, "big", 1 << 30, 131072}};
+  assert(AccessProfile::Load(path.c_str()) == want);
+
+  // Bad files are rejected.
+  for (const char* const contents :
+       {"bad header\n", "mount-zip access profile 1\n1 2\n",
+        "mount-zip access profile 1\n1 2 x path\n",
+        "mount-zip access profile 1\n1 2 0 path\n",
+        "mount-zip access profile 1\n1 2 3 path"}) {
+    FILE* const f = std::fopen(path.c_str(), "w");
+    assert(f);
+    std::fputs(contents, f);
+    std::fclose(f);
+
+    try {
+      AccessProfile::Load(path.c_str());
+      std::abort();
+    } catch (const std::runtime_error&) {
+    }
+  }
+
+  unlink(path.c_str());
+  rmdir(dir);
+}
+
+int main() {
+  TestRecord();
+  TestSaveAndLoad();
+}
@@ -0,0 +1,93 @@
+// Copyright 2021 Google LLC
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include <cassert>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "arena.h"
+
+// Object keeping a pointer to itself and counting live instances.
+struct Node {
+  static int count;
+
+  int value;
+  const Node* self = this;
+
+  explicit Node(int value) : value(value) { ++count; }
+  Node(const Node&) = delete;
+  ~Node() { --count; }
+};
+
+int Node::count = 0;
+
+void TestArena() {
+  std::vector<Node*> nodes;
+  {
+    Arena<Node> arena;
+    for (int i = 0; i < 100000; ++i)
+      nodes.push_back(arena.New([i] { return Node(i); }));
+
+    assert(arena.size() == 100000);
+    assert(Node::count == 100000);
+    for (int i = 0; i < 100000; ++i) {
+      assert(nodes[i]->value == i);
+      assert(nodes[i]->self == nodes[i]);
+    }
+
+    // Failed construction.
+    try {
+      arena.New([]() -> Node { throw std::runtime_error("Oops"); });
+      assert(false);
+    } catch (const std::runtime_error&) {
+    }
+
+    assert(arena.size() == 100000);
+    arena.Clear();
+    assert(arena.size() == 0);
+    assert(Node::count == 0);
+
+    arena.New([] { return Node(1); });
+    assert(Node::count == 1);
+  }
+
+  assert(Node::count == 0);
+}
+
+void TestStringPool() {
+  StringPool pool;
+  std::vector<std::string_view> views;
+  for (int i = 0; i < 100000; ++i)
+    views.push_back(pool.Add(std::to_string(i)));
+
+  const std::string big(100000, 'x');
+  const std::string_view s = pool.Add(big);
+  assert(s == big);
+  assert(s.data() != big.data());
+  assert(s.data()[s.size()] == '\0');
+  assert(pool.Add("").empty());
+
+  for (int i = 0; i < 100000; ++i) {
+    assert(views[i] == std::to_string(i));
+    assert(views[i].data()[views[i].size()] == '\0');
+  }
+}
+
+int main() {
+  TestArena();
+  TestStringPool();
+}
@@ -0,0 +1,165 @@
+// Copyright 2021 Google LLC
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include <cassert>
+#include <vector>
+
+#include "block_cache.h"
+
+using Block = BlockCache::Block;
+using Key = BlockCache::Key;
+
+// Adds the block |key| to |cache| and returns its slot.
+i64 Add(BlockCache* const cache, const Key& key, const ssize_t size = 100) {
+  const i64 slot = cache->Reserve();
+  cache->Put(key, slot, size);
+  cache->Release(slot);
+  return slot;
+}
+
+void TestUnlimited() {
+  BlockCache cache;
+  for (i64 i = 0; i < 100; ++i)
+    assert(Add(&cache, {1, i}) == i);
+
+  assert(cache.slot_count() == 100);
+  assert(cache.block_count() == 100);
+
+  Block block;
+  for (i64 i = 0; i < 100; ++i) {
+    assert(cache.Get({1, i}, &block));
+    assert(block.slot == i);
+    assert(block.size == 100);
+    cache.Release(block.slot);
+  }
+
+  assert(!cache.Get({2, 0}, &block));
+  assert(!cache.Get({1, 100}, &block));
+}
+
+void TestEviction() {
+  BlockCache cache(3);
+  const i64 a = Add(&cache, {1, 0});
+  const i64 b = Add(&cache, {1, 1});
+  const i64 c = Add(&cache, {2, 0});
+  assert(cache.slot_count() == 3);
+
+  // Use block a, so that b becomes the least recently used block.
+  Block block;
+  assert(cache.Get({1, 0}, &block));
+  assert(block.slot == a);
+  cache.Release(block.slot);
+
+  // Block b gets evicted.
+  assert(Add(&cache, {3, 0}, 10) == b);
+  assert(cache.slot_count() == 3);
+  assert(cache.block_count() == 3);
+  assert(!cache.Get({1, 1}, &block));
+  assert(cache.Get({3, 0}, &block));
+  assert(block.slot == b);
+  assert(block.size == 10);
+  cache.Release(block.slot);
+
+  // Pinned blocks are not evicted.
+  assert(cache.Get({2, 0}, &block));
+  assert(block.slot == c);
+  const i64 d = Add(&cache, {4, 0});
+  assert(d == a);
+  assert(cache.Get({2, 0}, &block));
+  cache.Release(block.slot);
+  cache.Release(block.slot);
+
+  // All the blocks are pinned: go over budget.
+  Block pinned[3];
+  assert(cache.Get({2, 0}, &pinned[0]));
+  assert(cache.Get({3, 0}, &pinned[1]));
+  assert(cache.Get({4, 0}, &pinned[2]));
+  const i64 e = cache.Reserve();
+  assert(e == 3);
+  assert(cache.slot_count() == 4);
+
+  // A reserved slot that isn't used becomes free again.
+  cache.Release(e);
+  assert(cache.Reserve() == e);
+  cache.Release(e);
+  for (const Block& block : pinned)
+    cache.Release(block.slot);
+}
+
+void TestRemove() {
+  BlockCache cache(2);
+  const i64 a = Add(&cache, {1, 0});
+  const i64 b = Add(&cache, {1, 1});
+
+  // Removing a pinned block only frees its slot once it's unpinned.
+  Block block;
+  assert(cache.Get({1, 1}, &block));
+  cache.Remove({1, 1});
+  cache.Remove({1, 2});
+  assert(!cache.Get({1, 1}, &block));
+  assert(cache.block_count() == 1);
+
+  cache.Remove({1, 0});
+  assert(cache.block_count() == 0);
+  assert(cache.Reserve() == a);
+  cache.Release(b);
+  assert(cache.Reserve() == b);
+  assert(cache.slot_count() == 2);
+  cache.Release(a);
+  cache.Release(b);
+}
+
+void TestFreeSlot() {
+  std::vector<i64> freed;
+  BlockCache cache(0, [&freed](const i64 slot) { freed.push_back(slot); });
+  for (i64 i = 0; i < 4; ++i)
+    assert(Add(&cache, {1, i}) == i);
+
+  // Free slots are reported.
+  cache.Remove({1, 2});
+  cache.Remove({1, 0});
+  assert((freed == std::vector<i64>{2, 0}));
+
+  // A removed block that is pinned is only reported once unpinned.
+  Block block;
+  assert(cache.Get({1, 3}, &block));
+  cache.Remove({1, 3});
+  assert(freed.size() == 2);
+  cache.Release(block.slot);
+  assert((freed == std::vector<i64>{2, 0, 3}));
+
+  // The free slots with the lowest indices are reused first.
+  assert(cache.Reserve() == 0);
+  assert(cache.Reserve() == 2);
+  assert(cache.Reserve() == 3);
+  assert(cache.Reserve() == 4);
+  assert(cache.slot_count() == 5);
+
+  // A reserved slot that isn't used is reported when released.
+  cache.Release(2);
+  assert(freed.back() == 2);
+  assert(cache.Reserve() == 2);
+  freed.clear();
+  for (const i64 slot : {0, 2, 3, 4})
+    cache.Release(slot);
+  assert((freed == std::vector<i64>{0, 2, 3, 4}));
+}
+
+int main() {
+  TestUnlimited();
+  TestEviction();
+  TestRemove();
+  TestFreeSlot();
+}
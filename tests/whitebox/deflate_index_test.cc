@@ -0,0 +1,172 @@
+// Copyright 2021 Google LLC
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+#include <zip.h>
+#include <zlib.h>
+
+#include "deflate_index.h"
+#include "error.h"
+
+// Generates |n| bytes of mildly compressible data.
+std::string MakeData(const size_t n) {
+  std::string data;
+  data.reserve(n + 100);
+  for (int i = 0; data.size() < n; ++i) {
+    data += std::to_string(i * 7919 % 100003);
+    data += i % 3 ? " The quick brown fox jumps over the lazy dog.\n" : "\n";
+  }
+
+  data.resize(n);
+  return data;
+}
+
+// Compresses |data| as a raw deflate stream.
+std::string Deflate(const std::string_view data) {
+  z_stream stream = {};
+  [[maybe_unused]] int ret =
+      deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+                   Z_DEFAULT_STRATEGY);
+  assert(ret == Z_OK);
+
+  std::string out(deflateBound(&stream, data.size()), '\0');
+  stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+  stream.avail_in = data.size();
+  stream.next_out = reinterpret_cast<Bytef*>(out.data());
+  stream.avail_out = out.size();
+  ret = deflate(&stream, Z_FINISH);
+  assert(ret == Z_STREAM_END);
+  out.resize(stream.total_out);
+  deflateEnd(&stream);
+  return out;
+}
+
+uLong Crc(const std::string_view data) {
+  return crc32(crc32(0, Z_NULL, 0), reinterpret_cast<const Bytef*>(data.data()),
+               data.size());
+}
+
+// Source reading compressed data from a string.
+struct StringSource {
+  std::string_view data;
+  size_t pos = 0;
+
+  ssize_t operator()(Bytef* const dest, const ssize_t size) {
+    const size_t n = data.copy(reinterpret_cast<char*>(dest), size,
+                               std::min(pos, data.size()));
+    pos += n;
+    return n;
+  }
+};
+
+void TestSequentialRead() {
+  const std::string data = MakeData(5 << 20);
+  const std::string compressed = Deflate(data);
+  DeflateIndex index(1 << 20, Crc(data));
+  Inflater inflater(&index);
+  StringSource source{compressed};
+
+  std::string got;
+  char buf[10000];
+  while (const ssize_t n = inflater.Read(buf, sizeof(buf), std::ref(source)))
+    got.append(buf, n);
+
+  assert(got == data);
+  assert(inflater.pos() == data.size());
+  assert(index.size() >= 2);
+  assert(index.size() <= 5);
+  assert(!index.Find(0));
+  assert(!index.Find((1 << 20) - 1));
+}
+
+void TestRandomRead() {
+  const std::string data = MakeData(5 << 20);
+  const std::string compressed = Deflate(data);
+  DeflateIndex index(1 << 20, Crc(data));
+
+  // Build the index.
+  {
+    Inflater inflater(&index);
+    StringSource source{compressed};
+    char buf[10000];
+    while (inflater.Read(buf, sizeof(buf), std::ref(source))) {
+    }
+  }
+
+  Inflater inflater(&index);
+  for (const off_t offset : {off_t(4 << 20), off_t(1 << 20) + 12345,
+                             off_t(data.size() - 1), off_t(17), off_t(3 << 20)}) {
+    const DeflateIndex::Point* const point = index.Find(offset);
+    assert(!point || point->out <= offset);
+    inflater.Reset(point);
+    StringSource source{compressed, point ? size_t(point->in) : 0};
+    assert(inflater.pos() == (point ? point->out : 0));
+
+    // Skip to the requested offset.
+    std::string got(offset - inflater.pos(), '\0');
+    assert(inflater.Read(got.data(), got.size(), std::ref(source)) ==
+           got.size());
+    assert(got == data.substr(inflater.pos() - got.size(), got.size()));
+
+    // Read a few bytes.
+    got.resize(100);
+    got.resize(inflater.Read(got.data(), got.size(), std::ref(source)));
+    assert(got == data.substr(offset, 100));
+  }
+}
+
+void TestBadCrc() {
+  const std::string data = MakeData(100000);
+  const std::string compressed = Deflate(data);
+  DeflateIndex index(1 << 20, Crc(data) ^ 1);
+  Inflater inflater(&index);
+  StringSource source{compressed};
+
+  try {
+    std::string got(data.size() + 1, '\0');
+    inflater.Read(got.data(), got.size(), std::ref(source));
+    assert(false);
+  } catch (const ZipError& e) {
+    assert(e.code() == ZIP_ER_CRC);
+  }
+}
+
+void TestTruncatedData() {
+  const std::string data = MakeData(100000);
+  const std::string compressed = Deflate(data);
+  DeflateIndex index(1 << 20, Crc(data));
+  Inflater inflater(&index);
+  StringSource source{std::string_view(compressed).substr(0, 1000)};
+
+  try {
+    std::string got(data.size(), '\0');
+    inflater.Read(got.data(), got.size(), std::ref(source));
+    assert(false);
+  } catch (const ZipError& e) {
+    assert(e.code() == ZIP_ER_INCONS);
+  }
+}
+
+int main() {
+  TestSequentialRead();
+  TestRandomRead();
+  TestBadCrc();
+  TestTruncatedData();
+}
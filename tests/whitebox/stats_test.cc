@@ -0,0 +1,78 @@
+// Copyright 2021 Google LLC
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include <cassert>
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include "stats.h"
+
+void TestToString() {
+  Stats stats;
+  Count(stats.rewinds, 1234567);
+  Count(stats.lookup_hits);
+  Count(stats.lookup_hits);
+
+  const std::string s = stats.ToString();
+  assert(s.starts_with("string_reader_bytes 0\n"));
+  assert(s.find("\nrewinds 1234567\n") != std::string::npos);
+  assert(s.find("\nlookup_hits 2\n") != std::string::npos);
+  assert(s.find("\nlookup_misses 0\n") != std::string::npos);
+  assert(s.ends_with("\ncache_file_reader_latency_p999_ns 0\n"));
+}
+
+void TestHistogram() {
+  Histogram h;
+  assert(h.count() == 0);
+  assert(h.Quantile(0.5) == 0);
+
+  for (int i = 0; i < 990; ++i)
+    h.Add(1000);
+  for (int i = 0; i < 10; ++i)
+    h.Add(1000000);
+
+  assert(h.count() == 1000);
+  // The upper bounds are within 25% of the recorded durations.
+  assert(h.Quantile(0.5) >= 1000);
+  assert(h.Quantile(0.5) < 1250);
+  assert(h.Quantile(0.99) == h.Quantile(0.5));
+  assert(h.Quantile(0.999) >= 1000000);
+  assert(h.Quantile(0.999) < 1250000);
+  assert(h.Quantile(1) == h.Quantile(0.999));
+
+  // Small and negative durations.
+  Histogram g;
+  g.Add(-5);
+  g.Add(0);
+  g.Add(3);
+  assert(g.Quantile(0.5) == 0);
+  assert(g.Quantile(1) == 3);
+}
+
+void TestScopedTime() {
+  Stats stats;
+  {
+    const ScopedTime timer(stats.inflate_ns);
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  assert(stats.inflate_ns >= 1000000);
+}
+
+int main() {
+  TestToString();
+  TestHistogram();
+  TestScopedTime();
+}
@@ -0,0 +1,141 @@
+// Copyright 2021 Google LLC
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include <cassert>
+#include <cstdio>
+#include <string>
+#include <string_view>
+
+#include "winzip_aes.h"
+
+// Converts the hexadecimal string |hex| to bytes.
+static std::string FromHex(const std::string_view hex) {
+  assert(hex.size() % 2 == 0);
+  std::string s;
+  for (size_t i = 0; i < hex.size(); i += 2)
+    s += static_cast<char>(std::stoi(std::string(hex.substr(i, 2)), nullptr,
+                                     16));
+  return s;
+}
+
+// Encrypted data of the files of tests/blackbox/data/different-encryptions.zip,
+// with their header and authentication code, and their decrypted contents.
+struct Case {
+  zip_uint16_t method;
+  std::string_view data;
+  std::string_view want;
+};
+
+static const Case cases[] = {
+    {ZIP_EM_AES_128,
+     "a7070fbe2cdc12c31d631ddb40301d65e879065f44eb590956b400148dbf0b2a"
+     "068531d9a4752cfc12a0d4244ba5a0b3e12dc283",
+     "This is encrypted with AES-128.\n"},
+    {ZIP_EM_AES_192,
+     "427f8297b71abfcc224f50164fe2a2a9f3de7909e21a6a0da7bd84f3ab373bea"
+     "a983e857798127825abfd7a421780b97519516365c5533a5",
+     "This is encrypted with AES-192.\n"},
+    {ZIP_EM_AES_256,
+     "10c9ce1b01e4083d53b8543d27331a5667705410a40013ad4bac90bb7b5ceb03"
+     "7fcafc116b138d871d6a202c69ff535854f4c68983ec32a9d482bbba",
+     "This is encrypted with AES-256.\n"},
+};
+
+#ifdef WITH_OPENSSL
+// Writes |contents| to a temporary file, and checks the authentication code of
+// the |size| bytes at |offset| in it.
+static bool Authenticate(const WinZipAes& aes,
+                         const std::string_view contents,
+                         const off_t offset,
+                         const off_t size) {
+  FILE* const f = std::tmpfile();
+  assert(f);
+  [[maybe_unused]] const size_t n =
+      std::fwrite(contents.data(), 1, contents.size(), f);
+  assert(n == contents.size());
+  [[maybe_unused]] const int err = std::fflush(f);
+  assert(err == 0);
+  const bool ok = aes.Authenticate(fileno(f), offset, size);
+  std::fclose(f);
+  return ok;
+}
+#endif
+
+void TestHeaderSize() {
+  assert(WinZipAes::GetHeaderSize(ZIP_EM_AES_128) == 10);
+  assert(WinZipAes::GetHeaderSize(ZIP_EM_AES_192) == 14);
+  assert(WinZipAes::GetHeaderSize(ZIP_EM_AES_256) == 18);
+  assert(WinZipAes::GetHeaderSize(ZIP_EM_TRAD_PKWARE) == 0);
+  assert(WinZipAes::GetHeaderSize(ZIP_EM_NONE) == 0);
+}
+
+void TestDecrypt() {
+  for (const Case& c : cases) {
+    const std::string data = FromHex(c.data);
+    const ssize_t header_size = WinZipAes::GetHeaderSize(c.method);
+    const std::string_view header =
+        std::string_view(data).substr(0, header_size);
+    const std::string encrypted =
+        data.substr(header_size, data.size() - header_size -
+                                     WinZipAes::trailer_size);
+    assert(encrypted.size() == c.want.size());
+
+#ifdef WITH_OPENSSL
+    // A wrong password is detected by the password verifier.
+    assert(!WinZipAes::Make(c.method, "wrong", header));
+    // So is a truncated header.
+    assert(!WinZipAes::Make(c.method, "password", header.substr(1)));
+
+    const WinZipAes::Ptr aes = WinZipAes::Make(c.method, "password", header);
+    assert(aes);
+
+    // Decrypt everything at once.
+    const WinZipAes::Decryptor::Ptr decryptor = aes->MakeDecryptor();
+    std::string s = encrypted;
+    decryptor->Decrypt(s.data(), s.size(), 0);
+    assert(s == c.want);
+
+    // Decrypt in pieces, starting from the end, across block boundaries, with
+    // another Decryptor.
+    const WinZipAes::Decryptor::Ptr other = aes->MakeDecryptor();
+    s = encrypted;
+    for (ssize_t end = s.size(); end > 0;) {
+      const ssize_t start = end > 5 ? end - 5 : 0;
+      other->Decrypt(s.data() + start, end - start, start);
+      end = start;
+    }
+    assert(s == c.want);
+
+    // Check the authentication code, and detect a corrupted byte.
+    std::string file = data;
+    const off_t offset = header_size;
+    const off_t size = encrypted.size();
+    assert(Authenticate(*aes, file, offset, size));
+    file[offset + 7] ^= 1;
+    assert(!Authenticate(*aes, file, offset, size));
+    file = data;
+    file[file.size() - 1] ^= 1;
+    assert(!Authenticate(*aes, file, offset, size));
+#else
+    // Not supported without OpenSSL.
+    assert(!WinZipAes::Make(c.method, "password", header));
+#endif
+  }
+}
+
+int main() {
+  TestHeaderSize();
+  TestDecrypt();
+}